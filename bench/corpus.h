@@ -0,0 +1,157 @@
+// Request corpus shared by microbench and loadgen.
+//
+// One JSON object per line, in the requests.jsonl format:
+//   {"request_id": "...", "title": "...", "body": "<raw HTTP request>"}
+// Only "request_id" and "body" are used; other keys are skipped. Bodies
+// are JSON strings, so CRLFs are written as "\r\n".
+
+#ifndef BENCH_CORPUS_H
+#define BENCH_CORPUS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char id[64];
+    char* data;             // Raw request bytes, NUL-terminated
+    size_t len;
+} CorpusEntry;
+
+typedef struct {
+    CorpusEntry* entries;
+    int count;
+} Corpus;
+
+static void corpus_put_utf8(char** out, unsigned cp) {
+    char* o = *out;
+    if (cp < 0x80) {
+        *o++ = (char)cp;
+    } else if (cp < 0x800) {
+        *o++ = (char)(0xc0 | (cp >> 6));
+        *o++ = (char)(0x80 | (cp & 0x3f));
+    } else {
+        *o++ = (char)(0xe0 | (cp >> 12));
+        *o++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *o++ = (char)(0x80 | (cp & 0x3f));
+    }
+    *out = o;
+}
+
+// Decode the JSON string starting after its opening quote into out (which
+// has room for at least as many bytes as the input); returns the position
+// after the closing quote, or NULL
+static const char* corpus_json_string(const char* p, char* out, size_t* out_len) {
+    char* o = out;
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            *o++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'u': {
+                unsigned cp = 0;
+                for (int i = 1; i <= 4; i++) {
+                    char c = p[i];
+                    cp <<= 4;
+                    if (c >= '0' && c <= '9') cp |= c - '0';
+                    else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+                    else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+                    else return NULL;
+                }
+                corpus_put_utf8(&o, cp); // Surrogate pairs are not combined
+                p += 4;
+                break;
+            }
+            case '\0': return NULL;
+            default: *o++ = *p; break; // \" \\ \/
+        }
+        p++;
+    }
+    if (*p != '"') return NULL;
+    *o = '\0';
+    *out_len = (size_t)(o - out);
+    return p + 1;
+}
+
+// Pull "request_id" and "body" out of one line; false if there is no body
+static bool corpus_parse_line(const char* line, CorpusEntry* e) {
+    size_t len = strlen(line);
+    char* scratch = malloc(len + 1);
+    if (!scratch) return false;
+    bool have_body = false;
+    e->id[0] = '\0';
+
+    const char* p = line;
+    while ((p = strchr(p, '"'))) {
+        size_t key_len;
+        p = corpus_json_string(p + 1, scratch, &key_len);
+        if (!p) break;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p != ':') continue; // A string value, not a key
+        p++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p != '"') continue; // Non-string value, skipped by the next strchr
+        bool is_id = strcmp(scratch, "request_id") == 0;
+        bool is_body = strcmp(scratch, "body") == 0;
+        size_t value_len;
+        p = corpus_json_string(p + 1, scratch, &value_len);
+        if (!p) break;
+        if (is_id) {
+            snprintf(e->id, sizeof(e->id), "%s", scratch);
+        } else if (is_body && !have_body) {
+            e->data = malloc(value_len + 1);
+            if (!e->data) break;
+            memcpy(e->data, scratch, value_len + 1);
+            e->len = value_len;
+            have_body = true;
+        }
+    }
+    free(scratch);
+    return have_body;
+}
+
+// Load path into c; prints the reason and returns false on failure
+static bool corpus_load(const char* path, Corpus* c) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    c->entries = NULL;
+    c->count = 0;
+    int capacity = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, f) > 0) {
+        CorpusEntry e;
+        if (!corpus_parse_line(line, &e)) continue;
+        if (c->count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            CorpusEntry* grown = realloc(c->entries, capacity * sizeof(CorpusEntry));
+            if (!grown) {
+                free(e.data);
+                break;
+            }
+            c->entries = grown;
+        }
+        if (e.id[0] == '\0') snprintf(e.id, sizeof(e.id), "line-%d", c->count + 1);
+        c->entries[c->count++] = e;
+    }
+    free(line);
+    fclose(f);
+    if (c->count == 0) {
+        fprintf(stderr, "%s: no entries with a \"body\"\n", path);
+        return false;
+    }
+    return true;
+}
+
+#endif // BENCH_CORPUS_H
@@ -0,0 +1,552 @@
+// HTTP/1.1 load generator: keep-alive connections spread over threads,
+// one request in flight per connection.
+//
+//   loadgen [-c conns] [-t threads] [-d seconds] [-R rate] [-p path]...
+//           [-f corpus.jsonl] host:port
+//
+// Closed loop (default): each connection sends its next request as soon
+// as the previous response is in, so throughput is what the server
+// sustains. Latency is measured from the actual send, and a second row is
+// corrected for coordinated omission the way HdrHistogram does it: every
+// sample longer than the mean interval also stands for the requests the
+// stalled connection did not send meanwhile.
+//
+// Open loop (-R): requests are scheduled at a fixed total rate whether or
+// not earlier ones finished, and latency is measured from the scheduled
+// send time, so queueing in the server (or in this client) is counted
+// instead of hidden.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+#define MAX_PATHS 64
+#define MAX_THREADS 64
+#define RBUF_INITIAL 16384
+
+// ============= Histogram =============
+
+// Log-linear: exact below 128 ns, then 64 linear sub-buckets per power of
+// two (under 1.6% error), up to 2^41 ns (about 36 minutes)
+#define HIST_SUB 64
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - 4) * HIST_SUB) // Power 2^e starts at (e - 5) * HIST_SUB
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+static int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    return (e - 6) * HIST_SUB + (int)(v >> (e - 6));
+}
+
+// Midpoint of bucket i
+static uint64_t hist_value(int i) {
+    if (i < 2 * HIST_SUB) return (uint64_t)i;
+    int e = i / HIST_SUB + 5;
+    uint64_t low = (uint64_t)(i - (e - 6) * HIST_SUB) << (e - 6);
+    return low + ((1ull << (e - 6)) >> 1);
+}
+
+static void hist_record_n(Histogram* h, uint64_t v, uint64_t n) {
+    h->counts[hist_index(v)] += n;
+    h->total += n;
+    h->sum += (double)v * n;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(Histogram* into, const Histogram* h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static uint64_t hist_percentile(const Histogram* h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// A copy where each sample v above interval adds v - interval,
+// v - 2 * interval, ... (HdrHistogram's copyCorrectedForCoordinatedOmission)
+static void hist_correct(Histogram* out, const Histogram* h, uint64_t interval) {
+    *out = *h;
+    if (interval == 0) return;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] == 0) continue;
+        uint64_t v = hist_value(i);
+        for (uint64_t missing = v > interval ? v - interval : 0; missing >= interval; missing -= interval) {
+            hist_record_n(out, missing, h->counts[i]);
+        }
+    }
+}
+
+// ============= Connections =============
+
+typedef struct {
+    const char* data;
+    size_t len;
+} Request;
+
+typedef struct {
+    int fd;
+    bool connecting;
+    bool busy;              // A request is out, its response not complete
+    bool close_after;       // Response said Connection: close
+    const Request* req;
+    size_t sent;
+    uint64_t start_ns;      // Send time (closed) or scheduled time (open)
+    uint64_t due_ns;        // Open loop: when the next request is scheduled
+    uint64_t retry_ns;      // Reconnect backoff after a failed connect
+    char* rbuf;
+    size_t rlen, rcap;
+    int next_req;
+} Conn;
+
+typedef struct {
+    pthread_t thread;
+    int epfd;
+    int timer_fd;           // Wakes the loop for the next open-loop slot
+    Conn* conns;
+    int conn_count;
+    int first;              // Index of conns[0] among all connections
+    Histogram hist;
+    uint64_t requests, errors, non_2xx, bytes;
+} Thread;
+
+static struct {
+    struct addrinfo* addr;
+    Request requests[4096];
+    int request_count;
+    int conns;
+    int threads;
+    double duration;
+    double rate;            // Total requests per second, 0 = closed loop
+    uint64_t interval_ns;   // Open loop, per connection
+    uint64_t start_ns;
+    uint64_t end_ns;
+} opt = {.conns = 16, .threads = 2, .duration = 5};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool conn_open(Thread* t, Conn* c) {
+    c->fd = socket(opt.addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, opt.addr->ai_addr, opt.addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->connecting = true;
+    c->rlen = 0;
+    c->close_after = false;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP, .data.ptr = c};
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return true;
+}
+
+static void conn_close(Conn* c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->busy = false;
+}
+
+static void conn_want_write(Thread* t, Conn* c, bool on) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_flush(Thread* t, Conn* c) {
+    while (c->sent < c->req->len) {
+        ssize_t n = send(c->fd, c->req->data + c->sent, c->req->len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                conn_want_write(t, c, true);
+                return;
+            }
+            t->errors++;
+            conn_close(c);
+            return;
+        }
+        c->sent += n;
+    }
+    conn_want_write(t, c, false);
+}
+
+// Start the next request; start_ns is when it counts from
+static void conn_send(Thread* t, Conn* c, uint64_t start_ns) {
+    if (c->fd < 0 && !conn_open(t, c)) {
+        t->errors++;
+        c->retry_ns = now_ns() + 10000000;
+        return;
+    }
+    c->req = &opt.requests[c->next_req];
+    c->next_req = (c->next_req + 1) % opt.request_count;
+    c->sent = 0;
+    c->busy = true;
+    c->start_ns = start_ns;
+    if (!c->connecting) conn_flush(t, c);
+}
+
+// Value of header name (case-insensitive) and its length, or NULL
+static const char* find_header(const char* head, size_t head_len, const char* name, size_t* len) {
+    size_t name_len = strlen(name);
+    const char* end = head + head_len;
+    for (const char* p = memchr(head, '\n', head_len); p && p + 1 < end; p = memchr(p + 1, '\n', end - p - 1)) {
+        const char* line = p + 1;
+        if ((size_t)(end - line) > name_len && strncasecmp(line, name, name_len) == 0 &&
+            line[name_len] == ':') {
+            const char* v = line + name_len + 1;
+            while (v < end && *v == ' ') v++;
+            const char* eol = memchr(v, '\r', end - v);
+            *len = eol ? (size_t)(eol - v) : 0;
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// Length of the complete response at the start of rbuf, 0 if incomplete,
+// -1 if malformed. at_eof: the peer closed (ends close-delimited bodies).
+static ssize_t response_length(Conn* c, int* status, bool at_eof) {
+    char* head_end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+    if (!head_end) return 0;
+    size_t head_len = head_end + 4 - c->rbuf;
+    if (c->rlen < 12 || memcmp(c->rbuf, "HTTP/1.", 7) != 0) return -1;
+    *status = atoi(c->rbuf + 9);
+
+    size_t vlen;
+    const char* v = find_header(c->rbuf, head_len, "Connection", &vlen);
+    c->close_after = (v && vlen >= 5 && strncasecmp(v, "close", 5) == 0) ||
+                     (c->rbuf[7] == '0' && !(v && strncasecmp(v, "keep-alive", 10) == 0));
+    if (*status == 204 || *status == 304 || (*status >= 100 && *status < 200)) return head_len;
+
+    v = find_header(c->rbuf, head_len, "Content-Length", &vlen);
+    if (v) {
+        size_t total = head_len + strtoull(v, NULL, 10);
+        return c->rlen >= total ? (ssize_t)total : 0;
+    }
+    v = find_header(c->rbuf, head_len, "Transfer-Encoding", &vlen);
+    if (v && vlen >= 7 && strncasecmp(v + vlen - 7, "chunked", 7) == 0) {
+        size_t pos = head_len;
+        for (;;) {
+            char* eol = memmem(c->rbuf + pos, c->rlen - pos, "\r\n", 2);
+            if (!eol) return 0;
+            size_t size = strtoull(c->rbuf + pos, NULL, 16);
+            pos = eol + 2 - c->rbuf;
+            if (size == 0) {
+                // Trailers end with an empty line
+                char* end = memmem(c->rbuf + pos - 2, c->rlen - pos + 2, "\r\n\r\n", 4);
+                return end ? end + 4 - c->rbuf : 0;
+            }
+            if (c->rlen < pos + size + 2) return 0;
+            pos += size + 2;
+        }
+    }
+    c->close_after = true;
+    return at_eof ? (ssize_t)c->rlen : 0;
+}
+
+// Account for a finished response and schedule the next request
+static void conn_complete(Thread* t, Conn* c, int status, size_t len, uint64_t now) {
+    if (now < opt.end_ns) {
+        hist_record_n(&t->hist, now - c->start_ns, 1);
+        t->requests++;
+        t->bytes += len;
+        if (status < 200 || status > 299) t->non_2xx++;
+    }
+    c->busy = false;
+    memmove(c->rbuf, c->rbuf + len, c->rlen - len);
+    c->rlen -= len;
+    if (c->close_after) conn_close(c);
+
+    if (opt.rate > 0) {
+        // Late requests are sent now but still count from their slot
+        c->due_ns += opt.interval_ns;
+        if (c->due_ns <= now) conn_send(t, c, c->due_ns);
+    } else {
+        conn_send(t, c, now);
+    }
+}
+
+static void conn_readable(Thread* t, Conn* c) {
+    bool eof = false;
+    for (;;) {
+        if (c->rcap - c->rlen < 4096) {
+            size_t cap = c->rcap * 2;
+            char* grown = realloc(c->rbuf, cap);
+            if (!grown) break;
+            c->rbuf = grown;
+            c->rcap = cap;
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+        if (n > 0) {
+            c->rlen += n;
+            continue;
+        }
+        if (n == 0) eof = true;
+        else if (errno != EAGAIN) eof = true;
+        break;
+    }
+
+    int status = 0;
+    ssize_t len = c->busy ? response_length(c, &status, eof) : 0;
+    if (len > 0) {
+        if (eof) c->close_after = true;
+        conn_complete(t, c, status, (size_t)len, now_ns());
+    } else if (eof || len < 0) {
+        // The main loop reopens it; a lost open-loop request gives up its slot
+        if (c->busy && now_ns() < opt.end_ns) t->errors++;
+        if (c->busy) c->due_ns += opt.interval_ns;
+        conn_close(c);
+    }
+}
+
+static void* thread_main(void* arg) {
+    Thread* t = arg;
+    struct epoll_event events[256];
+    struct epoll_event timer_ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timer_fd, &timer_ev);
+
+    for (int i = 0; i < t->conn_count; i++) {
+        Conn* c = &t->conns[i];
+        c->fd = -1;
+        c->rcap = RBUF_INITIAL;
+        c->rbuf = malloc(c->rcap);
+        c->next_req = (t->first + i) % opt.request_count;
+        // Open loop: spread the first sends over one interval
+        c->due_ns = opt.start_ns + opt.interval_ns * (uint64_t)(t->first + i) / opt.conns;
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= opt.end_ns) break;
+
+        // Idle connections: closed loop sends at once (this also reopens
+        // closed ones), open loop when the slot is due
+        uint64_t wake = opt.end_ns;
+        for (int i = 0; i < t->conn_count; i++) {
+            Conn* c = &t->conns[i];
+            if (c->busy) continue;
+            uint64_t due = opt.rate > 0 ? c->due_ns : now;
+            if (c->fd < 0 && c->retry_ns > due) due = c->retry_ns;
+            if (due <= now) conn_send(t, c, opt.rate > 0 ? c->due_ns : now);
+            else if (due < wake) wake = due;
+        }
+        // epoll_wait() only has millisecond timeouts, too coarse for slots
+        struct itimerspec when = {.it_value = {(time_t)(wake / 1000000000), (long)(wake % 1000000000)}};
+        timerfd_settime(t->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+        int n = epoll_wait(t->epfd, events, 256, -1);
+        for (int i = 0; i < n; i++) {
+            Conn* c = events[i].data.ptr;
+            if (!c) {
+                uint64_t expirations;
+                ssize_t r = read(t->timer_fd, &expirations, sizeof(expirations));
+                (void)r; // Only re-arms the timer
+                continue;
+            }
+            if (c->fd < 0) continue;
+            if (c->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    t->errors++;
+                    conn_close(c);
+                    c->retry_ns = now_ns() + 10000000;
+                    continue;
+                }
+                c->connecting = false;
+                if (c->busy) conn_flush(t, c);
+                else conn_want_write(t, c, false);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) conn_flush(t, c);
+            if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                conn_readable(t, c);
+            }
+        }
+    }
+
+    for (int i = 0; i < t->conn_count; i++) {
+        conn_close(&t->conns[i]);
+        free(t->conns[i].rbuf);
+    }
+    return NULL;
+}
+
+// ============= Reporting =============
+
+static void print_ms(uint64_t ns) {
+    printf(" %9.3f", ns / 1e6);
+}
+
+static void print_row(const char* name, const Histogram* h) {
+    static const double pcts[] = {50, 90, 99, 99.9, 99.99};
+    printf("  %-10s", name);
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) print_ms(hist_percentile(h, pcts[i]));
+    print_ms(h->max);
+    printf("\n");
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options] host:port\n"
+            "  -c N     Connections (default 16)\n"
+            "  -t N     Threads (default 2)\n"
+            "  -d S     Duration in seconds (default 5)\n"
+            "  -R N     Open loop at N requests/s in total (default: closed loop)\n"
+            "  -p PATH  GET this path; repeat to rotate through several (default /)\n"
+            "  -f FILE  Replay the raw requests of a corpus (requests.jsonl format)\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    const char* paths[MAX_PATHS];
+    int path_count = 0;
+    const char* corpus_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "c:t:d:R:p:f:h")) != -1) {
+        switch (c) {
+            case 'c': opt.conns = atoi(optarg); break;
+            case 't': opt.threads = atoi(optarg); break;
+            case 'd': opt.duration = atof(optarg); break;
+            case 'R': opt.rate = atof(optarg); break;
+            case 'p': if (path_count < MAX_PATHS) paths[path_count++] = optarg; break;
+            case 'f': corpus_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || opt.conns < 1 || opt.threads < 1 || opt.duration <= 0) usage(argv[0]);
+    if (opt.threads > opt.conns) opt.threads = opt.conns;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+
+    char host[256];
+    snprintf(host, sizeof(host), "%s", argv[optind]);
+    char* port = strrchr(host, ':');
+    if (!port) usage(argv[0]);
+    *port++ = '\0';
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(host, port, &hints, &opt.addr);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(rc));
+        return 1;
+    }
+
+    if (corpus_path) {
+        Corpus corpus;
+        if (!corpus_load(corpus_path, &corpus)) return 1;
+        for (int i = 0; i < corpus.count && opt.request_count < 4096; i++) {
+            opt.requests[opt.request_count++] = (Request){corpus.entries[i].data, corpus.entries[i].len};
+        }
+        free(corpus.entries); // The request bytes stay, opt.requests points at them
+    } else {
+        if (path_count == 0) paths[path_count++] = "/";
+        for (int i = 0; i < path_count; i++) {
+            char* r;
+            int len = asprintf(&r, "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n\r\n",
+                               paths[i], argv[optind]);
+            if (len < 0) return 1;
+            opt.requests[opt.request_count++] = (Request){r, (size_t)len};
+        }
+    }
+
+    if (opt.rate > 0) opt.interval_ns = (uint64_t)(1e9 * opt.conns / opt.rate);
+    Thread threads[MAX_THREADS];
+    Conn* conns = calloc(opt.conns, sizeof(Conn));
+    if (!conns) return 1;
+    opt.start_ns = now_ns();
+    opt.end_ns = opt.start_ns + (uint64_t)(opt.duration * 1e9);
+    for (int i = 0, first = 0; i < opt.threads; i++) {
+        Thread* t = &threads[i];
+        memset(t, 0, sizeof(*t));
+        t->conns = conns + first;
+        t->first = first;
+        t->conn_count = opt.conns / opt.threads + (i < opt.conns % opt.threads);
+        first += t->conn_count;
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (t->epfd < 0 || t->timer_fd < 0) {
+            perror("loadgen");
+            return 1;
+        }
+        pthread_create(&t->thread, NULL, thread_main, t);
+    }
+
+    Histogram all = {0};
+    uint64_t requests = 0, errors = 0, non_2xx = 0, bytes = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].epfd);
+        close(threads[i].timer_fd);
+        hist_merge(&all, &threads[i].hist);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        non_2xx += threads[i].non_2xx;
+        bytes += threads[i].bytes;
+    }
+    free(conns);
+
+    if (opt.rate > 0) {
+        printf("open loop at %.0f req/s, %d connections, %d threads, %.1f s\n",
+               opt.rate, opt.conns, opt.threads, opt.duration);
+    } else {
+        printf("closed loop, %d connections, %d threads, %.1f s\n", opt.conns, opt.threads, opt.duration);
+    }
+    printf("  requests %llu (%.0f/s), %.2f MB/s, errors %llu, non-2xx %llu\n",
+           (unsigned long long)requests, requests / opt.duration, bytes / opt.duration / 1e6,
+           (unsigned long long)errors, (unsigned long long)non_2xx);
+    if (all.total == 0) return 1;
+    printf("  latency ms   %9s %9s %9s %9s %9s %9s\n", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    if (opt.rate > 0) {
+        print_row("scheduled", &all); // Already free of coordinated omission
+    } else {
+        // Expected interval: the mean time a connection spent per request
+        uint64_t interval = (uint64_t)(opt.duration * 1e9 * opt.conns / all.total);
+        Histogram* corrected = malloc(sizeof(Histogram));
+        if (!corrected) return 1;
+        hist_correct(corrected, &all, interval);
+        print_row("recorded", &all);
+        print_row("corrected", corrected);
+        free(corrected);
+    }
+    freeaddrinfo(opt.addr);
+    return errors > 0;
+}
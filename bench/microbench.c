@@ -0,0 +1,188 @@
+// Microbenchmarks for the request parser, the router and the response
+// serializer, driven by a request corpus (see corpus.h).
+//
+//   make bench                      # or:
+//   ./bench/microbench [corpus.jsonl ...]
+//
+// The server is compiled in (WEBSERVER_NO_MAIN), so every function is
+// measured exactly as the workers run it, inlining included. Each case is
+// run in ROUNDS rounds of about ROUND_NS; the best and the median round
+// are reported in ns per call (and millions of calls per second), per
+// corpus entry and summed over the corpus.
+
+#define WEBSERVER_NO_MAIN
+#include "../webserver.c"
+#include "corpus.h"
+
+#define ROUNDS 7
+#define ROUND_NS 50000000ull // 50 ms
+
+typedef struct {
+    const CorpusEntry* entry;
+    char* buf;              // Scratch copy, the parser writes into it
+    HttpRequest req;        // Parsed once, for the route and serialize cases
+    bool parsed;
+} BenchCase;
+
+static BenchCase* cases;
+static int case_count;
+static Arena* arena;
+static volatile size_t sink; // Keeps results observable to the optimizer
+
+// One parse_request() + parser_build_request() pass; false on reject
+static bool bench_parse_once(BenchCase* c, HttpRequest* req) {
+    memcpy(c->buf, c->entry->data, c->entry->len);
+    HttpParser p;
+    parser_reset(&p);
+    ParseResult r;
+    do {
+        r = parse_request(&p, c->buf, c->entry->len);
+    } while (r == PARSE_HEAD);
+    if (r != PARSE_DONE) return false;
+    memset(req, 0, sizeof(*req));
+    bool ok = parser_build_request(&p, c->buf, req, arena);
+    arena_reset(arena);
+    return ok;
+}
+
+static void run_parse(BenchCase* c, uint64_t n) {
+    HttpRequest req;
+    for (uint64_t i = 0; i < n; i++) sink += bench_parse_once(c, &req);
+}
+
+static void run_route(BenchCase* c, uint64_t n) {
+    HttpRequest req = c->req;
+    for (uint64_t i = 0; i < n; i++) {
+        req.route = NULL;
+        find_handler(&req);
+        sink += req.param_count;
+    }
+}
+
+// What a worker does for a handler's JSON reply, or for a constant route
+static void run_serialize(BenchCase* c, uint64_t n) {
+    const Route* route = c->req.route;
+    struct iovec iov[IOVS_PER_RESPONSE];
+    for (uint64_t i = 0; i < n; i++) {
+        HttpResponse res;
+        init_response(&res, arena);
+        if (route && route->prebuilt) {
+            res.prebuilt = route->prebuilt;
+        } else {
+            add_response_header(&res, "Cache-Control", "no-cache");
+            set_json_response(&res, c->req.route ? 200 : 404, "{\"id\": 42, \"name\": \"User 42\"}");
+        }
+        int count = serialize_response(&res, true, true, iov);
+        for (int k = 0; k < count; k++) sink += iov[k].iov_len;
+        arena_reset(arena);
+    }
+}
+
+typedef void (*BenchFn)(BenchCase* c, uint64_t n);
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// ns per call: best and median of ROUNDS rounds after calibrating n
+static void measure(BenchFn fn, BenchCase* c, double* best, double* median) {
+    uint64_t n = 1;
+    for (;;) {
+        uint64_t start = monotonic_ns();
+        fn(c, n);
+        uint64_t took = monotonic_ns() - start;
+        if (took >= ROUND_NS / 4 || n >= (1ull << 32)) break;
+        n *= took < ROUND_NS / 64 ? 16 : 2;
+    }
+    n *= 4;
+
+    double rounds[ROUNDS];
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t start = monotonic_ns();
+        fn(c, n);
+        rounds[r] = (double)(monotonic_ns() - start) / n;
+    }
+    qsort(rounds, ROUNDS, sizeof(double), cmp_double);
+    *best = rounds[0];
+    *median = rounds[ROUNDS / 2];
+}
+
+static void bench(const char* name, BenchFn fn, bool needs_parse) {
+    printf("\n%s\n%-24s %10s %10s %10s\n", name, "entry", "best ns", "median ns", "M/s");
+    double total_best = 0, total_median = 0;
+    for (int i = 0; i < case_count; i++) {
+        BenchCase* c = &cases[i];
+        if (needs_parse && !c->parsed) {
+            printf("%-24s %10s\n", c->entry->id, "rejected");
+            continue;
+        }
+        double best, median;
+        measure(fn, c, &best, &median);
+        total_best += best;
+        total_median += median;
+        printf("%-24s %10.1f %10.1f %10.2f\n", c->entry->id, best, median, 1e3 / best);
+    }
+    printf("%-24s %10.1f %10.1f\n", "corpus (sum)", total_best, total_median);
+}
+
+int main(int argc, char** argv) {
+    const char* default_corpus[] = {"bench/corpus.jsonl"};
+    const char** paths = argc > 1 ? (const char**)argv + 1 : default_corpus;
+    int path_count = argc > 1 ? argc - 1 : 1;
+
+    // Same startup as the server, without sockets or workers
+    scan_init();
+    header_index_init();
+    response_cache_init();
+    cache_init();
+    setup_routes();
+    prerender_constant_routes();
+
+    static ArenaPool pool;
+    arena = arena_pool_get(&pool);
+    if (!arena) return 1;
+
+    for (int f = 0; f < path_count; f++) {
+        Corpus corpus;
+        if (!corpus_load(paths[f], &corpus)) return 1;
+        BenchCase* grown = realloc(cases, (case_count + corpus.count) * sizeof(BenchCase));
+        if (!grown) return 1;
+        cases = grown;
+        for (int i = 0; i < corpus.count; i++) {
+            BenchCase* c = &cases[case_count++];
+            c->entry = &corpus.entries[i];
+            c->buf = malloc(c->entry->len + 1);
+            if (!c->buf) return 1;
+            // Keep a parsed copy whose strings alias a private buffer
+            char* keep = malloc(c->entry->len + 1);
+            if (!keep) return 1;
+            memcpy(keep, c->entry->data, c->entry->len + 1);
+            HttpParser p;
+            parser_reset(&p);
+            ParseResult r;
+            do {
+                r = parse_request(&p, keep, c->entry->len);
+            } while (r == PARSE_HEAD);
+            static ArenaPool keep_pool; // Never reset: parsed headers live here
+            static Arena* keep_arena;
+            if (!keep_arena) keep_arena = arena_pool_get(&keep_pool);
+            memset(&c->req, 0, sizeof(c->req));
+            c->parsed = r == PARSE_DONE && keep_arena &&
+                        parser_build_request(&p, keep, &c->req, keep_arena);
+            if (c->parsed) find_handler(&c->req);
+        }
+    }
+
+    printf("microbench: %d corpus entries, %d routes, %s build\n", case_count, server.route_count,
+#ifdef __OPTIMIZE__
+           "optimized"
+#else
+           "unoptimized"
+#endif
+    );
+    bench("parse_request + parser_build_request", run_parse, false);
+    bench("find_handler", run_route, true);
+    bench("serialize_response", run_serialize, true);
+    return 0;
+}
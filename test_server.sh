@@ -41,6 +41,12 @@ curl -s "$SERVER/api/users"
 echo ""
 echo ""
 
+# Test 5b: Streamed export
+echo "5b. Testing GET /api/users/export?count=3 (chunked)"
+curl -s "$SERVER/api/users/export?count=3"
+echo ""
+echo ""
+
 # Test 6: Get specific user
 echo "6. Testing GET /api/users/1"
 curl -s "$SERVER/api/users/1"
@@ -55,17 +61,33 @@ curl -s -X POST "$SERVER/api/users" \
 echo ""
 echo ""
 
+# Test 7b: Chunked upload, streamed to the route's body reader
+echo "7b. Testing POST /api/upload (chunked)"
+printf 'hello upload' | curl -s -X POST "$SERVER/api/upload" \
+  -H "Transfer-Encoding: chunked" --data-binary @-
+echo ""
+echo ""
+
 # Test 8: Delete user
 echo "8. Testing DELETE /api/users/2"
 curl -s -X DELETE "$SERVER/api/users/2"
 echo ""
 echo ""
 
+# Test 8b: Static file
+echo "8b. Testing GET /static/style.css (first line)"
+curl -s "$SERVER/static/style.css" | head -n 1
+echo ""
+
 # Test 9: 404 - Not found
 echo "9. Testing GET /nonexistent (should be 404)"
 curl -s "$SERVER/nonexistent"
 echo ""
 echo ""
+# Test 9b: Known path, wrong method
+echo "9b. Testing PUT /api/users (should be 405 with Allow)"
+curl -s -D - -X PUT "$SERVER/api/users" | grep -iE "^HTTP|^Allow"
+echo ""
 
 # Test 10: Protected route without auth
 echo "10. Testing GET /admin (without auth - should fail)"
@@ -79,6 +101,19 @@ curl -s "$SERVER/admin" -H "Authorization: Bearer fake-token"
 echo ""
 echo ""
 
+# Test 12: Keep-alive
+echo "12. Testing keep-alive (two requests, one connection)"
+curl -sv "$SERVER/api/hello" "$SERVER/api/time" 2>&1 | grep -E "Re-using|Connection:"
+echo ""
+echo ""
+
+# Test 13: Compression
+echo "13. Testing GET / with Accept-Encoding: gzip"
+curl -s -D - -o /dev/null "$SERVER/" -H "Accept-Encoding: gzip" | grep -iE "Content-Encoding|Vary"
+curl -s --compressed "$SERVER/" | head -c 60
+echo ""
+echo ""
+
 echo "================================"
 echo "All tests completed!"
 echo "================================"
@@ -1,17 +1,97 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#elif defined(__FreeBSD__)
+#include <sys/types.h>
+#endif
+#include <sys/resource.h>
+#include <ctype.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <signal.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#include <sys/event.h>
+#define USE_KQUEUE 1
+#else
+#error "No supported event notification mechanism (epoll or kqueue)"
+#endif
+
+// The io_uring backend (--io-uring) needs Linux 6.0 headers for multishot
+// recv; it talks to the kernel through raw system calls, without liburing
+#if defined(USE_EPOLL) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // BSD/macOS: SO_NOSIGPIPE is set per socket instead
+#endif
 
 #define PORT 8080
 #define BUFFER_SIZE 4096
-#define MAX_ROUTES 50
+#define MAX_REQUEST_SIZE 65536 // Request head; bodies are limited by config.max_body
+#define MAX_CHUNK_FRAME 4096   // Chunk-size line (with extensions) or trailer section
+#define MAX_EVENTS 256
+#define MAX_WORKERS 64
+#define MAX_PIPELINE_OUTPUT (256 * 1024) // Stop dispatching pipelined requests past this
+#define MAX_IOV 64                         // Queued iovecs per connection
+#define MAX_HEADERS 32
+#define MAX_PARAMS 8
 #define MAX_MIDDLEWARE 10
+#define STATUS_MIN 100
+#define STATUS_MAX 599
 
 // HTTP Methods
 typedef enum {
@@ -22,47 +102,496 @@ typedef enum {
     UNSUPPORTED
 } HttpMethod;
 
-// Request structure
+// Headers the server or common middleware look at, interned by the parser
+// so lookups by id are a single array access (see http_header())
+typedef enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_CONNECTION,
+    HDR_EXPECT,
+    HDR_AUTHORIZATION,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_USER_AGENT,
+    HDR_CACHE_CONTROL,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_ORIGIN,
+    HDR_COUNT
+} HeaderId;
+
+// Parsed header; both strings alias the connection's receive buffer
+typedef struct {
+    const char* name;
+    const char* value;
+    size_t value_len;
+    HeaderId id;
+    uint32_t hash;          // Case-insensitive name hash, see header_hash()
+} HttpHeader;
+
+#define HEADER_SLOTS 64     // Open-addressed slots for HDR_OTHER, 2x MAX_HEADERS
+
+// Per-request header table. Entries are header index + 1, 0 = absent;
+// the first occurrence of a repeated header wins.
+typedef struct {
+    uint8_t known[HDR_COUNT];
+    uint8_t slots[HEADER_SLOTS];
+} HeaderIndex;
+
+// Captured path parameter, as an offset/length into the request path
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+    long int_value;         // Pre-converted for ":name<int>" segments
+    bool is_int;
+} ParamCapture;
+
+struct Route;
+struct CacheEntry;
+struct HttpAsync;
+typedef struct Arena Arena;
+typedef struct ArenaPool ArenaPool;
+
+// Request structure. All strings are NUL-terminated views into the
+// connection's receive buffer and are valid until the handler returns.
 typedef struct {
     HttpMethod method;
-    char path[256];
-    char query_string[512];
-    char body[2048];
-    int body_length;
-    char headers[1024];
+    const char* path;
+    size_t path_len;
+    const char* query_string; // "" when absent
+    size_t query_length;
+    const char* body;       // "" for streamed uploads, see register_upload_route()
+    size_t body_length;
+    HttpHeader* headers;    // header_count entries, allocated from the arena
+    int header_count;
+    HeaderIndex header_index; // See http_header() and http_get_header()
+    bool keep_alive;        // Client allows the connection to be reused
+    bool http11;            // HTTP/1.1 or later (chunked encoding allowed)
+    const struct Route* route; // Matched route, set by find_handler()
+    ParamCapture params[MAX_PARAMS]; // In path order, see req_param()
+    int param_count;
+    uint8_t allowed_methods; // No route: bit per method the path has (405)
+    struct CacheEntry* cache_fill; // Pending entry to fill, see cache_middleware()
+    bool log_access;        // Set by logger_middleware()
+    uint32_t client_ip;     // Peer IPv4 address, host byte order
+    void* upload_ctx;       // Free for the route's BodyReader, should live in the arena
+    uint64_t id;            // Unique per process, passed to the USDT probes
+    struct Trace* trace;    // Sampled requests only, see trace_sample()
 } HttpRequest;
 
-// Response structure
+// Offset/length view into the receive buffer, relative to request start
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} Slice;
+
+typedef struct {
+    Slice name;
+    Slice value;
+    HeaderId id;
+    uint32_t hash;
+} HeaderSlice;
+
+typedef enum {
+    P_METHOD,
+    P_PATH,
+    P_QUERY,
+    P_VERSION,
+    P_LINE_LF,
+    P_HEADER_START,
+    P_HEADER_NAME,
+    P_HEADER_VALUE_START,
+    P_HEADER_VALUE,
+    P_HEADER_LF,
+    P_HEAD_LF,
+    P_BODY,                 // Content-Length framed body
+    P_CHUNK_SIZE,           // Chunked body, RFC 9112 section 7.1
+    P_CHUNK_EXT,
+    P_CHUNK_SIZE_LF,
+    P_CHUNK_DATA,
+    P_CHUNK_DATA_CR,
+    P_CHUNK_DATA_LF,
+    P_TRAILER_START,
+    P_TRAILER_LINE,
+    P_TRAILER_LF,
+    P_TRAILERS_LF,
+    P_DONE,
+    P_ERROR
+} ParserState;
+
+typedef enum {
+    PARSE_AGAIN,  // Need more bytes
+    PARSE_HEAD,   // Head complete and a body follows; call again for it
+    PARSE_DONE,   // A complete request (head and body) is buffered
+    PARSE_ERROR   // Malformed; error_status holds the reply code
+} ParseResult;
+
+// Resumable parser state, kept on the connection between reads
+typedef struct {
+    ParserState state;
+    size_t pos;             // Next byte to examine
+    size_t mark;            // Start of the token being scanned
+    Slice method;
+    Slice path;
+    Slice query;
+    Slice version;
+    Slice body;
+    bool has_query;
+    HeaderSlice headers[MAX_HEADERS];
+    int header_count;
+    size_t head_len;
+    size_t content_length;
+    bool has_content_length;
+    bool chunked;           // Transfer-Encoding: chunked
+    bool expect_continue;   // Expect: 100-continue
+    bool head_reported;     // PARSE_HEAD already returned
+    size_t body_limit;      // Largest body accepted, 413 beyond it
+    size_t body_end;        // End of the decoded body bytes in the buffer
+    size_t body_total;      // Decoded body bytes so far, including discarded ones
+    size_t chunk_remaining; // Size of the chunk being read, then what is left of it
+    size_t frame_bytes;     // Length of the current chunk-size line or trailer section
+    size_t message_len;     // Bytes the whole request occupies, set on PARSE_DONE
+    bool conn_close;
+    bool conn_keep_alive;
+    int error_status;
+} HttpParser;
+
+// Content codings, see negotiate_encoding()
+typedef enum {
+    ENC_IDENTITY,
+    ENC_GZIP,
+    ENC_BROTLI,
+    ENC_ZSTD,
+    ENC_COUNT
+} ContentEncoding;
+
+// Response serialized ahead of time (constant routes, cache entries): the
+// status line and headers, minus Date and Connection, followed by the body
+typedef struct PrebuiltResponse {
+    int status_code;
+    char* data;
+    size_t head_len;
+    size_t body_len;
+} PrebuiltResponse;
+
+
+// Streaming body callback: write up to cap bytes into buf and return the
+// count, 0 once the body is complete, or -1 to abort the connection. It is
+// called from the event loop each time the previous chunk has been sent.
+typedef ssize_t (*BodyProducer)(void* ctx, char* buf, size_t cap);
+
+// Response structure. The body lives in the connection's arena and can
+// be any size; it is released once the response has been sent.
 typedef struct {
     int status_code;
-    char content_type[64];
-    char body[4096];
-    int body_length;
+    const char* content_type; // Static string
+    char* body;
+    size_t body_length;
+    Arena* arena;
+    BodyProducer producer;  // Set for streamed (chunked) responses
+    void* producer_ctx;     // Should live in the arena
+    char* extra_headers;    // "Name: value\r\n" lines, see add_response_header()
+    size_t extra_headers_len;
+    struct CachedFile* file; // Body sent with sendfile(), see handle_static()
+    off_t file_offset;
+    const PrebuiltResponse* prebuilt; // Sent as-is, everything else ignored
+    struct CacheEntry* cache_entry; // Reference that keeps prebuilt alive
+    struct HttpAsync* async; // Owning dispatch, see http_defer()
 } HttpResponse;
 
 // Handler function type
 typedef void (*RouteHandler)(HttpRequest*, HttpResponse*);
 
+// Streaming upload callback: called with each piece of the request body as
+// it arrives, already de-chunked. Return false to reject the upload; the
+// reply is whatever it set on res, or 413 if it left res alone.
+typedef bool (*BodyReader)(HttpRequest* req, HttpResponse* res, const char* data, size_t len);
+
 // Middleware function type (returns true to continue, false to stop)
 typedef bool (*Middleware)(HttpRequest*, HttpResponse*);
 
+// A route's whole middleware chain as one function, generated from
+// ROUTE_TABLE (see Server Setup). Same contract as Middleware.
+typedef bool (*MiddlewareChain)(HttpRequest*, HttpResponse*);
+
+// Response filter, run after the handler (or the middleware that stopped
+// the chain) on every request
+typedef void (*ResponseFilter)(HttpRequest*, HttpResponse*);
+
 // Route structure
-typedef struct {
+typedef struct Route {
+    int id;                 // Index in server.routes
     HttpMethod method;
     char path[256];
+    size_t path_len;
     RouteHandler handler;
+    MiddlewareChain chain;  // Generated from ROUTE_TABLE, else scoped_chain runs
+    uint8_t scoped_chain[MAX_MIDDLEWARE]; // Registry ids, bound by router_compile()
+    int scoped_count;
+    int param_count;        // ":name" and "*name" segments in path
+    char param_names[MAX_PARAMS][32];
+    void* ctx;              // Handler-specific data, e.g. a static root
+    bool constant;          // Handler output never varies, see register_constant_route()
+    PrebuiltResponse* prebuilt;
+    PrebuiltResponse* prebuilt_encoded[ENC_COUNT]; // Compressed variants, NULL if none
+    int cache_ttl;          // Seconds, see register_cached_route()
+    bool blocking;          // Runs on the blocking pool, see register_blocking_route()
+    BodyReader body_reader; // Body is streamed, see register_upload_route()
 } Route;
 
+// Router trie node, one trie per method (see router_compile())
+typedef struct RouteNode {
+    const char* segment;    // Static segment text, or ":name"/"*name"
+    size_t segment_len;
+    struct RouteNode** children; // Static children sorted by segment
+    int child_count;
+    struct RouteNode* int_child;
+    struct RouteNode* str_child;
+    struct RouteNode* wildcard_child;
+    Route* route;           // Set when a route ends at this node
+} RouteNode;
+
+typedef struct {
+    Route* route;
+    ParamCapture params[MAX_PARAMS];
+    int param_count;
+} RouteMatch;
+
+// Middleware bound to the runtime routes under prefix (NULL: all of them)
+typedef struct {
+    const char* prefix;
+    uint8_t id;             // Registry index
+} MiddlewareScope;
+
 // Server structure
 typedef struct {
-    Route routes[MAX_ROUTES];
+    Route** routes;         // Registration order
     int route_count;
-    Middleware middleware[MAX_MIDDLEWARE];
+    int route_capacity;
+    RouteNode* roots[UNSUPPORTED]; // Built by router_compile()
+    Route** exact;          // Perfect hash of parameterless routes, see exact_hash()
+    uint32_t exact_mask;
+    uint32_t exact_seed;
+    Middleware middleware[MAX_MIDDLEWARE]; // Every known middleware; the index is its metrics id
+    const char* middleware_names[MAX_MIDDLEWARE];
     int middleware_count;
+    MiddlewareScope scopes[MAX_MIDDLEWARE]; // Registration order
+    int scope_count;
+    uint8_t miss_chain[MAX_MIDDLEWARE]; // Unmatched requests, see register_miss_middleware()
+    int miss_count;
+    ResponseFilter filters[MAX_MIDDLEWARE];
+    int filter_count;
+    PrebuiltResponse* not_found; // Rendered handle_not_found() output
+    PrebuiltResponse* not_allowed[1 << UNSUPPORTED]; // 405 per Allow set
+    PrebuiltResponse* overloaded; // Rendered handle_overloaded() output, see shed_request()
+    bool frozen; // Set once setup_routes() returns; workers share it read-only
 } Server;
 
 Server server = {0};
 
+// Runtime configuration (see parse_args())
+typedef struct {
+    int port;
+    int workers;
+    bool cpu_affinity;
+    int keepalive_timeout;  // Seconds an idle connection is kept open
+    int header_timeout;     // Seconds to receive a request head (and TLS handshake)
+    int body_timeout;       // Seconds a request body may stall between reads
+    int write_timeout;      // Seconds a response may stall between writes
+    int max_requests;       // Requests served per connection before closing
+    int cache_mb;           // Response cache memory budget
+    int pool_threads;       // Threads for blocking routes, 0 = run inline
+    size_t max_body;        // Largest buffered request body in bytes
+    const char* tls_cert;   // PEM certificate chain; with tls_key enables TLS
+    const char* tls_key;
+    int backlog;            // listen() backlog, capped by the kernel's somaxconn
+    int max_conns;          // Open connections across all workers, 0 = from RLIMIT_NOFILE
+    int rate_limit;         // Requests per second per client IP, 0 = unlimited
+    int rate_burst;         // Token bucket size, 0 = rate_limit
+    int shed_ms;            // Queue delay that triggers the 503 fast path, 0 = never
+    int trace_sample;       // Trace one request in N per worker, 0 = off
+    int trace_slow_ms;      // Sampled traces at least this slow are kept
+    const char* handoff;    // Unix socket for passing listeners to a successor
+    int drain_timeout;      // Seconds in-flight requests get on shutdown
+    bool io_uring;          // Serve plain HTTP through io_uring, see ring_init()
+} ServerConfig;
+
+ServerConfig config = {
+    .port = PORT,
+    .workers = 1,
+    .cpu_affinity = false,
+    .keepalive_timeout = 5,
+    .header_timeout = 10,
+    .body_timeout = 30,
+    .write_timeout = 30,
+    .max_requests = 100,
+    .cache_mb = 16,
+    .pool_threads = 4,
+    .max_body = 1024 * 1024,
+    .backlog = 1024,
+    .shed_ms = 500,
+    .trace_slow_ms = 100,
+    .drain_timeout = 30,
+};
+
+// ============= Arena Allocator =============
+
+// Request/response memory comes from a bump allocator owned by the
+// connection. Everything allocated while serving a batch of requests is
+// released at once by arena_reset() when the responses have been flushed.
+// Blocks and arenas are recycled through a per-worker ArenaPool, so a
+// worker in steady state never calls malloc or free for request data.
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_POOL_MAX 1024 // Spare arenas/blocks kept per worker
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+struct Arena {
+    ArenaBlock* first;      // Kept across resets
+    ArenaBlock* current;
+    void* last;             // Most recent allocation, can grow in place
+    size_t last_size;
+    ArenaPool* pool;
+    Arena* next_free;
+};
+
+struct ArenaPool {
+    Arena* free_arenas;
+    int free_arena_count;
+    ArenaBlock* free_blocks;
+    int free_block_count;
+};
+
+static ArenaBlock* arena_block_get(ArenaPool* pool, size_t min_size) {
+    ArenaBlock* block;
+    if (min_size <= ARENA_BLOCK_SIZE && pool->free_blocks) {
+        block = pool->free_blocks;
+        pool->free_blocks = block->next;
+        pool->free_block_count--;
+    } else {
+        size_t capacity = min_size > ARENA_BLOCK_SIZE ? min_size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (!block) return NULL;
+        block->capacity = capacity;
+    }
+    block->next = NULL;
+    block->used = 0;
+    return block;
+}
+
+static void arena_block_put(ArenaPool* pool, ArenaBlock* block) {
+    // Only standard-size blocks are worth keeping
+    if (block->capacity == ARENA_BLOCK_SIZE && pool->free_block_count < ARENA_POOL_MAX) {
+        block->next = pool->free_blocks;
+        pool->free_blocks = block;
+        pool->free_block_count++;
+    } else {
+        free(block);
+    }
+}
+
+Arena* arena_pool_get(ArenaPool* pool) {
+    Arena* arena = pool->free_arenas;
+    if (arena) {
+        pool->free_arenas = arena->next_free;
+        pool->free_arena_count--;
+        return arena;
+    }
+
+    arena = calloc(1, sizeof(Arena));
+    if (!arena) return NULL;
+    arena->pool = pool;
+    arena->first = arena->current = arena_block_get(pool, ARENA_BLOCK_SIZE);
+    if (!arena->first) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+// O(1) unless the arena spilled into extra blocks, which go back to the pool
+void arena_reset(Arena* arena) {
+    ArenaBlock* extra = arena->first->next;
+    while (extra) {
+        ArenaBlock* next = extra->next;
+        arena_block_put(arena->pool, extra);
+        extra = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->last = NULL;
+    arena->last_size = 0;
+}
+
+void arena_pool_put(ArenaPool* pool, Arena* arena) {
+    arena_reset(arena);
+    if (pool->free_arena_count >= ARENA_POOL_MAX) {
+        arena_block_put(pool, arena->first);
+        free(arena);
+        return;
+    }
+    arena->next_free = pool->free_arenas;
+    pool->free_arenas = arena;
+    pool->free_arena_count++;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = arena->current;
+
+    if (block->capacity - block->used < aligned) {
+        block = arena_block_get(arena->pool, aligned);
+        if (!block) return NULL;
+        arena->current->next = block;
+        arena->current = block;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += aligned;
+    arena->last = ptr;
+    arena->last_size = aligned;
+    return ptr;
+}
+
+// Grow an allocation, in place when it is the most recent one
+void* arena_grow(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+    if (ptr && ptr == arena->last) {
+        ArenaBlock* block = arena->current;
+        size_t aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        size_t start = (char*)ptr - block->data;
+        if (block->capacity - start >= aligned) {
+            block->used = start + aligned;
+            arena->last_size = aligned;
+            return ptr;
+        }
+    }
+
+    void* grown = arena_alloc(arena, new_size);
+    if (grown && ptr) memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+char* arena_strndup(Arena* arena, const char* s, size_t len) {
+    char* copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
 // ============= Utility Functions =============
 
 HttpMethod parse_method(const char* method_str) {
@@ -83,62 +612,84 @@ const char* method_to_string(HttpMethod method) {
     }
 }
 
-void parse_request(const char* raw_request, HttpRequest* req) {
-    char method_str[16];
-    char full_path[512];
-    
-    sscanf(raw_request, "%s %s", method_str, full_path);
-    req->method = parse_method(method_str);
-    
-    // Parse path and query string
-    char* query_start = strchr(full_path, '?');
-    if (query_start) {
-        *query_start = '\0';
-        strncpy(req->path, full_path, sizeof(req->path) - 1);
-        strncpy(req->query_string, query_start + 1, sizeof(req->query_string) - 1);
-    } else {
-        strncpy(req->path, full_path, sizeof(req->path) - 1);
-        req->query_string[0] = '\0';
-    }
-    
-    // Parse body for POST/PUT requests
-    const char* body_start = strstr(raw_request, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4;
-        strncpy(req->body, body_start, sizeof(req->body) - 1);
-        req->body_length = strlen(req->body);
-    }
+void init_response(HttpResponse* res, Arena* arena) {
+    res->status_code = 200;
+    res->content_type = "text/plain";
+    res->body = "";
+    res->body_length = 0;
+    res->arena = arena;
+    res->producer = NULL;
+    res->producer_ctx = NULL;
+    res->extra_headers = NULL;
+    res->extra_headers_len = 0;
+    res->file = NULL;
+    res->file_offset = 0;
+    res->prebuilt = NULL;
+    res->cache_entry = NULL;
+    res->async = NULL;
+}
+
+// Append a header line to the response; both strings are copied
+bool add_response_header(HttpResponse* res, const char* name, const char* value) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t len = res->extra_headers_len + name_len + value_len + 4;
+    char* headers = arena_grow(res->arena, res->extra_headers, res->extra_headers_len, len);
+    if (!headers) return false;
     
-    // Copy headers
-    strncpy(req->headers, raw_request, sizeof(req->headers) - 1);
+    char* p = headers + res->extra_headers_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, value_len);
+    p += value_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    res->extra_headers = headers;
+    res->extra_headers_len = len;
+    return true;
 }
 
-void init_response(HttpResponse* res) {
-    res->status_code = 200;
-    strcpy(res->content_type, "text/plain");
-    res->body[0] = '\0';
-    res->body_length = 0;
+// Copy a body into the response arena. On allocation failure the
+// response degrades to an empty 500 rather than being truncated.
+void set_response_body(HttpResponse* res, int status, const char* type, const char* data, size_t len) {
+    char* body = arena_strndup(res->arena, data, len);
+    if (!body) {
+        res->status_code = 500;
+        res->content_type = "text/plain";
+        res->body = "";
+        res->body_length = 0;
+        return;
+    }
+    res->status_code = status;
+    res->content_type = type;
+    res->body = body;
+    res->body_length = len;
 }
 
 void set_json_response(HttpResponse* res, int status, const char* json) {
-    res->status_code = status;
-    strcpy(res->content_type, "application/json");
-    strncpy(res->body, json, sizeof(res->body) - 1);
-    res->body_length = strlen(res->body);
+    set_response_body(res, status, "application/json", json, strlen(json));
 }
 
 void set_text_response(HttpResponse* res, int status, const char* text) {
-    res->status_code = status;
-    strcpy(res->content_type, "text/plain");
-    strncpy(res->body, text, sizeof(res->body) - 1);
-    res->body_length = strlen(res->body);
+    set_response_body(res, status, "text/plain", text, strlen(text));
 }
 
 void set_html_response(HttpResponse* res, int status, const char* html) {
+    set_response_body(res, status, "text/html", html, strlen(html));
+}
+
+// Stream the body from producer with Transfer-Encoding: chunked. Allocate
+// ctx from res->arena; it stays valid until the last chunk is sent.
+void set_stream_response(HttpResponse* res, int status, const char* type,
+                         BodyProducer producer, void* ctx) {
     res->status_code = status;
-    strcpy(res->content_type, "text/html");
-    strncpy(res->body, html, sizeof(res->body) - 1);
-    res->body_length = strlen(res->body);
+    res->content_type = type;
+    res->body = "";
+    res->body_length = 0;
+    res->producer = producer;
+    res->producer_ctx = ctx;
 }
 
 const char* get_status_text(int code) {
@@ -146,344 +697,7009 @@ const char* get_status_text(int code) {
         case 200: return "OK";
         case 201: return "Created";
         case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
         case 400: return "Bad Request";
         case 404: return "Not Found";
         case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 413: return "Payload Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
         case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
         default: return "Unknown";
     }
 }
 
-// ============= Middleware Functions =============
+// ============= JSON Writer =============
 
-bool logger_middleware(HttpRequest* req, HttpResponse* res) {
-    time_t now;
-    time(&now);
-    char* time_str = ctime(&now);
-    time_str[strlen(time_str) - 1] = '\0'; // Remove newline
-    
-    printf("[%s] %s %s", time_str, method_to_string(req->method), req->path);
-    if (req->query_string[0]) {
-        printf("?%s", req->query_string);
+// Appends JSON straight into the response arena (or a caller's fixed
+// buffer), escaping strings and formatting numbers by hand, so dynamic
+// endpoints never go through printf or copy the body a second time.
+// Errors are sticky: after a failed allocation or a full fixed buffer
+// every call is a no-op and json_finish() reports the failure.
+//
+//     JsonWriter w;
+//     json_begin(&w, res->arena, 64);
+//     json_object_begin(&w);
+//     json_key(&w, "id");
+//     json_int(&w, 42);
+//     json_object_end(&w);
+//     json_finish(&w, res, 200);
+//
+// Separators follow the hand-written responses: ": " after keys and ", "
+// between members.
+
+typedef struct {
+    Arena* arena;           // NULL for a fixed buffer, see json_begin_fixed()
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;
+    bool need_comma;        // A value precedes the next one at this level
+} JsonWriter;
+
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Decimal digits of v at out (room for 20 bytes); returns the length
+static size_t format_u64(char* out, uint64_t v) {
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        const char* pair = digit_pairs + (v % 100) * 2;
+        v /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
     }
-    printf("\n");
-    
-    return true; // Continue to next middleware/handler
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    return len;
 }
 
-bool cors_middleware(HttpRequest* req, HttpResponse* res) {
-    // This would add CORS headers in a real implementation
-    // For now, just demonstrate the concept
-    return true;
+// Start a document in the arena; size_hint is the expected output size
+void json_begin(JsonWriter* w, Arena* arena, size_t size_hint) {
+    w->arena = arena;
+    w->len = 0;
+    w->cap = size_hint > 16 ? size_hint : 16;
+    w->data = arena_alloc(arena, w->cap);
+    w->failed = w->data == NULL;
+    w->need_comma = false;
 }
 
-bool auth_middleware(HttpRequest* req, HttpResponse* res) {
-    // Check for protected routes
-    if (strncmp(req->path, "/admin", 6) == 0) {
-        // Look for Authorization header (simplified)
-        if (strstr(req->headers, "Authorization:") == NULL) {
-            set_json_response(res, 401, "{\"error\": \"Unauthorized\"}");
-            return false; // Stop processing
+// Write into buf instead; running out of room fails the writer. The
+// nesting state is kept, so a BodyProducer can re-point the same writer
+// at each chunk.
+void json_begin_fixed(JsonWriter* w, char* buf, size_t cap) {
+    w->arena = NULL;
+    w->data = buf;
+    w->len = 0;
+    w->cap = cap;
+    w->failed = false;
+}
+
+// Room for n more bytes, or NULL
+static char* json_reserve(JsonWriter* w, size_t n) {
+    if (w->failed) return NULL;
+    if (w->cap - w->len < n) {
+        size_t cap = w->cap * 2;
+        while (cap - w->len < n) cap *= 2;
+        char* grown = w->arena ? arena_grow(w->arena, w->data, w->len, cap) : NULL;
+        if (!grown) {
+            w->failed = true;
+            return NULL;
         }
+        w->data = grown;
+        w->cap = cap;
     }
-    return true;
+    return w->data + w->len;
 }
 
-// ============= Route Handlers =============
+// Append bytes as they are
+void json_raw(JsonWriter* w, const char* s, size_t len) {
+    char* out = json_reserve(w, len);
+    if (!out) return;
+    memcpy(out, s, len);
+    w->len += len;
+}
 
-void handle_home(HttpRequest* req, HttpResponse* res) {
-    const char* html = 
-        "<!DOCTYPE html>"
-        "<html><head><title>C Web Server</title></head>"
-        "<body>"
-        "<h1>Welcome to the C Web Server!</h1>"
-        "<p>Available endpoints:</p>"
-        "<ul>"
-        "<li>GET / - This page</li>"
-        "<li>GET /api/hello - Hello JSON</li>"
-        "<li>GET /api/time - Current time</li>"
-        "<li>GET /api/users - List users</li>"
-        "<li>POST /api/users - Create user</li>"
-        "<li>GET /api/users/123 - Get specific user</li>"
-        "<li>DELETE /api/users/123 - Delete user</li>"
-        "<li>GET /admin - Protected route (requires auth)</li>"
-        "</ul>"
-        "</body></html>";
-    
-    set_html_response(res, 200, html);
+static inline void json_value_start(JsonWriter* w) {
+    if (w->need_comma) json_raw(w, ", ", 2);
+    w->need_comma = true;
 }
 
-void handle_hello(HttpRequest* req, HttpResponse* res) {
-    const char* name = "Guest";
-    
-    // Parse query parameter
-    if (req->query_string[0]) {
-        char* name_param = strstr(req->query_string, "name=");
-        if (name_param) {
-            static char name_buffer[64];
-            sscanf(name_param, "name=%63s", name_buffer);
-            name = name_buffer;
+void json_object_begin(JsonWriter* w) {
+    json_value_start(w);
+    json_raw(w, "{", 1);
+    w->need_comma = false;
+}
+
+void json_object_end(JsonWriter* w) {
+    json_raw(w, "}", 1);
+    w->need_comma = true;
+}
+
+void json_array_begin(JsonWriter* w) {
+    json_value_start(w);
+    json_raw(w, "[", 1);
+    w->need_comma = false;
+}
+
+void json_array_end(JsonWriter* w) {
+    json_raw(w, "]", 1);
+    w->need_comma = true;
+}
+
+// Escape s into the current string. Runs of ordinary bytes are copied
+// with one memcpy; UTF-8 passes through unchanged.
+void json_string_append(JsonWriter* w, const char* s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        json_raw(w, s + start, i - start);
+        start = i + 1;
+        char esc[6] = {'\\', (char)c};
+        size_t n = 2;
+        switch (c) {
+            case '"': case '\\': break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            default:
+                memcpy(esc + 1, "u00", 3);
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 15];
+                n = 6;
         }
+        json_raw(w, esc, n);
     }
-    
-    char json[256];
-    snprintf(json, sizeof(json), 
-             "{\"message\": \"Hello, %s!\", \"timestamp\": %ld}", 
-             name, time(NULL));
-    
-    set_json_response(res, 200, json);
+    json_raw(w, s + start, len - start);
 }
 
-void handle_time(HttpRequest* req, HttpResponse* res) {
-    time_t now = time(NULL);
-    char* time_str = ctime(&now);
-    time_str[strlen(time_str) - 1] = '\0';
-    
-    char json[256];
-    snprintf(json, sizeof(json), 
-             "{\"current_time\": \"%s\", \"unix_timestamp\": %ld}", 
-             time_str, now);
-    
-    set_json_response(res, 200, json);
+// A string value built from several pieces: open, append..., close
+void json_string_open(JsonWriter* w) {
+    json_value_start(w);
+    json_raw(w, "\"", 1);
 }
 
-void handle_users_list(HttpRequest* req, HttpResponse* res) {
-    const char* json = 
-        "{"
-        "  \"users\": ["
-        "    {\"id\": 1, \"name\": \"Alice\", \"email\": \"alice@example.com\"},"
-        "    {\"id\": 2, \"name\": \"Bob\", \"email\": \"bob@example.com\"},"
-        "    {\"id\": 3, \"name\": \"Charlie\", \"email\": \"charlie@example.com\"}"
-        "  ],"
-        "  \"count\": 3"
-        "}";
-    
-    set_json_response(res, 200, json);
+void json_string_close(JsonWriter* w) {
+    json_raw(w, "\"", 1);
 }
 
-void handle_user_create(HttpRequest* req, HttpResponse* res) {
-    // In a real app, you'd parse the JSON body and save to database
-    printf("Received POST body: %s\n", req->body);
-    
-    const char* json = 
-        "{"
-        "  \"id\": 4,"
-        "  \"name\": \"New User\","
-        "  \"email\": \"newuser@example.com\","
-        "  \"created\": true"
-        "}";
-    
-    set_json_response(res, 201, json);
+void json_string_n(JsonWriter* w, const char* s, size_t len) {
+    json_string_open(w);
+    json_string_append(w, s, len);
+    json_string_close(w);
 }
 
-void handle_user_get(HttpRequest* req, HttpResponse* res) {
-    // Extract user ID from path /api/users/123
-    int user_id = 0;
-    sscanf(req->path, "/api/users/%d", &user_id);
-    
-    if (user_id > 0 && user_id <= 3) {
-        char json[256];
-        snprintf(json, sizeof(json),
-                 "{\"id\": %d, \"name\": \"User %d\", \"email\": \"user%d@example.com\"}",
-                 user_id, user_id, user_id);
-        set_json_response(res, 200, json);
-    } else {
-        set_json_response(res, 404, "{\"error\": \"User not found\"}");
+void json_string(JsonWriter* w, const char* s) {
+    json_string_n(w, s, strlen(s));
+}
+
+// Object member name; the value call that follows adds no separator
+void json_key(JsonWriter* w, const char* key) {
+    json_string(w, key);
+    json_raw(w, ": ", 2);
+    w->need_comma = false;
+}
+
+void json_uint(JsonWriter* w, uint64_t v) {
+    json_value_start(w);
+    char* out = json_reserve(w, 20);
+    if (out) w->len += format_u64(out, v);
+}
+
+void json_int(JsonWriter* w, int64_t v) {
+    json_value_start(w);
+    char* out = json_reserve(w, 21);
+    if (!out) return;
+    if (v < 0) {
+        *out++ = '-';
+        w->len++;
     }
+    w->len += format_u64(out, v < 0 ? -(uint64_t)v : (uint64_t)v);
 }
 
-void handle_user_delete(HttpRequest* req, HttpResponse* res) {
-    int user_id = 0;
-    sscanf(req->path, "/api/users/%d", &user_id);
+void json_bool(JsonWriter* w, bool v) {
+    json_value_start(w);
+    json_raw(w, v ? "true" : "false", v ? 4 : 5);
+}
+
+void json_null(JsonWriter* w) {
+    json_value_start(w);
+    json_raw(w, "null", 4);
+}
+
+// Make the document the response body, without copying it. Returns false
+// (and answers 500) if the writer failed.
+bool json_finish(JsonWriter* w, HttpResponse* res, int status) {
+    if (w->failed) {
+        set_response_body(res, 500, "text/plain", "", 0);
+        return false;
+    }
+    res->status_code = status;
+    res->content_type = "application/json";
+    res->body = w->data;
+    res->body_length = w->len;
+    return true;
+}
+
+// ============= Clock =============
+
+// Each worker keeps its own copy of the time, refreshed by clock_update()
+// once per event loop iteration. The formatted strings are rebuilt only
+// when the second changes, so requests never call time() or strftime().
+
+typedef struct {
+    time_t wall;            // time(NULL)
+    time_t mono;            // CLOCK_MONOTONIC seconds, for timeouts
+    uint64_t mono_ms;
+    char http_date[48];     // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    size_t http_date_len;
+    char log_time[32];      // ctime() layout without the newline
+} WorkerClock;
+
+static _Thread_local WorkerClock worker_clock;
+
+// RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+void format_http_date(time_t t, char* out, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void clock_update(void) {
+    WorkerClock* clock = &worker_clock;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    clock->mono = ts.tv_sec;
+    clock->mono_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    time_t now = time(NULL);
+    if (now == clock->wall) return;
+    clock->wall = now;
     
-    char json[128];
-    snprintf(json, sizeof(json),
-             "{\"message\": \"User %d deleted\", \"success\": true}",
-             user_id);
-    set_json_response(res, 200, json);
+    char date[32];
+    format_http_date(now, date, sizeof(date));
+    clock->http_date_len = snprintf(clock->http_date, sizeof(clock->http_date),
+                                    "Date: %s\r\n", date);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(clock->log_time, sizeof(clock->log_time), "%a %b %e %H:%M:%S %Y", &tm);
 }
 
-void handle_admin(HttpRequest* req, HttpResponse* res) {
-    set_json_response(res, 200, "{\"message\": \"Welcome to admin panel\"}");
+// The calling thread's clock; threads outside the event loop (startup)
+// get one on first use
+const WorkerClock* clock_get(void) {
+    if (worker_clock.wall == 0) clock_update();
+    return &worker_clock;
 }
 
-void handle_not_found(HttpRequest* req, HttpResponse* res) {
-    set_json_response(res, 404, "{\"error\": \"Route not found\"}");
+time_t monotonic_seconds(void) {
+    return clock_get()->mono;
 }
 
-// ============= Routing System =============
+uint64_t monotonic_ms(void) {
+    return clock_get()->mono_ms;
+}
 
-void register_route(HttpMethod method, const char* path, RouteHandler handler) {
-    if (server.route_count < MAX_ROUTES) {
-        server.routes[server.route_count].method = method;
-        strncpy(server.routes[server.route_count].path, path, 
-                sizeof(server.routes[server.route_count].path) - 1);
-        server.routes[server.route_count].handler = handler;
-        server.route_count++;
-    }
+// Uncached, for measuring latency
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void register_middleware(Middleware middleware) {
-    if (server.middleware_count < MAX_MIDDLEWARE) {
-        server.middleware[server.middleware_count++] = middleware;
+// ============= Byte Scanning =============
+
+// The parser spends most of its time skipping over runs of ordinary bytes
+// in paths, header names and header values. scan_stop() finds the first
+// byte that falls in any of a set's "stop" ranges, 16 or 32 bytes at a
+// time where the CPU allows. A set may over-report (a stop range can cover
+// a few legal bytes); the parser re-checks every byte it stops on.
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_X86 1
+#elif !defined(NO_SIMD) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+#define MAX_SCAN_RANGES 8 // Limit of one _mm_cmpestri range operand
+
+typedef struct {
+    unsigned char ranges[MAX_SCAN_RANGES * 2]; // Inclusive lo/hi pairs
+    int range_count;
+    bool stop[256];                            // Scalar lookup table
+} ScanSet;
+
+// Request-target: stop on controls, space, '?' and DEL
+static ScanSet scan_path = {{0x00, 0x20, '?', '?', 0x7f, 0x7f}, 3, {0}};
+// Query string: stop on controls, space and DEL
+static ScanSet scan_query = {{0x00, 0x20, 0x7f, 0x7f}, 2, {0}};
+// Header name: stop on ':' and every non-tchar. '|' and '~' fall inside the
+// last range to stay within eight ranges; they are legal and re-checked.
+static ScanSet scan_header_name = {{0x00, 0x20, '"', '"', '(', ')', ',', ',',
+                                    '/', '/', ':', '@', '[', ']', '{', 0xff}, 8, {0}};
+// Header value: stop on CR, LF and other controls except TAB
+static ScanSet scan_header_value = {{0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f}, 3, {0}};
+
+static size_t scan_stop_scalar(const char* p, size_t len, const ScanSet* set) {
+    size_t i = 0;
+    while (i < len && !set->stop[(unsigned char)p[i]]) i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse4.2")))
+static size_t scan_stop_sse42(const char* p, size_t len, const ScanSet* set) {
+    __m128i ranges = _mm_loadu_si128((const __m128i*)set->ranges);
+    int range_len = set->range_count * 2;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+        int idx = _mm_cmpestri(ranges, range_len, chunk, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) return i + idx;
     }
+    return i + scan_stop_scalar(p + i, len - i, set);
 }
 
-bool path_matches(const char* route_path, const char* req_path) {
-    // Exact match
-    if (strcmp(route_path, req_path) == 0) {
-        return true;
+__attribute__((target("avx2")))
+static size_t scan_stop_avx2(const char* p, size_t len, const ScanSet* set) {
+    __m256i lo[MAX_SCAN_RANGES], hi[MAX_SCAN_RANGES];
+    for (int r = 0; r < set->range_count; r++) {
+        lo[r] = _mm256_set1_epi8((char)set->ranges[r * 2]);
+        hi[r] = _mm256_set1_epi8((char)set->ranges[r * 2 + 1]);
     }
-    
-    // Pattern match for /api/users/:id style routes
-    if (strstr(route_path, "/:id")) {
-        char pattern[256];
-        strncpy(pattern, route_path, sizeof(pattern) - 1);
-        char* placeholder = strstr(pattern, "/:id");
-        if (placeholder) {
-            *placeholder = '\0';
-            if (strncmp(pattern, req_path, strlen(pattern)) == 0) {
-                return true;
-            }
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i hit = _mm256_setzero_si256();
+        for (int r = 0; r < set->range_count; r++) {
+            // Unsigned lo <= x <= hi via max/min, AVX2 has no unsigned compare
+            __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, lo[r]), chunk);
+            __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, hi[r]), chunk);
+            hit = _mm256_or_si256(hit, _mm256_and_si256(ge, le));
         }
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask) return i + __builtin_ctz(mask);
     }
-    
-    return false;
+    return i + scan_stop_scalar(p + i, len - i, set);
 }
+#endif
 
-RouteHandler find_handler(HttpRequest* req) {
-    for (int i = 0; i < server.route_count; i++) {
-        if (server.routes[i].method == req->method &&
-            path_matches(server.routes[i].path, req->path)) {
-            return server.routes[i].handler;
+#ifdef SCAN_NEON
+static size_t scan_stop_neon(const char* p, size_t len, const ScanSet* set) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t*)(p + i));
+        uint8x16_t hit = vdupq_n_u8(0);
+        for (int r = 0; r < set->range_count; r++) {
+            uint8x16_t ge = vcgeq_u8(chunk, vdupq_n_u8(set->ranges[r * 2]));
+            uint8x16_t le = vcleq_u8(chunk, vdupq_n_u8(set->ranges[r * 2 + 1]));
+            hit = vorrq_u8(hit, vandq_u8(ge, le));
         }
+        // Narrow to a 64-bit mask with four bits per input byte
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(hit), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask) return i + (__builtin_ctzll(mask) >> 2);
     }
-    return handle_not_found;
+    return i + scan_stop_scalar(p + i, len - i, set);
 }
+#endif
 
-void handle_request(HttpRequest* req, HttpResponse* res) {
-    // Execute middleware chain
-    for (int i = 0; i < server.middleware_count; i++) {
-        if (!server.middleware[i](req, res)) {
-            return; // Middleware stopped the request
+static size_t (*scan_stop_impl)(const char*, size_t, const ScanSet*) = scan_stop_scalar;
+const char* scan_impl_name = "scalar";
+
+static inline size_t scan_stop(const char* p, size_t len, const ScanSet* set) {
+    return scan_stop_impl(p, len, set);
+}
+
+static void scan_set_init(ScanSet* set) {
+    for (int r = 0; r < set->range_count; r++) {
+        for (int c = set->ranges[r * 2]; c <= set->ranges[r * 2 + 1]; c++) {
+            set->stop[c] = true;
         }
     }
-    
-    // Find and execute handler
-    RouteHandler handler = find_handler(req);
-    handler(req, res);
 }
 
-// ============= Server Setup =============
+// Build lookup tables and pick the widest implementation the CPU supports.
+// Must run before any worker starts parsing.
+void scan_init(void) {
+    scan_set_init(&scan_path);
+    scan_set_init(&scan_query);
+    scan_set_init(&scan_header_name);
+    scan_set_init(&scan_header_value);
 
-void setup_routes() {
-    // Register middleware (order matters!)
-    register_middleware(logger_middleware);
-    register_middleware(auth_middleware);
-    register_middleware(cors_middleware);
-    
-    // Register routes
-    register_route(GET, "/", handle_home);
-    register_route(GET, "/api/hello", handle_hello);
-    register_route(GET, "/api/time", handle_time);
-    register_route(GET, "/api/users", handle_users_list);
-    register_route(POST, "/api/users", handle_user_create);
-    register_route(GET, "/api/users/:id", handle_user_get);
-    register_route(DELETE, "/api/users/:id", handle_user_delete);
-    register_route(GET, "/admin", handle_admin);
-}
-
-void send_response(int client_sock, HttpResponse* res) {
-    char response[8192];
-    int len = snprintf(response, sizeof(response),
-                      "HTTP/1.1 %d %s\r\n"
-                      "Content-Type: %s\r\n"
-                      "Content-Length: %d\r\n"
-                      "Connection: close\r\n"
-                      "\r\n"
-                      "%s",
-                      res->status_code,
-                      get_status_text(res->status_code),
-                      res->content_type,
-                      res->body_length,
-                      res->body);
-    
-    send(client_sock, response, len, 0);
-}
-
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
-    
-    // Initialize server
-    setup_routes();
-    
-    // Create socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        exit(1);
+#if defined(SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_stop_impl = scan_stop_avx2;
+        scan_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_stop_impl = scan_stop_sse42;
+        scan_impl_name = "sse4.2";
     }
-    
+#elif defined(SCAN_NEON)
+    scan_stop_impl = scan_stop_neon;
+    scan_impl_name = "neon";
+#endif
+}
+
+// ============= Header Index =============
+
+// Header names are hashed once, case-insensitively, when the parser
+// finishes them. Known names map to a HeaderId through a small table
+// built at startup; the rest go into the request's open-addressed slots.
+
+static const char* const header_names[HDR_COUNT] = {
+    [HDR_HOST] = "Host",
+    [HDR_CONTENT_LENGTH] = "Content-Length",
+    [HDR_CONTENT_TYPE] = "Content-Type",
+    [HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HDR_CONNECTION] = "Connection",
+    [HDR_EXPECT] = "Expect",
+    [HDR_AUTHORIZATION] = "Authorization",
+    [HDR_ACCEPT] = "Accept",
+    [HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HDR_USER_AGENT] = "User-Agent",
+    [HDR_CACHE_CONTROL] = "Cache-Control",
+    [HDR_IF_NONE_MATCH] = "If-None-Match",
+    [HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [HDR_RANGE] = "Range",
+    [HDR_IF_RANGE] = "If-Range",
+    [HDR_ORIGIN] = "Origin",
+};
+
+#define KNOWN_HEADER_SLOTS 64 // Power of two, well above HDR_COUNT
+
+static uint8_t known_header_table[KNOWN_HEADER_SLOTS]; // HeaderId, 0 = empty
+
+// FNV-1a over the name with ASCII letters folded to lower case. The fold
+// (| 0x20) also merges a few non-letter pairs; callers compare names on a
+// hash match anyway.
+static inline uint32_t header_hash(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ ((unsigned char)name[i] | 0x20)) * 16777619u;
+    }
+    return h;
+}
+
+static inline bool header_name_eq(const char* a, size_t a_len, const char* b, size_t b_len) {
+    return a_len == b_len && strncasecmp(a, b, a_len) == 0;
+}
+
+void header_index_init(void) {
+    for (int id = 1; id < HDR_COUNT; id++) {
+        uint32_t slot = header_hash(header_names[id], strlen(header_names[id]));
+        while (known_header_table[slot & (KNOWN_HEADER_SLOTS - 1)]) slot++;
+        known_header_table[slot & (KNOWN_HEADER_SLOTS - 1)] = (uint8_t)id;
+    }
+}
+
+// HeaderId of a name with the given hash, HDR_OTHER if it isn't interned
+static HeaderId header_intern(const char* name, size_t len, uint32_t hash) {
+    for (uint32_t slot = hash;; slot++) {
+        int id = known_header_table[slot & (KNOWN_HEADER_SLOTS - 1)];
+        if (id == 0) return HDR_OTHER;
+        const char* known = header_names[id];
+        if (header_name_eq(name, len, known, strlen(known))) return (HeaderId)id;
+    }
+}
+
+// Index one header; returns false for a repeat that is already indexed
+static bool header_index_add(HeaderIndex* index, const HttpHeader* headers, int i) {
+    const HttpHeader* h = &headers[i];
+    if (h->id != HDR_OTHER) {
+        if (index->known[h->id]) return false;
+        index->known[h->id] = (uint8_t)(i + 1);
+        return true;
+    }
+    for (uint32_t slot = h->hash;; slot++) {
+        uint8_t* entry = &index->slots[slot & (HEADER_SLOTS - 1)];
+        if (*entry == 0) {
+            *entry = (uint8_t)(i + 1);
+            return true;
+        }
+        const HttpHeader* other = &headers[*entry - 1];
+        if (other->hash == h->hash && strcasecmp(other->name, h->name) == 0) return false;
+    }
+}
+
+// ============= Request Parser =============
+
+// Incremental, single-pass HTTP/1.x parser. It walks the receive buffer
+// once, recording offset/length slices relative to the start of the
+// request, and can be resumed after every read. Offsets (not pointers)
+// keep it valid when the buffer is grown or compacted between reads.
+
+static inline bool is_token_char(unsigned char c) {
+    // RFC 7230 tchar, enough for methods and header names
+    return c > 0x20 && c < 0x7f && !strchr("\"(),/:;<=>?@[\\]{}", c);
+}
+
+static inline bool is_target_char(unsigned char c) {
+    return c > 0x20 && c != 0x7f;
+}
+
+void parser_reset(HttpParser* p) {
+    memset(p, 0, sizeof(*p));
+    p->state = P_METHOD;
+    p->body_limit = config.max_body;
+}
+
+// Inspect headers the connection layer needs while the head is parsed
+static bool parser_on_header(HttpParser* p, const char* buf, const HeaderSlice* h) {
+    const char* value = buf + h->value.off;
+
+    if (h->id == HDR_CONTENT_LENGTH) {
+        if (h->value.len == 0 || p->has_content_length) return false;
+        size_t length = 0;
+        for (uint32_t i = 0; i < h->value.len; i++) {
+            if (value[i] < '0' || value[i] > '9') return false;
+            if (length > (SIZE_MAX - 9) / 10) {
+                p->error_status = 413;
+                return false;
+            }
+            length = length * 10 + (value[i] - '0');
+        }
+        p->content_length = length;
+        p->has_content_length = true;
+    } else if (h->id == HDR_TRANSFER_ENCODING) {
+        // Only chunked is supported, and it must be the final coding
+        if (h->value.len != 7 || strncasecmp(value, "chunked", 7) != 0 || p->chunked) {
+            p->error_status = 501;
+            return false;
+        }
+        p->chunked = true;
+    } else if (h->id == HDR_EXPECT) {
+        if (h->value.len == 12 && strncasecmp(value, "100-continue", 12) == 0) p->expect_continue = true;
+    } else if (h->id == HDR_CONNECTION) {
+        if (h->value.len == 5 && strncasecmp(value, "close", 5) == 0) p->conn_close = true;
+        if (h->value.len == 10 && strncasecmp(value, "keep-alive", 10) == 0) p->conn_keep_alive = true;
+    }
+    return true;
+}
+
+static ParseResult parser_fail(HttpParser* p, int status) {
+    p->state = P_ERROR;
+    if (!p->error_status) p->error_status = status;
+    return PARSE_ERROR;
+}
+
+static ParseResult parser_done(HttpParser* p, size_t pos) {
+    p->pos = pos;
+    p->message_len = pos;
+    p->body = (Slice){(uint32_t)p->head_len, (uint32_t)(p->body_end - p->head_len)};
+    p->state = P_DONE;
+    return PARSE_DONE;
+}
+
+static inline int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Body framing. Content-Length bodies are left where they are; chunked
+// bodies are decoded in place, each chunk's data moved down over the
+// framing before it, so the decoded body is always contiguous at
+// [head_len, body_end) however it was split on the wire.
+static ParseResult parse_body(HttpParser* p, char* buf, size_t len) {
+    size_t pos = p->pos;
+
+    if (p->state == P_BODY) {
+        if (p->content_length > p->body_limit) return parser_fail(p, 413);
+        size_t want = p->content_length - p->body_total;
+        size_t n = len - pos < want ? len - pos : want;
+        pos += n;
+        p->body_total += n;
+        p->body_end = pos;
+        p->pos = pos;
+        if (p->body_total < p->content_length) return PARSE_AGAIN;
+        return parser_done(p, pos);
+    }
+
+    while (pos < len) {
+        unsigned char c = buf[pos];
+        if (++p->frame_bytes > MAX_CHUNK_FRAME && p->state != P_CHUNK_DATA) {
+            return parser_fail(p, 431);
+        }
+
+        switch (p->state) {
+            case P_CHUNK_SIZE: {
+                int digit = hex_value(c);
+                if (digit >= 0) {
+                    if (p->chunk_remaining > (SIZE_MAX >> 4)) return parser_fail(p, 413);
+                    p->chunk_remaining = (p->chunk_remaining << 4) | (size_t)digit;
+                    break;
+                }
+                if (p->frame_bytes == 1) return parser_fail(p, 400); // No digits
+                if (c == ';' || c == ' ' || c == '\t') p->state = P_CHUNK_EXT;
+                else if (c == '\r') p->state = P_CHUNK_SIZE_LF;
+                else return parser_fail(p, 400);
+                break;
+            }
+
+            case P_CHUNK_EXT:
+                // Extensions carry nothing we use
+                if (c == '\r') p->state = P_CHUNK_SIZE_LF;
+                else if (c < 0x20 && c != '\t') return parser_fail(p, 400);
+                break;
+
+            case P_CHUNK_SIZE_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                if (p->chunk_remaining > p->body_limit - p->body_total) return parser_fail(p, 413);
+                p->frame_bytes = 0;
+                p->state = p->chunk_remaining ? P_CHUNK_DATA : P_TRAILER_START;
+                break;
+
+            case P_CHUNK_DATA: {
+                size_t n = len - pos < p->chunk_remaining ? len - pos : p->chunk_remaining;
+                if (p->body_end != pos) memmove(buf + p->body_end, buf + pos, n);
+                p->body_end += n;
+                p->body_total += n;
+                p->chunk_remaining -= n;
+                pos += n;
+                if (p->chunk_remaining == 0) p->state = P_CHUNK_DATA_CR;
+                continue;
+            }
+
+            case P_CHUNK_DATA_CR:
+                if (c != '\r') return parser_fail(p, 400);
+                p->state = P_CHUNK_DATA_LF;
+                break;
+
+            case P_CHUNK_DATA_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                p->frame_bytes = 0;
+                p->state = P_CHUNK_SIZE;
+                break;
+
+            case P_TRAILER_START:
+                // Trailer fields are read and ignored
+                p->state = c == '\r' ? P_TRAILERS_LF : P_TRAILER_LINE;
+                break;
+
+            case P_TRAILER_LINE:
+                if (c == '\r') p->state = P_TRAILER_LF;
+                break;
+
+            case P_TRAILER_LF:
+            case P_TRAILERS_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                if (p->state == P_TRAILERS_LF) return parser_done(p, pos + 1);
+                p->state = P_TRAILER_START;
+                break;
+
+            default:
+                return parser_fail(p, 400);
+        }
+        pos++;
+    }
+    p->pos = pos;
+    return PARSE_AGAIN;
+}
+
+// Remove the framing between the decoded body and the unparsed rest of
+// the buffer; with keep_body false the decoded bytes go too (they have
+// been handed to a BodyReader). Returns how many bytes were removed.
+size_t parser_compact(HttpParser* p, char* buf, size_t len, bool keep_body) {
+    if (p->state <= P_HEAD_LF) return 0; // Still in the head
+    if (!keep_body) p->body_end = p->head_len;
+    size_t removed = p->pos - p->body_end;
+    if (removed) memmove(buf + p->body_end, buf + p->pos, len - p->pos);
+    p->pos = p->body_end;
+    if (p->state == P_DONE) p->message_len = p->pos;
+    return removed;
+}
+
+ParseResult parse_request(HttpParser* p, char* buf, size_t len) {
+    size_t pos = p->pos;
+
+    while (pos < len && p->state < P_BODY) {
+        unsigned char c = buf[pos];
+
+        switch (p->state) {
+            case P_METHOD:
+                if (c == ' ') {
+                    if (pos == 0) return parser_fail(p, 400);
+                    p->method = (Slice){0, (uint32_t)pos};
+                    p->mark = pos + 1;
+                    p->state = P_PATH;
+                } else if (c < 'A' || c > 'Z' || pos >= 16) {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_PATH:
+                pos += scan_stop(buf + pos, len - pos, &scan_path);
+                if (pos == len) continue;
+                c = buf[pos];
+                if (c == ' ' || c == '?') {
+                    if (pos == p->mark) return parser_fail(p, 400);
+                    p->path = (Slice){(uint32_t)p->mark, (uint32_t)(pos - p->mark)};
+                    p->mark = pos + 1;
+                    p->has_query = c == '?';
+                    p->state = c == '?' ? P_QUERY : P_VERSION;
+                } else if (!is_target_char(c)) {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_QUERY:
+                pos += scan_stop(buf + pos, len - pos, &scan_query);
+                if (pos == len) continue;
+                c = buf[pos];
+                if (c == ' ') {
+                    p->query = (Slice){(uint32_t)p->mark, (uint32_t)(pos - p->mark)};
+                    p->mark = pos + 1;
+                    p->state = P_VERSION;
+                } else if (!is_target_char(c)) {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_VERSION:
+                if (c == '\r' || c == '\n') {
+                    p->version = (Slice){(uint32_t)p->mark, (uint32_t)(pos - p->mark)};
+                    if (p->version.len != 8 || strncmp(buf + p->mark, "HTTP/1.", 7) != 0) {
+                        return parser_fail(p, 400);
+                    }
+                    p->state = c == '\r' ? P_LINE_LF : P_HEADER_START;
+                }
+                break;
+
+            case P_LINE_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                p->state = P_HEADER_START;
+                break;
+
+            case P_HEADER_START:
+                if (c == '\r') {
+                    p->state = P_HEAD_LF;
+                } else if (c == '\n') {
+                    p->state = P_HEAD_LF;
+                    continue; // Bare LF ends the head too
+                } else if (is_token_char(c)) {
+                    if (p->header_count >= MAX_HEADERS) return parser_fail(p, 431);
+                    p->mark = pos;
+                    p->state = P_HEADER_NAME;
+                } else {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_HEADER_NAME:
+                pos += scan_stop(buf + pos, len - pos, &scan_header_name);
+                if (pos == len) continue;
+                c = buf[pos];
+                if (c == ':') {
+                    if (pos == p->mark) return parser_fail(p, 400);
+                    HeaderSlice* h = &p->headers[p->header_count];
+                    h->name = (Slice){(uint32_t)p->mark, (uint32_t)(pos - p->mark)};
+                    h->hash = header_hash(buf + p->mark, h->name.len);
+                    h->id = header_intern(buf + p->mark, h->name.len, h->hash);
+                    p->state = P_HEADER_VALUE_START;
+                } else if (!is_token_char(c)) {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_HEADER_VALUE_START:
+                if (c == ' ' || c == '\t') break;
+                p->mark = pos;
+                p->state = P_HEADER_VALUE;
+                continue; // Re-examine this byte as part of the value
+
+            case P_HEADER_VALUE:
+                pos += scan_stop(buf + pos, len - pos, &scan_header_value);
+                if (pos == len) continue;
+                c = buf[pos];
+                if (c == '\r' || c == '\n') {
+                    size_t end = pos;
+                    while (end > p->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) end--;
+                    HeaderSlice* h = &p->headers[p->header_count++];
+                    h->value = (Slice){(uint32_t)p->mark, (uint32_t)(end - p->mark)};
+                    if (!parser_on_header(p, buf, h)) return parser_fail(p, 400);
+                    p->state = c == '\r' ? P_HEADER_LF : P_HEADER_START;
+                } else if (c < 0x20 && c != '\t') {
+                    return parser_fail(p, 400);
+                }
+                break;
+
+            case P_HEADER_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                p->state = P_HEADER_START;
+                break;
+
+            case P_HEAD_LF:
+                if (c != '\n') return parser_fail(p, 400);
+                if (p->chunked && p->has_content_length) return parser_fail(p, 400); // Smuggling vector
+                p->head_len = pos + 1;
+                p->body_end = p->head_len;
+                p->state = p->chunked ? P_CHUNK_SIZE : P_BODY;
+                break;
+
+            default:
+                return parser_fail(p, 400);
+        }
+        pos++;
+    }
+    p->pos = pos;
+
+    if (p->state < P_BODY) {
+        return PARSE_AGAIN;
+    }
+    if (!p->head_reported && (p->chunked || p->content_length)) {
+        // Let the connection pick buffering or streaming first
+        p->head_reported = true;
+        return PARSE_HEAD;
+    }
+    return parse_body(p, buf, len);
+}
+
+// Build an HttpRequest from a completed parse. Each slice is terminated in
+// place by overwriting its delimiter (space, '?', ':' or CR), so handlers
+// get ordinary C strings that alias the receive buffer with no copying.
+// The byte after the body belongs to the next pipelined request, so the
+// caller must save and restore it around the handler. Called before the
+// body has arrived (streamed uploads), it leaves the body empty.
+bool parser_build_request(HttpParser* p, char* buf, HttpRequest* req, Arena* arena) {
+    buf[p->method.off + p->method.len] = '\0';
+    req->method = parse_method(buf + p->method.off);
+
+    buf[p->path.off + p->path.len] = '\0';
+    req->path = buf + p->path.off;
+    req->path_len = p->path.len;
+
+    if (p->has_query) {
+        buf[p->query.off + p->query.len] = '\0';
+        req->query_string = buf + p->query.off;
+        req->query_length = p->query.len;
+    } else {
+        req->query_string = "";
+        req->query_length = 0;
+    }
+
+    req->headers = arena_alloc(arena, p->header_count * sizeof(HttpHeader));
+    if (!req->headers) return false;
+    req->header_count = p->header_count;
+    for (int i = 0; i < p->header_count; i++) {
+        HeaderSlice* h = &p->headers[i];
+        buf[h->name.off + h->name.len] = '\0';
+        buf[h->value.off + h->value.len] = '\0';
+        req->headers[i].name = buf + h->name.off;
+        req->headers[i].value = buf + h->value.off;
+        req->headers[i].value_len = h->value.len;
+        req->headers[i].id = h->id;
+        req->headers[i].hash = h->hash;
+        header_index_add(&req->header_index, req->headers, i);
+    }
+
+    if (p->state == P_DONE) {
+        req->body = buf + p->body.off;
+        req->body_length = p->body.len;
+        buf[p->body.off + p->body.len] = '\0';
+    } else {
+        req->body = "";
+        req->body_length = 0;
+    }
+
+    // HTTP/1.1 defaults to persistent connections, HTTP/1.0 must opt in
+    req->http11 = buf[p->version.off + 7] == '1';
+    req->keep_alive = req->http11 ? !p->conn_close : p->conn_keep_alive;
+    return true;
+}
+
+// Value of an interned header, NULL when absent
+const char* http_header(const HttpRequest* req, HeaderId id) {
+    int i = req->header_index.known[id];
+    return i ? req->headers[i - 1].value : NULL;
+}
+
+// Case-insensitive lookup by name; returns NULL when the header is absent.
+// Prefer http_header() for the names in HeaderId, which skips the hashing.
+const char* http_get_header(const HttpRequest* req, const char* name) {
+    size_t len = strlen(name);
+    uint32_t hash = header_hash(name, len);
+    HeaderId id = header_intern(name, len, hash);
+    if (id != HDR_OTHER) return http_header(req, id);
+
+    for (uint32_t slot = hash;; slot++) {
+        int i = req->header_index.slots[slot & (HEADER_SLOTS - 1)];
+        if (i == 0) return NULL;
+        const HttpHeader* h = &req->headers[i - 1];
+        if (h->hash == hash && strcasecmp(h->name, name) == 0) return h->value;
+    }
+}
+
+// ============= Path Parameters =============
+
+// Parameters captured by the router are slices of req->path, in the order
+// they appear in the route pattern. Lookup by index is O(1); lookup by name
+// scans at most MAX_PARAMS names on the matched route.
+
+const ParamCapture* req_param_at(const HttpRequest* req, int index) {
+    if (index < 0 || index >= req->param_count) return NULL;
+    return &req->params[index];
+}
+
+int req_param_index(const HttpRequest* req, const char* name) {
+    if (!req->route) return -1;
+    for (int i = 0; i < req->param_count; i++) {
+        if (strcmp(req->route->param_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// Returns the raw parameter text (not NUL-terminated) and its length
+const char* req_param(const HttpRequest* req, const char* name, size_t* len) {
+    const ParamCapture* param = req_param_at(req, req_param_index(req, name));
+    if (!param) return NULL;
+    if (len) *len = param->len;
+    return req->path + param->off;
+}
+
+// Returns false unless the parameter was matched by a ":name<int>" segment
+bool req_param_int(const HttpRequest* req, const char* name, long* value) {
+    const ParamCapture* param = req_param_at(req, req_param_index(req, name));
+    if (!param || !param->is_int) return false;
+    *value = param->int_value;
+    return true;
+}
+
+// ============= Compression =============
+
+// Responses are compressed by the compress_response() filter once the
+// handler has run. The coding is negotiated from Accept-Encoding; codings
+// are compiled in with make GZIP=1 (default), BROTLI=1 and ZSTD=1. gzip
+// and zstd keep one compressor per thread that is reset between requests.
+// Brotli has no reset, so it is only used for responses that are stored
+// and served many times: constant routes, cache entries, and .br files
+// next to static files.
+
+#define COMPRESS_MIN_SIZE 256    // Smaller bodies gain less than the header costs
+#define GZIP_LEVEL 5             // Per-request responses
+#define GZIP_LEVEL_STORED 9      // Compressed once, served many times
+#define ZSTD_LEVEL 3
+#define ZSTD_LEVEL_STORED 19
+#define BROTLI_QUALITY_STORED 9
+
+static const char* const encoding_names[ENC_COUNT] = {"identity", "gzip", "br", "zstd"};
+static const char* const encoding_suffixes[ENC_COUNT] = {"", ".gz", ".br", ".zst"};
+
+// Server preference, best first
+static const ContentEncoding encoding_preference[] = {ENC_BROTLI, ENC_ZSTD, ENC_GZIP};
+
+static bool encoding_available(ContentEncoding enc) {
+    switch (enc) {
+#ifdef HAVE_ZLIB
+        case ENC_GZIP: return true;
+#endif
+#ifdef HAVE_BROTLI
+        case ENC_BROTLI: return true;
+#endif
+#ifdef HAVE_ZSTD
+        case ENC_ZSTD: return true;
+#endif
+        default: return false;
+    }
+}
+
+static bool compressible_type(const char* type) {
+    return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/json") == 0 ||
+           strcmp(type, "application/javascript") == 0 || strcmp(type, "image/svg+xml") == 0 ||
+           strcmp(type, "application/wasm") == 0;
+}
+
+// q-value of an Accept-Encoding item as 0-1000; "q=" missing means 1
+static int parse_qvalue(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) p++;
+    if (end - p < 3 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') return 1000;
+    p += 2;
+    if (*p == '1') return 1000;
+    int q = 0, scale = 100;
+    if (*p++ != '0') return 0;
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9' && scale > 0; p++, scale /= 10) {
+            q += (*p - '0') * scale;
+        }
+    }
+    return q;
+}
+
+// The coding among allowed (bit per ContentEncoding) with the client's
+// highest q-value, server preference breaking ties
+static ContentEncoding negotiate_allowed(const HttpRequest* req, unsigned allowed) {
+    const char* p = http_header(req, HDR_ACCEPT_ENCODING);
+    if (!p) return ENC_IDENTITY;
+
+    int q[ENC_COUNT] = {-1, -1, -1, -1};
+    int star = -1;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char* name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t len = p - name;
+        const char* item_end = p;
+        while (*item_end && *item_end != ',') item_end++;
+        int value = parse_qvalue(p, item_end);
+        p = item_end;
+
+        if (len == 1 && name[0] == '*') {
+            star = value;
+        } else if (len == 2 && strncasecmp(name, "br", 2) == 0) {
+            q[ENC_BROTLI] = value;
+        } else if (len == 4 && strncasecmp(name, "zstd", 4) == 0) {
+            q[ENC_ZSTD] = value;
+        } else if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+                   (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            q[ENC_GZIP] = value;
+        }
+    }
+
+    ContentEncoding best = ENC_IDENTITY;
+    int best_q = 0;
+    for (size_t i = 0; i < sizeof(encoding_preference) / sizeof(encoding_preference[0]); i++) {
+        ContentEncoding enc = encoding_preference[i];
+        if (!(allowed & (1u << enc))) continue;
+        int value = q[enc] >= 0 ? q[enc] : (star >= 0 ? star : 0);
+        if (value > best_q) {
+            best = enc;
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+// The coding to use when compressing a response to req. Brotli only
+// counts for stored responses.
+ContentEncoding negotiate_encoding(const HttpRequest* req, bool stored) {
+    unsigned allowed = 0;
+    for (int enc = ENC_GZIP; enc < ENC_COUNT; enc++) {
+        if (encoding_available(enc) && (enc != ENC_BROTLI || stored)) allowed |= 1u << enc;
+    }
+    return allowed ? negotiate_allowed(req, allowed) : ENC_IDENTITY;
+}
+
+#ifdef HAVE_ZLIB
+static _Thread_local z_stream* gzip_stream; // Per thread, deflateReset() per use
+static _Thread_local int gzip_stream_level;
+
+static size_t gzip_compress(const char* in, size_t len, char* out, size_t cap, int level) {
+    if (!gzip_stream) {
+        gzip_stream = calloc(1, sizeof(z_stream));
+        // windowBits 15 + 16 selects the gzip wrapper
+        if (!gzip_stream || deflateInit2(gzip_stream, level, Z_DEFLATED, 15 + 16, 8,
+                                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(gzip_stream);
+            gzip_stream = NULL;
+            return 0;
+        }
+        gzip_stream_level = level;
+    } else {
+        deflateReset(gzip_stream);
+        if (level != gzip_stream_level && deflateParams(gzip_stream, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+            gzip_stream_level = level;
+        }
+    }
+    gzip_stream->next_in = (Bytef*)in;
+    gzip_stream->avail_in = (uInt)len;
+    gzip_stream->next_out = (Bytef*)out;
+    gzip_stream->avail_out = (uInt)cap;
+    if (deflate(gzip_stream, Z_FINISH) != Z_STREAM_END) return 0;
+    return cap - gzip_stream->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static _Thread_local ZSTD_CCtx* zstd_cctx; // Per thread, reused across calls
+
+static size_t zstd_compress(const char* in, size_t len, char* out, size_t cap, int level) {
+    if (!zstd_cctx) zstd_cctx = ZSTD_createCCtx();
+    if (!zstd_cctx) return 0;
+    size_t n = ZSTD_compressCCtx(zstd_cctx, out, cap, in, len, level);
+    return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+// Worst-case output size for len input bytes, 0 if enc isn't built in
+static size_t compress_bound(ContentEncoding enc, size_t len) {
+    switch (enc) {
+#ifdef HAVE_ZLIB
+        case ENC_GZIP: return compressBound((uLong)len) + 18; // gzip header and trailer
+#endif
+#ifdef HAVE_BROTLI
+        case ENC_BROTLI: return BrotliEncoderMaxCompressedSize(len);
+#endif
+#ifdef HAVE_ZSTD
+        case ENC_ZSTD: return ZSTD_compressBound(len);
+#endif
+        default: return 0;
+    }
+}
+
+// Compressed length, or 0 on failure
+static size_t compress_buffer(ContentEncoding enc, bool stored, const char* in, size_t len,
+                              char* out, size_t cap) {
+    switch (enc) {
+#ifdef HAVE_ZLIB
+        case ENC_GZIP: return gzip_compress(in, len, out, cap, stored ? GZIP_LEVEL_STORED : GZIP_LEVEL);
+#endif
+#ifdef HAVE_BROTLI
+        case ENC_BROTLI: {
+            size_t n = cap;
+            if (!BrotliEncoderCompress(BROTLI_QUALITY_STORED, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                       len, (const uint8_t*)in, &n, (uint8_t*)out)) {
+                return 0;
+            }
+            return n;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case ENC_ZSTD: return zstd_compress(in, len, out, cap, stored ? ZSTD_LEVEL_STORED : ZSTD_LEVEL);
+#endif
+        default:
+            (void)stored; (void)in; (void)len; (void)out; (void)cap;
+            return 0;
+    }
+}
+
+// Would compress_body() consider this response? Such responses vary on
+// Accept-Encoding whatever the client sent.
+static bool response_compressible(const HttpResponse* res) {
+    return res->status_code == 200 && !res->prebuilt && !res->producer && !res->file &&
+           res->body_length >= COMPRESS_MIN_SIZE && compressible_type(res->content_type);
+}
+
+// Replace the body with its enc-coded form from the arena. Leaves the
+// response alone (and returns false) when that doesn't make it smaller.
+bool compress_body(HttpResponse* res, ContentEncoding enc, bool stored) {
+    size_t cap = compress_bound(enc, res->body_length);
+    if (cap == 0) return false;
+    char* out = arena_alloc(res->arena, cap);
+    if (!out) return false;
+    size_t n = compress_buffer(enc, stored, res->body, res->body_length, out, cap);
+    if (n == 0 || n >= res->body_length) return false;
+    if (!add_response_header(res, "Content-Encoding", encoding_names[enc])) return false;
+    res->body = out;
+    res->body_length = n;
+    return true;
+}
+
+// Response filter: compress eligible bodies with the negotiated coding.
+// Register it before cache_store() so cache entries keep the encoded
+// body (cache keys include the coding, see cache_key()).
+void compress_response(HttpRequest* req, HttpResponse* res) {
+    if (!response_compressible(res)) return;
+    add_response_header(res, "Vary", "Accept-Encoding");
+    ContentEncoding enc = negotiate_encoding(req, req->cache_fill != NULL);
+    if (enc != ENC_IDENTITY) compress_body(res, enc, req->cache_fill != NULL);
+}
+
+// ============= Metrics =============
+
+// Every worker records into its own WorkerMetrics; nothing on the request
+// path is shared between threads. Counters are atomics with a single
+// writer, so an update is a plain load and store. handle_metrics() sums
+// all workers only when /metrics is scraped.
+//
+// Histograms are log-linear in nanoseconds (HDR style): each power of two
+// is split into HIST_SUB buckets, giving about 25% relative precision
+// from 1 ns to 2^37 ns (about 137 s); anything longer lands in the last
+// bucket.
+
+#define HIST_SUB 4
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_EXP - 1) * HIST_SUB)
+
+typedef enum {
+    STAGE_ACCEPT,           // accept() through registering the socket
+    STAGE_PARSE,            // One parse_request() call
+    STAGE_ROUTE,            // find_handler()
+    STAGE_HANDLER,
+    STAGE_SEND,             // send_response(): serialize and queue
+    STAGE_COUNT
+} MetricStage;
+
+static const char* stage_names[STAGE_COUNT] = {
+    "accept", "parse", "route", "handler", "send",
+};
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+} Histogram;
+
+typedef struct {
+    Histogram latency;      // Dispatch to response queued
+    _Atomic uint64_t status[STATUS_MAX - STATUS_MIN + 1];
+} RouteMetrics;
+
+typedef struct {
+    Histogram stages[STAGE_COUNT];
+    Histogram middleware[MAX_MIDDLEWARE];
+    RouteMetrics* routes;   // server.route_count entries, then unmatched
+    _Atomic uint64_t connections;
+    _Atomic uint64_t parse_errors;
+    _Atomic uint64_t tls_handshakes;
+    _Atomic uint64_t tls_resumed;   // Handshakes that reused a session
+    _Atomic uint64_t tls_ktls;      // Handshakes that moved encryption into the kernel
+    _Atomic uint64_t conns_rejected; // Over --max-conns
+    _Atomic uint64_t rate_limited;  // Answered 429 by rate_limit_middleware()
+    _Atomic uint64_t shed;          // Answered with the overload 503
+} WorkerMetrics;
+
+static WorkerMetrics* metrics_slots[MAX_WORKERS];
+static _Thread_local WorkerMetrics* worker_metrics; // Set by run_event_loop()
+
+// Single-writer increment: no locked instruction needed
+static inline void counter_add(_Atomic uint64_t* c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v); // >= 2
+    int index = HIST_SUB + (e - 2) * HIST_SUB + (int)((v >> (e - 2)) & (HIST_SUB - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+static inline void hist_record(Histogram* h, uint64_t ns) {
+    counter_add(&h->buckets[hist_bucket(ns)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum_ns, ns);
+}
+
+// Record a stage timing for the calling worker (no-op elsewhere)
+static inline void metrics_stage(MetricStage stage, uint64_t start_ns) {
+    if (worker_metrics) hist_record(&worker_metrics->stages[stage], monotonic_ns() - start_ns);
+}
+
+// Allocate a worker's metrics; call after setup_routes()
+WorkerMetrics* metrics_create(int worker_id) {
+    WorkerMetrics* m = calloc(1, sizeof(WorkerMetrics));
+    if (!m) return NULL;
+    m->routes = calloc(server.route_count + 1, sizeof(RouteMetrics));
+    if (!m->routes) {
+        free(m);
+        return NULL;
+    }
+    metrics_slots[worker_id] = m;
+    return m;
+}
+
+// Count a finished request against its route (or "unmatched")
+void metrics_request(const HttpRequest* req, int status, uint64_t latency_ns) {
+    WorkerMetrics* m = worker_metrics;
+    if (!m) return;
+    RouteMetrics* route = &m->routes[req->route ? req->route->id : server.route_count];
+    hist_record(&route->latency, latency_ns);
+    if (status < STATUS_MIN || status > STATUS_MAX) status = 500;
+    counter_add(&route->status[status - STATUS_MIN], 1);
+}
+
+// ============= Tracing =============
+
+// Two views of the request lifecycle, both keyed by a request id that is
+// unique per process (worker in the top bits, a per-worker sequence
+// below, so it stays exact as a JSON number):
+//
+// USDT probes (provider "webserver") at accept, recv, parse, route, each
+// middleware, the handler, send and close, for bpftrace/perf. A probe
+// site is a single nop until a tracer attaches; the arguments are values
+// the code already has in registers. Built when <sys/sdt.h> is present
+// (systemtap-sdt-dev), or never with USDT=0.
+//
+// Sampled spans: with --trace-sample N one request in N per worker
+// carries a Trace in its arena and every stage appends a span to it.
+// Traces that take at least --trace-slow ms, recv of the first byte to
+// the last byte written, are copied into a small shared store that
+// GET /debug/traces exports. Unsampled requests pay one branch per stage.
+
+#if HAVE_USDT
+#define PROBE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(webserver, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+#define TRACE_MAX_SPANS 24
+#define TRACE_PATH_MAX 64
+#define TRACE_KEEP 64           // Slow traces kept for /debug/traces
+#define REQUEST_ID_SHIFT 40     // Sequence bits below the worker number
+
+typedef enum {
+    SPAN_RECV,              // Waiting for the rest of the request after its first byte
+    SPAN_PARSE,             // parse_request() calls, summed
+    SPAN_QUEUE,             // Wakeup to dispatch: the batch ahead of it, its read and parse
+    SPAN_ROUTE,
+    SPAN_MIDDLEWARE,        // index: registry id
+    SPAN_POOL_WAIT,         // Queued for the blocking pool
+    SPAN_HANDLER,
+    SPAN_BODY,              // BodyReader calls of a streamed upload, summed
+    SPAN_SEND,              // Serialize and queue the response
+    SPAN_FLUSH,             // Queued to the last byte written
+    SPAN_KIND_COUNT
+} SpanKind;
+
+static const char* span_names[SPAN_KIND_COUNT] = {
+    "recv", "parse", "queue", "route", "middleware", "pool_wait", "handler", "body", "send", "flush",
+};
+
+typedef struct {
+    uint64_t offset_ns;     // From Trace.start_ns
+    uint64_t duration_ns;
+    uint8_t kind;
+    uint8_t index;
+} TraceSpan;
+
+typedef struct Trace {
+    uint64_t id;
+    uint64_t start_ns;
+    uint64_t queued_ns;     // Response queued, start of SPAN_FLUSH
+    uint64_t duration_ns;
+    time_t wall;
+    int route;              // Route id, -1 unmatched
+    uint16_t status;
+    uint8_t method;
+    uint8_t path_len;
+    uint8_t span_count;
+    uint8_t spans_dropped;
+    char path[TRACE_PATH_MAX];
+    TraceSpan spans[TRACE_MAX_SPANS];
+} Trace;
+
+// Only slow sampled traces take the lock, so one store serves all workers
+static struct {
+    pthread_mutex_t lock;
+    uint64_t recorded;      // Total stored; the newest is at (recorded - 1) % TRACE_KEEP
+    Trace traces[TRACE_KEEP];
+} trace_store = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local uint64_t request_id_next; // Set by trace_worker_start()
+static _Thread_local uint32_t trace_countdown;
+
+void trace_worker_start(int worker_id) {
+    request_id_next = ((uint64_t)worker_id + 1) << REQUEST_ID_SHIFT;
+}
+
+static inline uint64_t request_id_new(void) {
+    return ++request_id_next;
+}
+
+// Every config.trace_sample-th request of this worker gets a Trace,
+// starting at start_ns (the request's first byte)
+static inline Trace* trace_sample(Arena* arena, uint64_t start_ns) {
+    if (config.trace_sample == 0 || trace_countdown-- > 1) return NULL;
+    trace_countdown = config.trace_sample;
+    Trace* t = arena_alloc(arena, sizeof(Trace));
+    if (!t) return NULL;
+    t->start_ns = start_ns;
+    t->queued_ns = 0;
+    t->route = -1;
+    t->status = 0;
+    t->span_count = 0;
+    t->spans_dropped = 0;
+    return t;
+}
+
+// Record a span; start_ns is absolute. Summed kinds extend their span.
+static void trace_span(Trace* t, SpanKind kind, int index, uint64_t start_ns, uint64_t duration_ns) {
+    if ((kind == SPAN_BODY || kind == SPAN_PARSE) && t->span_count > 0 &&
+        t->spans[t->span_count - 1].kind == kind) {
+        t->spans[t->span_count - 1].duration_ns += duration_ns;
+        return;
+    }
+    if (t->span_count == TRACE_MAX_SPANS) {
+        if (t->spans_dropped < UINT8_MAX) t->spans_dropped++;
+        return;
+    }
+    TraceSpan* s = &t->spans[t->span_count++];
+    s->offset_ns = start_ns > t->start_ns ? start_ns - t->start_ns : 0;
+    s->duration_ns = duration_ns;
+    s->kind = kind;
+    s->index = index;
+}
+
+// Copy the request details in once it has been built
+static void trace_attach(Trace* t, const HttpRequest* req) {
+    t->id = req->id;
+    t->method = req->method;
+    t->path_len = req->path_len < TRACE_PATH_MAX ? req->path_len : TRACE_PATH_MAX;
+    memcpy(t->path, req->path, t->path_len);
+}
+
+// The response is fully written (flushed_ns) or abandoned (0): keep the
+// trace if it was slow
+static void trace_commit(Trace* t, uint64_t flushed_ns) {
+    uint64_t end = t->queued_ns;
+    if (flushed_ns > t->queued_ns && t->queued_ns) {
+        trace_span(t, SPAN_FLUSH, 0, t->queued_ns, flushed_ns - t->queued_ns);
+        end = flushed_ns;
+    }
+    t->duration_ns = end > t->start_ns ? end - t->start_ns : 0;
+    if (t->duration_ns < (uint64_t)config.trace_slow_ms * 1000000) return;
+    t->wall = clock_get()->wall;
+
+    pthread_mutex_lock(&trace_store.lock);
+    trace_store.traces[trace_store.recorded % TRACE_KEEP] = *t;
+    trace_store.recorded++;
+    pthread_mutex_unlock(&trace_store.lock);
+}
+
+// ============= Admission Control =============
+
+// Three layers keep an overloaded server answering quickly instead of
+// queueing without bound:
+//   - --max-conns caps open connections across workers; the surplus gets
+//     the prerendered 503 straight from accept_connections()
+//   - rate_limit_middleware() gives every client IP a token bucket in a
+//     sharded, lock-free table (RateSlot)
+//   - a request that waited longer than --shed-ms, behind the rest of its
+//     event loop batch or in the blocking pool queue, is answered with
+//     the prerendered 503 without running middleware or the handler
+
+#define RATE_SHARDS 64          // Power of two
+#define RATE_SLOTS 256          // Per shard, power of two
+#define RATE_PROBES 8           // Linear probe limit inside a shard
+#define RATE_TOKEN_SCALE 256    // Tokens are stored in 1/256ths
+#define RATE_TOKEN_BITS 24      // Low bits of RateSlot.bucket; the rest is a ms timestamp
+#define RATE_BURST_MAX ((1 << RATE_TOKEN_BITS) / RATE_TOKEN_SCALE - 1)
+
+static _Atomic int open_connections; // Accepted and not yet closed, all workers
+
+// When the event loop picked up the batch being processed
+static _Thread_local uint64_t loop_wake_ns;
+
+// Has a request that became ready at ready_ns waited past --shed-ms?
+static inline bool queue_delay_exceeded(uint64_t ready_ns) {
+    return config.shed_ms > 0 && monotonic_ns() - ready_ns > (uint64_t)config.shed_ms * 1000000;
+}
+
+// Answer with the prerendered 503; conn_finish() counts it
+void shed_request(HttpResponse* res) {
+    if (server.overloaded) res->prebuilt = server.overloaded;
+    else set_json_response(res, 503, "{\"error\": \"Server overloaded\"}");
+}
+
+// One client's bucket. ip is claimed with a CAS; bucket packs the last
+// refill time (ms) above RATE_TOKEN_BITS of fixed-point tokens and is
+// updated with a CAS loop, so workers never take a lock.
+typedef struct {
+    _Atomic uint32_t ip;      // 0 = free
+    _Atomic uint64_t bucket;  // 0 = full (not used since claimed, or being claimed)
+} RateSlot;
+
+typedef struct {
+    _Alignas(64) RateSlot slots[RATE_SLOTS];
+} RateShard;
+
+static RateShard rate_shards[RATE_SHARDS];
+
+static inline uint64_t rate_burst(void) {
+    int burst = config.rate_burst > 0 ? config.rate_burst : config.rate_limit;
+    return (uint64_t)(burst < RATE_BURST_MAX ? burst : RATE_BURST_MAX) * RATE_TOKEN_SCALE;
+}
+
+// Find or claim ip's slot. A slot idle long enough to have refilled
+// completely is as good as free and may be taken over: its bucket is
+// reset to 0 first, which no other claimer sees as stale, then ip is
+// swapped. NULL when the probe window is full of active clients.
+static RateSlot* rate_slot(uint32_t ip, uint64_t now_ms) {
+    uint32_t h = ip * 2654435761u;
+    RateShard* shard = &rate_shards[h >> 26 & (RATE_SHARDS - 1)];
+    uint64_t refill_ms = rate_burst() * 1000 / RATE_TOKEN_SCALE / config.rate_limit + 1;
+
+    for (uint32_t i = 0; i < RATE_PROBES; i++) {
+        RateSlot* slot = &shard->slots[(h + i) & (RATE_SLOTS - 1)];
+        uint32_t owner = atomic_load_explicit(&slot->ip, memory_order_acquire);
+        if (owner == ip) return slot;
+        uint64_t bucket = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+        bool stale = owner != 0 && bucket != 0 && now_ms - (bucket >> RATE_TOKEN_BITS) > refill_ms;
+        if (stale && !atomic_compare_exchange_strong_explicit(&slot->bucket, &bucket, 0,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+            continue; // Its owner came back, or another claimer got there first
+        }
+        if ((owner == 0 || stale) &&
+            atomic_compare_exchange_strong_explicit(&slot->ip, &owner, ip,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return slot;
+        }
+        if (owner == ip) return slot; // Claimed by another worker meanwhile
+    }
+    return NULL;
+}
+
+// Take one token for ip; false when its bucket is empty
+bool rate_take(uint32_t ip) {
+    uint64_t now_ms = monotonic_ns() / 1000000 + 1; // Never 0, see RateSlot.bucket
+    RateSlot* slot = rate_slot(ip, now_ms);
+    if (!slot) return true; // Table full: fail open rather than punish new clients
+
+    uint64_t burst = rate_burst();
+    uint64_t old = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+    while (1) {
+        uint64_t stamp = old >> RATE_TOKEN_BITS;
+        uint64_t tokens = burst;
+        if (old != 0) {
+            tokens = old & ((1u << RATE_TOKEN_BITS) - 1);
+            if (now_ms > stamp) tokens += (now_ms - stamp) * config.rate_limit * RATE_TOKEN_SCALE / 1000;
+            if (tokens > burst) tokens = burst;
+        }
+        if (tokens < RATE_TOKEN_SCALE) return false; // Refill keeps accruing from stamp
+        uint64_t next = now_ms << RATE_TOKEN_BITS | (tokens - RATE_TOKEN_SCALE);
+        if (atomic_compare_exchange_weak_explicit(&slot->bucket, &old, next,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+// ============= Async Handlers =============
+
+// A handler normally fills its HttpResponse before returning. Instead it
+// may call http_defer() and return; the request and response then stay
+// valid (they live in the connection's arena) until some thread fills
+// the response and calls http_complete(). Completions are pushed onto the
+// owning worker's lock-free queue and the worker is woken through an
+// eventfd (a pipe elsewhere); the response is sent from its event loop.
+// The connection stops reading while a response is outstanding, so
+// pipelined responses keep their order.
+//
+// Routes registered with register_blocking_route() are deferred
+// automatically and their handler runs on a bounded thread pool.
+
+typedef struct {
+    _Atomic(struct HttpAsync*) head; // Pushed by any thread, newest first
+    int wake_read;
+    int wake_write;                  // Same descriptor as wake_read for eventfd
+} CompletionQueue;
+
+typedef struct HttpAsync {
+    HttpRequest req;
+    HttpResponse res;
+    bool deferred;
+    bool cache_retry;                // The fill it waited on failed, see conn_complete()
+    struct HttpAsync* next;          // CompletionQueue link, or CacheEntry waiter list before that
+    CompletionQueue* queue;          // Owning worker's queue
+    struct Connection* conn;
+    char* restore_at;                // Byte after the request, see conn_dispatch()
+    char saved;
+    uint64_t start_ns;
+    uint64_t queued_ns;              // Submitted to the blocking pool
+} HttpAsync;
+
+int completion_queue_init(CompletionQueue* q) {
+    atomic_init(&q->head, NULL);
+#ifdef __linux__
+    q->wake_read = q->wake_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return q->wake_read < 0 ? -1 : 0;
+#else
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    q->wake_read = fds[0];
+    q->wake_write = fds[1];
+    return 0;
+#endif
+}
+
+// Detach the response from the handler: return without filling res and
+// call http_complete() later, from any thread. Returns NULL when the
+// request can't be deferred (e.g. while prerendering); fill res directly.
+HttpAsync* http_defer(HttpResponse* res) {
+    if (res->async) res->async->deferred = true;
+    return res->async;
+}
+
+// Hand a filled response back to its worker; callable from any thread
+void http_complete(HttpAsync* async) {
+    CompletionQueue* q = async->queue;
+    HttpAsync* head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    do {
+        async->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &head, async,
+                                                    memory_order_release, memory_order_relaxed));
+    // Only the push onto an empty queue needs to wake the worker
+    if (head == NULL) {
+        uint64_t one = 1;
+        ssize_t n = write(q->wake_write, &one, sizeof(one));
+        (void)n; // Full pipe: a wakeup is already pending
+    }
+}
+
+// Take every completion, oldest first; called by the owning worker
+HttpAsync* completion_queue_take(CompletionQueue* q) {
+    uint64_t count;
+    while (read(q->wake_read, &count, sizeof(count)) > 0) {}
+    
+    HttpAsync* list = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
+    HttpAsync* ordered = NULL;
+    while (list) {
+        HttpAsync* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    return ordered;
+}
+
+#define POOL_QUEUE_MAX 1024 // Queued blocking requests before answering 503
+#define POOL_MAX_THREADS 256
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    HttpAsync* jobs[POOL_QUEUE_MAX];
+    size_t head;
+    size_t count;
+    int thread_count;
+} BlockingPool;
+
+static BlockingPool blocking_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void* blocking_pool_thread(void* arg) {
+    BlockingPool* pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0) pthread_cond_wait(&pool->ready, &pool->lock);
+        HttpAsync* job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % POOL_QUEUE_MAX;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        clock_update(); // Pool threads have no event loop to tick the clock
+        job->deferred = false;
+        HttpRequest* req = &job->req;
+        uint64_t start = monotonic_ns();
+        if (req->trace) trace_span(req->trace, SPAN_POOL_WAIT, 0, job->queued_ns, start - job->queued_ns);
+        if (queue_delay_exceeded(job->queued_ns)) {
+            PROBE1(request__shed, req->id);
+            shed_request(&job->res); // Too late to be worth running
+            http_complete(job);
+            continue;
+        }
+        req->route->handler(req, &job->res);
+        uint64_t ns = monotonic_ns() - start;
+        if (req->trace) trace_span(req->trace, SPAN_HANDLER, 0, start, ns);
+        PROBE3(handler, req->id, req->route->id, ns);
+        if (!job->deferred) http_complete(job);
+    }
+    return NULL;
+}
+
+// Queue a request for the pool; false when the queue is full
+bool blocking_pool_submit(HttpAsync* job) {
+    BlockingPool* pool = &blocking_pool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == POOL_QUEUE_MAX) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    job->queued_ns = monotonic_ns();
+    pool->jobs[(pool->head + pool->count) % POOL_QUEUE_MAX] = job;
+    pool->count++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+void blocking_pool_start(int threads) {
+    if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, blocking_pool_thread, &blocking_pool) != 0) {
+            perror("Blocking pool thread");
+            break;
+        }
+        pthread_detach(thread);
+        blocking_pool.thread_count++;
+    }
+}
+
+// ============= Middleware Functions =============
+
+// Flags the request for the access log; the record itself is written by
+// conn_dispatch() once status and size are known (see access_log_record())
+bool logger_middleware(HttpRequest* req, HttpResponse* res) {
+    req->log_access = true;
+    return true; // Continue to next middleware/handler
+}
+
+bool cors_middleware(HttpRequest* req, HttpResponse* res) {
+    // This would add CORS headers in a real implementation
+    // For now, just demonstrate the concept
+    return true;
+}
+
+// Token bucket per client IP (--rate-limit, --rate-burst), see rate_take()
+bool rate_limit_middleware(HttpRequest* req, HttpResponse* res) {
+    if (config.rate_limit <= 0 || rate_take(req->client_ip)) return true;
+    if (worker_metrics) counter_add(&worker_metrics->rate_limited, 1);
+    add_response_header(res, "Retry-After", "1");
+    set_json_response(res, 429, "{\"error\": \"Too many requests\"}");
+    return false;
+}
+
+// Protects every route whose chain lists it (ROUTE_TABLE puts it on /admin)
+bool auth_middleware(HttpRequest* req, HttpResponse* res) {
+    // Look for Authorization header (simplified)
+    if (http_header(req, HDR_AUTHORIZATION) == NULL) {
+        set_json_response(res, 401, "{\"error\": \"Unauthorized\"}");
+        return false; // Stop processing
+    }
+    return true;
+}
+
+// ============= Route Handlers =============
+
+void handle_home(HttpRequest* req, HttpResponse* res) {
+    const char* html = 
+        "<!DOCTYPE html>"
+        "<html><head><title>C Web Server</title>"
+        "<link rel=\"stylesheet\" href=\"/static/style.css\"></head>"
+        "<body>"
+        "<h1>Welcome to the C Web Server!</h1>"
+        "<p>Available endpoints:</p>"
+        "<ul>"
+        "<li>GET / - This page</li>"
+        "<li>GET /api/hello - Hello JSON</li>"
+        "<li>GET /api/time - Current time</li>"
+        "<li>GET /api/users - List users</li>"
+        "<li>POST /api/users - Create user</li>"
+        "<li>GET /api/users/123 - Get specific user</li>"
+        "<li>DELETE /api/users/123 - Delete user</li>"
+        "<li>GET /admin - Protected route (requires auth)</li>"
+        "<li>GET /static/style.css - Static file</li>"
+        "</ul>"
+        "</body></html>";
+    
+    set_html_response(res, 200, html);
+}
+
+void handle_hello(HttpRequest* req, HttpResponse* res) {
+    const char* name = "Guest";
+    size_t name_len = 5;
+    
+    // Parse query parameter; the value is used in place and escaped below
+    const char* name_param = strstr(req->query_string, "name=");
+    if (name_param && name_param[5] && name_param[5] != '&') {
+        name = name_param + 5;
+        name_len = strcspn(name, "&");
+    }
+    
+    JsonWriter w;
+    json_begin(&w, res->arena, 64 + name_len);
+    json_object_begin(&w);
+    json_key(&w, "message");
+    json_string_open(&w);
+    json_raw(&w, "Hello, ", 7);
+    json_string_append(&w, name, name_len);
+    json_raw(&w, "!", 1);
+    json_string_close(&w);
+    json_key(&w, "timestamp");
+    json_int(&w, clock_get()->wall);
+    json_object_end(&w);
+    json_finish(&w, res, 200);
+}
+
+void handle_time(HttpRequest* req, HttpResponse* res) {
+    const WorkerClock* clock = clock_get();
+    
+    JsonWriter w;
+    json_begin(&w, res->arena, 80);
+    json_object_begin(&w);
+    json_key(&w, "current_time");
+    json_string(&w, clock->log_time);
+    json_key(&w, "unix_timestamp");
+    json_int(&w, clock->wall);
+    json_object_end(&w);
+    json_finish(&w, res, 200);
+}
+
+void handle_users_list(HttpRequest* req, HttpResponse* res) {
+    const char* json = 
+        "{"
+        "  \"users\": ["
+        "    {\"id\": 1, \"name\": \"Alice\", \"email\": \"alice@example.com\"},"
+        "    {\"id\": 2, \"name\": \"Bob\", \"email\": \"bob@example.com\"},"
+        "    {\"id\": 3, \"name\": \"Charlie\", \"email\": \"charlie@example.com\"}"
+        "  ],"
+        "  \"count\": 3"
+        "}";
+    
+    set_json_response(res, 200, json);
+}
+
+// One generated user object; shared by the single and streamed endpoints
+static void json_user(JsonWriter* w, long id) {
+    char digits[20];
+    size_t n = format_u64(digits, (uint64_t)id);
+    json_object_begin(w);
+    json_key(w, "id");
+    json_int(w, id);
+    json_key(w, "name");
+    json_string_open(w);
+    json_raw(w, "User ", 5);
+    json_raw(w, digits, n);
+    json_string_close(w);
+    json_key(w, "email");
+    json_string_open(w);
+    json_raw(w, "user", 4);
+    json_raw(w, digits, n);
+    json_raw(w, "@example.com", 12);
+    json_string_close(w);
+    json_object_end(w);
+}
+
+// Streams a generated user list of ?count=N entries as chunked JSON
+typedef struct {
+    long next;
+    long count;
+    JsonWriter w;           // Re-pointed at each chunk, keeps the nesting
+} UserExport;
+
+static ssize_t produce_user_export(void* ctx, char* buf, size_t cap) {
+    UserExport* export = ctx;
+    JsonWriter* w = &export->w;
+    json_begin_fixed(w, buf, cap);
+    
+    if (export->next == 0) {
+        json_object_begin(w);
+        json_key(w, "users");
+        json_array_begin(w);
+    }
+    while (export->next < export->count && cap - w->len > 128) {
+        json_user(w, ++export->next);
+    }
+    if (export->next == export->count && cap - w->len > 32) {
+        json_array_end(w);
+        json_key(w, "count");
+        json_int(w, export->count);
+        json_object_end(w);
+        export->next++; // Past the end: next call finishes the stream
+    }
+    return w->failed ? -1 : (ssize_t)w->len;
+}
+
+void handle_users_export(HttpRequest* req, HttpResponse* res) {
+    UserExport* export = arena_alloc(res->arena, sizeof(UserExport));
+    if (!export) {
+        set_json_response(res, 500, "{\"error\": \"Out of memory\"}");
+        return;
+    }
+    export->next = 0;
+    export->count = 1000;
+    export->w.need_comma = false;
+    
+    const char* count = strstr(req->query_string, "count=");
+    if (count) {
+        export->count = strtol(count + 6, NULL, 10);
+        if (export->count < 0) export->count = 0;
+        if (export->count > 10000000) export->count = 10000000;
+    }
+    
+    set_stream_response(res, 200, "application/json", produce_user_export, export);
+}
+
+void handle_user_create(HttpRequest* req, HttpResponse* res) {
+    // In a real app, you'd parse the JSON body and save to database
+    const char* json = 
+        "{"
+        "  \"id\": 4,"
+        "  \"name\": \"New User\","
+        "  \"email\": \"newuser@example.com\","
+        "  \"created\": true"
+        "}";
+    
+    set_json_response(res, 201, json);
+}
+
+// Streamed upload: the body never sits in memory as a whole, only each
+// piece as it was read. The digest stands in for writing it to storage.
+typedef struct {
+    uint32_t hash;          // FNV-1a
+} UploadDigest;
+
+bool read_upload(HttpRequest* req, HttpResponse* res, const char* data, size_t len) {
+    UploadDigest* digest = req->upload_ctx;
+    if (!digest) {
+        digest = arena_alloc(res->arena, sizeof(UploadDigest));
+        if (!digest) return false;
+        digest->hash = 2166136261u;
+        req->upload_ctx = digest;
+    }
+    for (size_t i = 0; i < len; i++) {
+        digest->hash = (digest->hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return true;
+}
+
+void handle_upload(HttpRequest* req, HttpResponse* res) {
+    static const char hex[] = "0123456789abcdef";
+    UploadDigest* digest = req->upload_ctx;
+    uint32_t hash = digest ? digest->hash : 2166136261u;
+    char fnv[8];
+    for (int i = 0; i < 8; i++) fnv[i] = hex[(hash >> (28 - 4 * i)) & 15];
+    
+    JsonWriter w;
+    json_begin(&w, res->arena, 48);
+    json_object_begin(&w);
+    json_key(&w, "bytes");
+    json_uint(&w, req->body_length);
+    json_key(&w, "fnv1a");
+    json_string_n(&w, fnv, 8);
+    json_object_end(&w);
+    json_finish(&w, res, 201);
+}
+
+void handle_user_get(HttpRequest* req, HttpResponse* res) {
+    // User ID was captured by the router from /api/users/:id<int>
+    long user_id = 0;
+    req_param_int(req, "id", &user_id);
+    
+    if (user_id > 0 && user_id <= 3) {
+        JsonWriter w;
+        json_begin(&w, res->arena, 80);
+        json_user(&w, user_id);
+        json_finish(&w, res, 200);
+    } else {
+        set_json_response(res, 404, "{\"error\": \"User not found\"}");
+    }
+}
+
+void handle_user_delete(HttpRequest* req, HttpResponse* res) {
+    long user_id = 0;
+    req_param_int(req, "id", &user_id);
+    
+    char digits[20];
+    size_t n = format_u64(digits, (uint64_t)user_id);
+    
+    JsonWriter w;
+    json_begin(&w, res->arena, 64);
+    json_object_begin(&w);
+    json_key(&w, "message");
+    json_string_open(&w);
+    json_raw(&w, "User ", 5);
+    json_raw(&w, digits, n);
+    json_raw(&w, " deleted", 8);
+    json_string_close(&w);
+    json_key(&w, "success");
+    json_bool(&w, true);
+    json_object_end(&w);
+    json_finish(&w, res, 200);
+}
+
+void handle_admin(HttpRequest* req, HttpResponse* res) {
+    set_json_response(res, 200, "{\"message\": \"Welcome to admin panel\"}");
+}
+
+void handle_not_found(HttpRequest* req, HttpResponse* res) {
+    set_json_response(res, 404, "{\"error\": \"Route not found\"}");
+}
+
+// The path exists under other methods (req->allowed_methods); prerendered
+// into server.not_allowed for each set
+void handle_method_not_allowed(HttpRequest* req, HttpResponse* res) {
+    char allow[64] = "";
+    size_t len = 0;
+    for (int method = 0; method < UNSUPPORTED; method++) {
+        if (!(req->allowed_methods & (1 << method))) continue;
+        len += snprintf(allow + len, sizeof(allow) - len, "%s%s", len ? ", " : "",
+                        method_to_string(method));
+    }
+    add_response_header(res, "Allow", allow);
+    set_json_response(res, 405, "{\"error\": \"Method not allowed\"}");
+}
+
+// Prerendered into server.overloaded; sent by shed_request()
+void handle_overloaded(HttpRequest* req, HttpResponse* res) {
+    add_response_header(res, "Retry-After", "1");
+    set_json_response(res, 503, "{\"error\": \"Server overloaded\"}");
+}
+
+// ============= Routing System =============
+
+// Append a filled-in route to server.routes; the route is not copied
+Route* add_route(Route* route) {
+    if (server.frozen) {
+        fprintf(stderr, "register_route(%s) after setup_routes() ignored\n", route->path);
+        return NULL;
+    }
+    if (server.route_count == server.route_capacity) {
+        int capacity = server.route_capacity ? server.route_capacity * 2 : 16;
+        Route** grown = realloc(server.routes, capacity * sizeof(Route*));
+        if (!grown) {
+            perror("register_route");
+            return NULL;
+        }
+        server.routes = grown;
+        server.route_capacity = capacity;
+    }
+    route->id = server.route_count;
+    route->path_len = strlen(route->path);
+    server.routes[server.route_count++] = route;
+    return route;
+}
+
+// Returns the new route so callers can set options on it, or NULL
+Route* register_route(HttpMethod method, const char* path, RouteHandler handler) {
+    if (server.frozen) {
+        fprintf(stderr, "register_route(%s) after setup_routes() ignored\n", path);
+        return NULL;
+    }
+    Route* route = calloc(1, sizeof(Route));
+    if (!route) {
+        perror("register_route");
+        return NULL;
+    }
+    route->method = method;
+    strncpy(route->path, path, sizeof(route->path) - 1);
+    route->handler = handler;
+    return add_route(route);
+}
+
+// Register a route whose handler produces the same bytes for every
+// request. It is run once at startup and its serialized response is then
+// sent from a shared read-only buffer; middleware still runs per request.
+Route* register_constant_route(HttpMethod method, const char* path, RouteHandler handler) {
+    Route* route = register_route(method, path, handler);
+    if (route) route->constant = true;
+    return route;
+}
+
+// Register a route whose responses may be reused for ttl seconds by
+// cache_middleware(), keyed on method, path and query string
+Route* register_cached_route(HttpMethod method, const char* path, RouteHandler handler, int ttl) {
+    Route* route = register_route(method, path, handler);
+    if (route) route->cache_ttl = ttl;
+    return route;
+}
+
+// Register a route whose handler may block (database, disk, ...). It runs
+// on the blocking pool and its response is sent by the owning worker.
+Route* register_blocking_route(HttpMethod method, const char* path, RouteHandler handler) {
+    Route* route = register_route(method, path, handler);
+    if (route) route->blocking = true;
+    return route;
+}
+
+// Register a route whose request body is streamed to reader as it arrives
+// instead of being buffered (and limited by --max-body). Middleware runs
+// before the body is read; handler runs after it, with req->body empty
+// and req->body_length the total size.
+Route* register_upload_route(HttpMethod method, const char* path, RouteHandler handler,
+                             BodyReader reader) {
+    Route* route = register_route(method, path, handler);
+    if (route) route->body_reader = reader;
+    return route;
+}
+
+// Add middleware to the registry under name; returns its metrics id or -1
+int define_middleware(Middleware middleware, const char* name) {
+    for (int i = 0; i < server.middleware_count; i++) {
+        if (server.middleware[i] == middleware) return i;
+    }
+    if (server.middleware_count == MAX_MIDDLEWARE) return -1;
+    server.middleware[server.middleware_count] = middleware;
+    server.middleware_names[server.middleware_count] = name;
+    return server.middleware_count++;
+}
+
+// Bind middleware to the runtime-registered routes whose path is prefix
+// or below it ("/api" covers "/api" and "/api/users", not "/apix").
+// Routes from ROUTE_TABLE list their own chain instead.
+void register_group_middleware(const char* prefix, Middleware middleware) {
+    if (server.frozen) {
+        fprintf(stderr, "register_middleware() after setup_routes() ignored\n");
+        return;
+    }
+    int id = define_middleware(middleware, NULL);
+    if (id >= 0 && server.scope_count < MAX_MIDDLEWARE) {
+        server.scopes[server.scope_count++] = (MiddlewareScope){prefix, (uint8_t)id};
+    }
+}
+
+// Bind middleware to every runtime-registered route
+void register_middleware(Middleware middleware) {
+    register_group_middleware(NULL, middleware);
+}
+
+// Run middleware for requests that match no route, before the 404 or
+// 405. Nothing else runs for them, so keep this short.
+void register_miss_middleware(Middleware middleware) {
+    if (server.frozen) {
+        fprintf(stderr, "register_middleware() after setup_routes() ignored\n");
+        return;
+    }
+    int id = define_middleware(middleware, NULL);
+    if (id >= 0 && server.miss_count < MAX_MIDDLEWARE) {
+        server.miss_chain[server.miss_count++] = (uint8_t)id;
+    }
+}
+
+void register_response_filter(ResponseFilter filter) {
+    if (server.frozen) {
+        fprintf(stderr, "register_response_filter() after setup_routes() ignored\n");
+        return;
+    }
+    if (server.filter_count < MAX_MIDDLEWARE) {
+        server.filters[server.filter_count++] = filter;
+    }
+}
+
+// The router is a trie over path segments with one root per method.
+// Each node has sorted static children plus at most one int parameter,
+// one string parameter and one wildcard child. Lookup walks one node per
+// segment, so its cost depends on path depth rather than route count.
+// Pattern syntax:
+//   /users/:name         any non-empty segment
+//   /users/:id<int>      a segment that parses as an int
+//   /static/*path        the rest of the path (must be last)
+// Static segments win over parameters, int over string, and wildcards
+// come last; the matcher backtracks if a more specific branch dead-ends.
+
+static RouteNode* route_node_new(const char* segment, size_t len) {
+    RouteNode* node = calloc(1, sizeof(RouteNode));
+    if (!node) {
+        perror("router");
+        exit(1);
+    }
+    node->segment = segment;
+    node->segment_len = len;
+    return node;
+}
+
+static int segment_cmp(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+// Binary search; returns the child or NULL and the insertion index
+static RouteNode* find_static_child(const RouteNode* node, const char* seg, size_t len, int* index) {
+    int lo = 0, hi = node->child_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        RouteNode* child = node->children[mid];
+        int c = segment_cmp(seg, len, child->segment, child->segment_len);
+        if (c == 0) return child;
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    if (index) *index = lo;
+    return NULL;
+}
+
+static RouteNode* add_static_child(RouteNode* node, const char* seg, size_t len) {
+    int index;
+    RouteNode* child = find_static_child(node, seg, len, &index);
+    if (child) return child;
+    
+    RouteNode** grown = realloc(node->children, (node->child_count + 1) * sizeof(RouteNode*));
+    if (!grown) {
+        perror("router");
+        exit(1);
+    }
+    node->children = grown;
+    memmove(&node->children[index + 1], &node->children[index],
+            (node->child_count - index) * sizeof(RouteNode*));
+    node->children[index] = child = route_node_new(seg, len);
+    node->child_count++;
+    return child;
+}
+
+static bool router_insert(Route* route) {
+    if (route->method >= UNSUPPORTED || route->path[0] != '/') return false;
+    
+    RouteNode** root = &server.roots[route->method];
+    if (!*root) *root = route_node_new("", 0);
+    RouteNode* node = *root;
+    
+    const char* p = route->path;
+    while (*p == '/') {
+        const char* seg = p + 1;
+        const char* end = strchr(seg, '/');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+        
+        if (len > 1 && (seg[0] == ':' || seg[0] == '*')) {
+            if (route->param_count == MAX_PARAMS) return false;
+            
+            bool is_int = seg[0] == ':' && len > 6 && memcmp(seg + len - 5, "<int>", 5) == 0;
+            size_t name_len = len - 1 - (is_int ? 5 : 0);
+            if (name_len >= sizeof(route->param_names[0])) return false;
+            memcpy(route->param_names[route->param_count], seg + 1, name_len);
+            route->param_names[route->param_count][name_len] = '\0';
+            route->param_count++;
+            
+            if (seg[0] == '*') {
+                if (end) return false; // Wildcard must be the last segment
+                if (!node->wildcard_child) node->wildcard_child = route_node_new(seg, len);
+                node = node->wildcard_child;
+            } else {
+                RouteNode** slot = is_int ? &node->int_child : &node->str_child;
+                if (!*slot) *slot = route_node_new(seg, len);
+                node = *slot;
+            }
+        } else {
+            node = add_static_child(node, seg, len);
+        }
+        
+        p = seg + len;
+    }
+    
+    if (node->route) {
+        fprintf(stderr, "Duplicate route %s %s ignored\n",
+                method_to_string(route->method), route->path);
+        return true;
+    }
+    node->route = route;
+    return true;
+}
+
+// Parse a whole segment as an int; rejects empty, signs and overflow
+static bool parse_int_segment(const char* seg, size_t len, long* out) {
+    if (len == 0 || len > 10) return false;
+    long value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (seg[i] < '0' || seg[i] > '9') return false;
+        value = value * 10 + (seg[i] - '0');
+    }
+    if (value > INT32_MAX) return false;
+    *out = value;
+    return true;
+}
+
+static bool node_match(const RouteNode* node, const char* path, size_t pos, size_t len, RouteMatch* m) {
+    if (pos == len) {
+        m->route = node->route;
+        return node->route != NULL;
+    }
+    if (path[pos] != '/') return false;
+    
+    size_t start = pos + 1;
+    const char* slash = memchr(path + start, '/', len - start);
+    size_t end = slash ? (size_t)(slash - path) : len;
+    size_t seg_len = end - start;
+    int depth = m->param_count;
+    
+    const RouteNode* child = find_static_child(node, path + start, seg_len, NULL);
+    if (child && node_match(child, path, end, len, m)) return true;
+    
+    long value;
+    if (node->int_child && parse_int_segment(path + start, seg_len, &value)) {
+        m->params[depth] = (ParamCapture){(uint32_t)start, (uint32_t)seg_len, value, true};
+        m->param_count = depth + 1;
+        if (node_match(node->int_child, path, end, len, m)) return true;
+        m->param_count = depth;
+    }
+    
+    if (node->str_child && seg_len > 0) {
+        m->params[depth] = (ParamCapture){(uint32_t)start, (uint32_t)seg_len, 0, false};
+        m->param_count = depth + 1;
+        if (node_match(node->str_child, path, end, len, m)) return true;
+        m->param_count = depth;
+    }
+    
+    if (node->wildcard_child && node->wildcard_child->route) {
+        m->params[depth] = (ParamCapture){(uint32_t)start, (uint32_t)(len - start), 0, false};
+        m->param_count = depth + 1;
+        m->route = node->wildcard_child->route;
+        return true;
+    }
+    return false;
+}
+
+// Seeded FNV-1a over method and path. router_compile() searches for a
+// seed under which no two parameterless routes share a slot, so a hit
+// needs one hash and one memcmp and never falls through to the trie.
+static uint32_t exact_hash(uint32_t seed, HttpMethod method, const char* path, size_t len) {
+    uint32_t h = (2166136261u ^ seed) * 16777619u;
+    h = (h ^ (uint32_t)method) * 16777619u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+static bool node_lookup(HttpMethod method, const char* path, size_t len, RouteMatch* m) {
+    m->route = NULL;
+    m->param_count = 0;
+    if (method >= UNSUPPORTED || !server.roots[method]) return false;
+    return node_match(server.roots[method], path, 0, len, m);
+}
+
+bool route_lookup(HttpMethod method, const char* path, size_t len, RouteMatch* m) {
+    if (server.exact) {
+        Route* route = server.exact[exact_hash(server.exact_seed, method, path, len) & server.exact_mask];
+        if (route && route->method == method && route->path_len == len &&
+            memcmp(route->path, path, len) == 0) {
+            m->route = route;
+            m->param_count = 0;
+            return true;
+        }
+    }
+    return node_lookup(method, path, len, m);
+}
+
+// Try seeds until the parameterless routes land in distinct slots,
+// growing the table when a size has no such seed
+static void exact_compile(void) {
+    Route** keys = malloc((server.route_count + 1) * sizeof(Route*));
+    if (!keys) return;
+    int n = 0;
+    for (int i = 0; i < server.route_count; i++) {
+        Route* route = server.routes[i];
+        RouteMatch m;
+        // Only routes that own their path in the trie (not duplicates)
+        if (route->param_count == 0 && node_lookup(route->method, route->path, route->path_len, &m) &&
+            m.route == route) {
+            keys[n++] = route;
+        }
+    }
+    uint32_t size = 16;
+    while (size < 2u * (uint32_t)n) size *= 2;
+    for (; n > 0 && size <= 65536; size *= 2) {
+        Route** slots = calloc(size, sizeof(Route*));
+        if (!slots) break;
+        for (uint32_t seed = 1; seed <= 1024; seed++) {
+            int placed = 0;
+            for (; placed < n; placed++) {
+                Route* route = keys[placed];
+                uint32_t slot = exact_hash(seed, route->method, route->path, route->path_len) & (size - 1);
+                if (slots[slot]) break;
+                slots[slot] = route;
+            }
+            if (placed == n) {
+                server.exact = slots;
+                server.exact_mask = size - 1;
+                server.exact_seed = seed;
+                free(keys);
+                return;
+            }
+            memset(slots, 0, size * sizeof(Route*));
+        }
+        free(slots);
+    }
+    // None found (or nothing to hash): every lookup walks the trie
+    free(keys);
+}
+
+static bool path_in_group(const char* path, const char* prefix) {
+    if (!prefix) return true;
+    size_t len = strlen(prefix);
+    while (len > 0 && prefix[len - 1] == '/') len--; // "/" and "/api/" are groups too
+    return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Resolve each runtime route's middleware list once, so a request runs
+// exactly the scopes that cover its route without testing any prefix
+static void bind_route_middleware(Route* route) {
+    route->scoped_count = 0;
+    for (int i = 0; i < server.scope_count; i++) {
+        if (path_in_group(route->path, server.scopes[i].prefix)) {
+            route->scoped_chain[route->scoped_count++] = server.scopes[i].id;
+        }
+    }
+}
+
+// Build the per-method tries and the exact-path hash, and bind scoped
+// middleware; called once at the end of setup_routes()
+void router_compile(void) {
+    for (int i = 0; i < server.route_count; i++) {
+        if (!router_insert(server.routes[i])) {
+            fprintf(stderr, "Invalid route pattern %s %s ignored\n",
+                    method_to_string(server.routes[i]->method), server.routes[i]->path);
+        }
+        if (!server.routes[i]->chain) bind_route_middleware(server.routes[i]);
+    }
+    exact_compile();
+}
+
+// Match the request and record the route and its captured parameters
+RouteHandler find_handler(HttpRequest* req) {
+    RouteMatch match;
+    if (route_lookup(req->method, req->path, req->path_len, &match)) {
+        req->route = match.route;
+        req->param_count = match.param_count;
+        memcpy(req->params, match.params, match.param_count * sizeof(ParamCapture));
+        return match.route->handler;
+    }
+    
+    // Misses only: which other methods would have matched (405 vs 404)
+    req->allowed_methods = 0;
+    for (int method = 0; method < UNSUPPORTED; method++) {
+        if (method != (int)req->method && route_lookup(method, req->path, req->path_len, &match)) {
+            req->allowed_methods |= 1 << method;
+        }
+    }
+    return handle_not_found;
+}
+
+// Run the response filters; done on the worker, also for deferred requests
+void finish_request(HttpRequest* req, HttpResponse* res) {
+    for (int i = 0; i < server.filter_count; i++) {
+        server.filters[i](req, res);
+    }
+}
+
+// Run one middleware and time it under its registry id
+static inline bool middleware_step(int id, Middleware middleware, HttpRequest* req, HttpResponse* res) {
+    uint64_t start = monotonic_ns();
+    bool proceed = middleware(req, res);
+    uint64_t ns = monotonic_ns() - start;
+    if (worker_metrics) hist_record(&worker_metrics->middleware[id], ns);
+    if (req->trace) trace_span(req->trace, SPAN_MIDDLEWARE, id, start, ns);
+    PROBE4(middleware, req->id, id, ns, proceed);
+    return proceed;
+}
+
+// First half of handle_request(): route, then run the middleware chain.
+// Returns false when middleware stopped the request (res holds the reply).
+// Streamed uploads run this as soon as the head is in, before the body.
+bool begin_request(HttpRequest* req, HttpResponse* res) {
+    // Route first so middleware can look at req->route
+    uint64_t start = monotonic_ns();
+    find_handler(req);
+    metrics_stage(STAGE_ROUTE, start);
+    if (req->trace) trace_span(req->trace, SPAN_ROUTE, 0, start, monotonic_ns() - start);
+    PROBE2(request__route, req->id, req->route ? req->route->id : -1);
+    
+    // Table routes run their own straight-line chain, runtime routes the
+    // middleware scoped to them, and misses only the miss chain
+    const uint8_t* ids = server.miss_chain;
+    int count = server.miss_count;
+    if (req->route) {
+        if (req->route->chain) return req->route->chain(req, res);
+        ids = req->route->scoped_chain;
+        count = req->route->scoped_count;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!middleware_step(ids[i], server.middleware[ids[i]], req, res)) return false;
+    }
+    return true;
+}
+
+// Second half: produce the response. Returns false when it was deferred;
+// finish_request() then runs once it completes (see http_complete())
+bool run_handler(HttpRequest* req, HttpResponse* res) {
+    // Constant routes skip the handler entirely
+    if (req->route && req->route->prebuilt) {
+        const PrebuiltResponse* variant =
+            req->route->prebuilt_encoded[negotiate_encoding(req, true)];
+        res->prebuilt = variant ? variant : req->route->prebuilt;
+    } else if (!req->route && server.not_allowed[req->allowed_methods]) {
+        res->prebuilt = server.not_allowed[req->allowed_methods];
+    } else if (!req->route && req->allowed_methods) {
+        handle_method_not_allowed(req, res);
+    } else if (!req->route && server.not_found) {
+        res->prebuilt = server.not_found;
+    } else if (req->route && req->route->blocking && res->async &&
+               blocking_pool.thread_count > 0) {
+        if (blocking_pool_submit(res->async)) return false;
+        set_json_response(res, 503, "{\"error\": \"Server busy\"}");
+    } else {
+        uint64_t start = monotonic_ns();
+        (req->route ? req->route->handler : handle_not_found)(req, res);
+        uint64_t ns = monotonic_ns() - start;
+        if (worker_metrics) hist_record(&worker_metrics->stages[STAGE_HANDLER], ns);
+        if (req->trace) trace_span(req->trace, SPAN_HANDLER, 0, start, ns);
+        PROBE3(handler, req->id, req->route ? req->route->id : -1, ns);
+        if (res->async && res->async->deferred) return false;
+    }
+    
+    finish_request(req, res);
+    return true;
+}
+
+// Returns false when the response was deferred, see run_handler()
+bool handle_request(HttpRequest* req, HttpResponse* res) {
+    if (!begin_request(req, res)) {
+        if (res->async && res->async->deferred) return false; // Waiting on a cache fill
+        finish_request(req, res);
+        return true;
+    }
+    return run_handler(req, res);
+}
+
+// ============= Static Files =============
+
+// handle_static() serves files under a route's root directory. Bodies are
+// sent with sendfile(), so file data never passes through user space.
+// Each worker keeps an LRU of open descriptors with their stat, ETag and
+// Last-Modified values; entries are re-validated with stat() at most once
+// a second. An entry evicted while a connection is still sending from it
+// stays open until that send finishes.
+
+#define FILE_CACHE_MAX 256
+#define FILE_CACHE_BUCKETS 512
+
+typedef struct CachedFile {
+    char path[512];
+    uint32_t hash;
+    int fd;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    time_t checked_at;      // Monotonic second of the last stat()
+    const char* content_type;
+    char etag[48];
+    char last_modified[32];
+    unsigned variants;      // Precompressed siblings found at open, bit per ContentEncoding
+    int refs;               // Cache reference plus in-flight responses
+    bool cached;            // Still linked in the cache
+    struct CachedFile* hash_next;
+    struct CachedFile* lru_prev;
+    struct CachedFile* lru_next;
+} CachedFile;
+
+typedef struct {
+    CachedFile* buckets[FILE_CACHE_BUCKETS];
+    CachedFile* lru_head;   // Most recently used
+    CachedFile* lru_tail;
+    int count;
+} FileCache;
+
+// Per worker thread, so lookups never take a lock
+static _Thread_local FileCache file_cache;
+
+static const struct {
+    const char* ext;
+    const char* type;
+} mime_types[] = {
+    {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"},
+    {"js", "application/javascript"}, {"json", "application/json"},
+    {"txt", "text/plain"}, {"svg", "image/svg+xml"}, {"png", "image/png"},
+    {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"gif", "image/gif"},
+    {"webp", "image/webp"}, {"ico", "image/x-icon"}, {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"}, {"pdf", "application/pdf"},
+};
+
+static const char* mime_type_for(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+            if (strcasecmp(dot + 1, mime_types[i].ext) == 0) return mime_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static uint32_t fnv1a(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+void cached_file_release(CachedFile* file) {
+    if (--file->refs == 0) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+static void file_cache_lru_unlink(FileCache* cache, CachedFile* file) {
+    if (file->lru_prev) file->lru_prev->lru_next = file->lru_next;
+    else cache->lru_head = file->lru_next;
+    if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+    else cache->lru_tail = file->lru_prev;
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void file_cache_lru_push(FileCache* cache, CachedFile* file) {
+    file->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = file;
+    else cache->lru_tail = file;
+    cache->lru_head = file;
+}
+
+static void file_cache_remove(FileCache* cache, CachedFile* file) {
+    CachedFile** slot = &cache->buckets[file->hash % FILE_CACHE_BUCKETS];
+    while (*slot != file) slot = &(*slot)->hash_next;
+    *slot = file->hash_next;
+    file_cache_lru_unlink(cache, file);
+    file->cached = false;
+    cache->count--;
+    cached_file_release(file);
+}
+
+static CachedFile* file_cache_open(FileCache* cache, const char* path, uint32_t hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    
+    CachedFile* file = calloc(1, sizeof(CachedFile));
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+    strncpy(file->path, path, sizeof(file->path) - 1);
+    file->hash = hash;
+    file->fd = fd;
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    file->ino = st.st_ino;
+    file->checked_at = monotonic_seconds();
+    file->content_type = mime_type_for(path);
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%lx\"",
+             (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+    format_http_date(st.st_mtime, file->last_modified, sizeof(file->last_modified));
+    if (compressible_type(file->content_type)) {
+        // Probed once per open: a sibling added later shows up when the
+        // file itself changes or is evicted
+        for (int enc = ENC_GZIP; enc < ENC_COUNT; enc++) {
+            char variant[sizeof(file->path) + 8];
+            struct stat vst;
+            snprintf(variant, sizeof(variant), "%s%s", path, encoding_suffixes[enc]);
+            if (stat(variant, &vst) == 0 && S_ISREG(vst.st_mode)) file->variants |= 1u << enc;
+        }
+    }
+    file->refs = 1;
+    file->cached = true;
+    
+    if (cache->count >= FILE_CACHE_MAX) {
+        file_cache_remove(cache, cache->lru_tail);
+    }
+    CachedFile** bucket = &cache->buckets[hash % FILE_CACHE_BUCKETS];
+    file->hash_next = *bucket;
+    *bucket = file;
+    file_cache_lru_push(cache, file);
+    cache->count++;
+    return file;
+}
+
+// Returns the cached file with an extra reference, or NULL
+CachedFile* file_cache_get(const char* path) {
+    FileCache* cache = &file_cache;
+    uint32_t hash = fnv1a(path);
+    
+    CachedFile* file = cache->buckets[hash % FILE_CACHE_BUCKETS];
+    while (file && (file->hash != hash || strcmp(file->path, path) != 0)) {
+        file = file->hash_next;
+    }
+    
+    if (file) {
+        time_t now = monotonic_seconds();
+        if (file->checked_at != now) {
+            struct stat st;
+            file->checked_at = now;
+            if (stat(path, &st) < 0 || st.st_ino != file->ino ||
+                st.st_mtime != file->mtime || st.st_size != file->size) {
+                file_cache_remove(cache, file); // Changed or gone
+                file = NULL;
+            }
+        }
+    }
+    if (file) {
+        file_cache_lru_unlink(cache, file);
+        file_cache_lru_push(cache, file);
+    } else {
+        file = file_cache_open(cache, path, hash);
+        if (!file) return NULL;
+    }
+    
+    file->refs++;
+    return file;
+}
+
+// Drop this worker's entries; responses still sending keep their refs
+static void file_cache_clear(void) {
+    while (file_cache.lru_tail) file_cache_remove(&file_cache, file_cache.lru_tail);
+}
+
+// Decode %XX escapes and reject anything that could leave the root
+static bool sanitize_static_path(const char* in, size_t len, char* out, size_t size) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = in[i];
+        if (c == '%' && i + 2 < len && isxdigit((unsigned char)in[i + 1]) &&
+            isxdigit((unsigned char)in[i + 2])) {
+            char hex[3] = {in[i + 1], in[i + 2], '\0'};
+            c = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        if (c == '\0' || c == '\\' || n + 1 >= size) return false;
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    
+    // No ".." segments anywhere in the decoded path
+    for (const char* seg = out; *seg; ) {
+        const char* end = strchr(seg, '/');
+        size_t seg_len = end ? (size_t)(end - seg) : strlen(seg);
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') return false;
+        if (!end) break;
+        seg = end + 1;
+    }
+    return true;
+}
+
+// Parse a single "bytes=a-b" range; false means unsatisfiable / malformed
+static bool parse_range(const char* value, off_t size, off_t* start, off_t* end) {
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) return false;
+    const char* p = value + 6;
+    char* rest;
+    
+    if (*p == '-') {
+        long long suffix = strtoll(p + 1, &rest, 10);
+        if (rest == p + 1 || *rest || suffix <= 0) return false;
+        *start = suffix >= size ? 0 : size - suffix;
+        *end = size - 1;
+    } else {
+        long long first = strtoll(p, &rest, 10);
+        if (rest == p || *rest != '-' || first < 0 || first >= size) return false;
+        p = rest + 1;
+        *start = first;
+        if (*p == '\0') {
+            *end = size - 1;
+        } else {
+            long long last = strtoll(p, &rest, 10);
+            if (*rest || last < first) return false;
+            *end = last >= size ? size - 1 : last;
+        }
+    }
+    return size > 0;
+}
+
+static bool etag_matches(const char* header, const char* etag) {
+    if (strcmp(header, "*") == 0) return true;
+    return strstr(header, etag) != NULL; // Weak comparison is fine for GET
+}
+
+// Route handler: register with register_static_dir() or set route->ctx
+// to the root directory of a "/prefix/*path" route
+void handle_static(HttpRequest* req, HttpResponse* res) {
+    const char* root = req->route && req->route->ctx ? req->route->ctx : ".";
+    const ParamCapture* rest = req_param_at(req, req->param_count - 1);
+    
+    char rel[512];
+    if (!rest || !sanitize_static_path(req->path + rest->off, rest->len, rel, sizeof(rel))) {
+        set_json_response(res, 404, "{\"error\": \"Route not found\"}");
+        return;
+    }
+    
+    char path[1024];
+    size_t rel_len = strlen(rel);
+    snprintf(path, sizeof(path), "%s/%s%s", root, rel,
+             rel_len == 0 || rel[rel_len - 1] == '/' ? "index.html" : "");
+    
+    CachedFile* file = file_cache_get(path);
+    if (!file) {
+        set_json_response(res, 404, "{\"error\": \"Route not found\"}");
+        return;
+    }
+    
+    // Serve a precompressed sibling (style.css.br, .zst, .gz) when the
+    // client takes it; ranges always address the plain file
+    const char* type = file->content_type;
+    if (file->variants) {
+        add_response_header(res, "Vary", "Accept-Encoding");
+        ContentEncoding enc = http_header(req, HDR_RANGE) ? ENC_IDENTITY
+                                                          : negotiate_allowed(req, file->variants);
+        if (enc != ENC_IDENTITY) {
+            char variant[sizeof(path) + 8];
+            snprintf(variant, sizeof(variant), "%s%s", path, encoding_suffixes[enc]);
+            CachedFile* encoded = file_cache_get(variant);
+            if (encoded) {
+                cached_file_release(file);
+                file = encoded;
+                add_response_header(res, "Content-Encoding", encoding_names[enc]);
+            }
+        }
+    }
+    
+    add_response_header(res, "ETag", file->etag);
+    add_response_header(res, "Last-Modified", file->last_modified);
+    add_response_header(res, "Accept-Ranges", "bytes");
+    
+    // Conditional GET: If-None-Match wins over If-Modified-Since
+    const char* inm = http_header(req, HDR_IF_NONE_MATCH);
+    const char* ims = http_header(req, HDR_IF_MODIFIED_SINCE);
+    if ((inm && etag_matches(inm, file->etag)) ||
+        (!inm && ims && strcmp(ims, file->last_modified) == 0)) {
+        res->status_code = 304;
+        res->content_type = type;
+        cached_file_release(file);
+        return;
+    }
+    
+    off_t start = 0, end = file->size - 1;
+    const char* range = http_header(req, HDR_RANGE);
+    const char* if_range = http_header(req, HDR_IF_RANGE);
+    if (range && (!if_range || strcmp(if_range, file->etag) == 0)) {
+        char content_range[64];
+        if (!parse_range(range, file->size, &start, &end)) {
+            snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long)file->size);
+            add_response_header(res, "Content-Range", content_range);
+            set_json_response(res, 416, "{\"error\": \"Range not satisfiable\"}");
+            cached_file_release(file);
+            return;
+        }
+        snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+                 (long long)start, (long long)end, (long long)file->size);
+        add_response_header(res, "Content-Range", content_range);
+        res->status_code = 206;
+    } else {
+        res->status_code = 200;
+    }
+    
+    // The connection drops this reference once the body has been sent
+    res->content_type = type;
+    res->file = file;
+    res->file_offset = start;
+    res->body_length = file->size == 0 ? 0 : (size_t)(end - start + 1);
+}
+
+// Serve files below dir at "<prefix>/..." (prefix without trailing slash)
+Route* register_static_dir(const char* prefix, const char* dir) {
+    char pattern[256];
+    snprintf(pattern, sizeof(pattern), "%s/*path", strcmp(prefix, "/") == 0 ? "" : prefix);
+    Route* route = register_route(GET, pattern, handle_static);
+    if (route) route->ctx = (void*)dir;
+    return route;
+}
+
+// ============= Event Loop =============
+
+#define EV_READ  1
+#define EV_WRITE 2
+
+typedef struct {
+    int fd; // epoll or kqueue descriptor
+} EventLoop;
+
+typedef struct {
+    void* data;
+    int events;
+} LoopEvent;
+
+int loop_init(EventLoop* loop) {
+#ifdef USE_EPOLL
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    loop->fd = kqueue();
+#endif
+    return loop->fd < 0 ? -1 : 0;
+}
+
+#ifdef USE_EPOLL
+static int loop_ctl(EventLoop* loop, int op, int fd, int events, void* data) {
+    struct epoll_event ev = {0};
+    if (events & EV_READ) ev.events |= EPOLLIN;
+    if (events & EV_WRITE) ev.events |= EPOLLOUT;
+    ev.data.ptr = data;
+    return epoll_ctl(loop->fd, op, fd, &ev);
+}
+#else
+static int loop_ctl(EventLoop* loop, int fd, int events, void* data) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, (events & EV_READ) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, data);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, (events & EV_WRITE) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, data);
+    return kevent(loop->fd, changes, 2, NULL, 0, NULL);
+}
+#endif
+
+int loop_add(EventLoop* loop, int fd, int events, void* data) {
+#ifdef USE_EPOLL
+    return loop_ctl(loop, EPOLL_CTL_ADD, fd, events, data);
+#else
+    return loop_ctl(loop, fd, events, data);
+#endif
+}
+
+int loop_mod(EventLoop* loop, int fd, int events, void* data) {
+#ifdef USE_EPOLL
+    return loop_ctl(loop, EPOLL_CTL_MOD, fd, events, data);
+#else
+    return loop_ctl(loop, fd, events, data);
+#endif
+}
+
+void loop_del(EventLoop* loop, int fd) {
+    // Closing the descriptor removes it from both epoll and kqueue, but
+    // doing it explicitly keeps the interest set tidy if fd is shared
+#ifdef USE_EPOLL
+    epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(loop->fd, changes, 2, NULL, 0, NULL);
+#endif
+}
+
+int loop_wait(EventLoop* loop, LoopEvent* out, int max_events, int timeout_ms) {
+#ifdef USE_EPOLL
+    struct epoll_event events[MAX_EVENTS];
+    if (max_events > MAX_EVENTS) max_events = MAX_EVENTS;
+    int n = epoll_wait(loop->fd, events, max_events, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        out[i].data = events[i].data.ptr;
+        out[i].events = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) out[i].events |= EV_READ;
+        if (events[i].events & EPOLLOUT) out[i].events |= EV_WRITE;
+    }
+    return n;
+#else
+    struct kevent events[MAX_EVENTS];
+    struct timespec ts, *tsp = NULL;
+    if (max_events > MAX_EVENTS) max_events = MAX_EVENTS;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    int n = kevent(loop->fd, NULL, 0, events, max_events, tsp);
+    for (int i = 0; i < n; i++) {
+        out[i].data = events[i].udata;
+        out[i].events = events[i].filter == EVFILT_WRITE ? EV_WRITE : EV_READ;
+    }
+    return n;
+#endif
+}
+
+// ============= io_uring =============
+
+// Opt-in backend for plain HTTP (--io-uring). Instead of readiness events
+// plus one system call per accept, recv, send and close, each worker
+// queues those operations on its own ring and hands the whole batch to
+// the kernel in the io_uring_enter() that also waits for completions, so
+// a loop iteration costs one system call however many sockets it served:
+//   accept  one multishot request per listener yields every new socket
+//   recv    one multishot request per connection; the kernel fills
+//           buffers from the worker's provided buffer ring, and the
+//           bytes are copied into rbuf before the buffer goes back
+//   send    responses up to RING_SLOT_SIZE are gathered into a slot of
+//           a registered buffer and written with WRITE_FIXED, larger ones
+//           go out as SENDMSG straight from conn->iov
+//   close   linked behind the last response, or queued by conn_destroy()
+// File bodies still use sendfile(), polled with POLL_ADD like the
+// completion eventfd. The connection side is in Connection Handling.
+
+#ifdef HAVE_IO_URING
+
+#define RING_ENTRIES 1024        // Submission queue; completions get 4x as many
+#define RING_RECV_BUFS 256       // Provided buffers shared by the worker's recvs
+#define RING_RECV_BUF_SIZE 4096
+#define RING_RECV_GROUP 0
+#define RING_SLOTS 128           // Registered send buffer, in slots
+#define RING_SLOT_SIZE 4096
+
+// user_data is the owner (a Connection or the Worker) with the operation
+// in its low bits, which alignment leaves free
+typedef enum {
+    RING_OP_ACCEPT,
+    RING_OP_WAKE,
+    RING_OP_RECV,
+    RING_OP_SEND,
+    RING_OP_POLL,
+    RING_OP_CLOSE,
+    RING_OP_CANCEL
+} RingOp;
+
+#define RING_OP_MASK 7
+
+typedef struct Ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned queued;             // SQEs written since the last io_uring_enter()
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;                // NULL when it shares sq_map
+    size_t cq_map_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring* recv_ring;
+    char* recv_bufs;             // RING_RECV_BUFS * RING_RECV_BUF_SIZE
+    uint16_t recv_tail;
+    char* slots;                 // RING_SLOTS * RING_SLOT_SIZE, NULL if not registered
+    uint16_t free_slots[RING_SLOTS];
+    int free_slot_count;
+} Ring;
+
+static inline uint64_t ring_data(const void* owner, RingOp op) {
+    return (uint64_t)(uintptr_t)owner | op;
+}
+
+static void ring_free(Ring* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->recv_ring) munmap(ring->recv_ring, RING_RECV_BUFS * sizeof(struct io_uring_buf));
+    if (ring->fd >= 0) close(ring->fd); // Also unregisters the buffers
+    free(ring->recv_bufs);
+    free(ring->slots);
+    free(ring);
+}
+
+// Hand a provided buffer (back) to the kernel
+static void ring_recv_give(Ring* ring, uint16_t bid) {
+    struct io_uring_buf* buf = &ring->recv_ring->bufs[ring->recv_tail & (RING_RECV_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->recv_bufs + (size_t)bid * RING_RECV_BUF_SIZE);
+    buf->len = RING_RECV_BUF_SIZE;
+    buf->bid = bid;
+    ring->recv_tail++;
+    atomic_store_explicit((_Atomic uint16_t*)&ring->recv_ring->tail, ring->recv_tail,
+                          memory_order_release);
+}
+
+// Set up a worker's ring. It starts disabled: run_event_loop() enables it
+// from the worker thread, which then is its only submitter.
+static Ring* ring_create(void) {
+    Ring* ring = calloc(1, sizeof(Ring));
+    if (!ring) return NULL;
+    struct io_uring_params p = {0};
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+    p.cq_entries = RING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+    char* cq = ring->sq_map;
+    if (ring->sq_map && !single) {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+        cq = ring->cq_map;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    if (!ring->sq_map || !cq || !ring->sqes) {
+        ring_free(ring);
+        return NULL;
+    }
+    char* sq = ring->sq_map;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Provided buffers for multishot recv: the kernel picks one per completion
+    ring->recv_ring = mmap(NULL, RING_RECV_BUFS * sizeof(struct io_uring_buf),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->recv_ring == MAP_FAILED) ring->recv_ring = NULL;
+    ring->recv_bufs = malloc((size_t)RING_RECV_BUFS * RING_RECV_BUF_SIZE);
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->recv_ring;
+    reg.ring_entries = RING_RECV_BUFS;
+    reg.bgid = RING_RECV_GROUP;
+    if (!ring->recv_ring || !ring->recv_bufs ||
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        ring_free(ring);
+        return NULL;
+    }
+    for (int i = 0; i < RING_RECV_BUFS; i++) ring_recv_give(ring, i);
+
+    // Registered send slots are pinned against RLIMIT_MEMLOCK; without
+    // them every response goes out by SENDMSG
+    ring->slots = aligned_alloc(4096, (size_t)RING_SLOTS * RING_SLOT_SIZE);
+    struct iovec slab = {ring->slots, (size_t)RING_SLOTS * RING_SLOT_SIZE};
+    if (ring->slots &&
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &slab, 1) == 0) {
+        for (int i = 0; i < RING_SLOTS; i++) ring->free_slots[i] = RING_SLOTS - 1 - i;
+        ring->free_slot_count = RING_SLOTS;
+    } else {
+        free(ring->slots);
+        ring->slots = NULL;
+    }
+    return ring;
+}
+
+static bool ring_enable(Ring* ring) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == 0;
+}
+
+// Pass what is queued to the kernel without waiting
+static void ring_submit(Ring* ring) {
+    int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+    if (n > 0) ring->queued -= n;
+}
+
+// Make sure count SQEs can be queued without a submission in between,
+// so a linked pair goes to the kernel together
+static void ring_reserve(Ring* ring, unsigned count) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+    if (*ring->sq_tail - head + count > ring->sq_entries) ring_submit(ring);
+}
+
+static struct io_uring_sqe* ring_sqe(Ring* ring, uint8_t opcode, int fd, uint64_t data) {
+    ring_reserve(ring, 1);
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + 1, memory_order_release);
+    ring->queued++;
+    return sqe;
+}
+
+// Submit the batch and wait up to timeout_ms for a completion; 0 on
+// success (completions are read with ring_next()), -1 with errno set
+static int ring_wait(Ring* ring, int timeout_ms) {
+    struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {0};
+    if (timeout_ms >= 0) arg.ts = (uint64_t)(uintptr_t)&ts;
+    int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (n < 0) return errno == ETIME ? 0 : -1;
+    ring->queued -= n;
+    return 0;
+}
+
+static bool ring_next(Ring* ring, struct io_uring_cqe* out) {
+    unsigned head = *ring->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire)) {
+        return false;
+    }
+    *out = ring->cqes[head & ring->cq_mask];
+    atomic_store_explicit((_Atomic unsigned*)ring->cq_head, head + 1, memory_order_release);
+    return true;
+}
+
+static void ring_accept(Ring* ring, int listen_fd, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_ACCEPT, listen_fd, data);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void ring_recv(Ring* ring, int fd, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_RECV, fd, data);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_RECV_GROUP;
+}
+
+static inline char* ring_slot(Ring* ring, int slot) {
+    return ring->slots + (size_t)slot * RING_SLOT_SIZE;
+}
+
+static int ring_slot_get(Ring* ring) {
+    return ring->free_slot_count > 0 ? ring->free_slots[--ring->free_slot_count] : -1;
+}
+
+static void ring_slot_put(Ring* ring, int slot) {
+    ring->free_slots[ring->free_slot_count++] = slot;
+}
+
+static struct io_uring_sqe* ring_write_slot(Ring* ring, int fd, int slot, size_t len, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_WRITE_FIXED, fd, data);
+    sqe->addr = (uint64_t)(uintptr_t)ring_slot(ring, slot);
+    sqe->len = len;
+    sqe->off = (uint64_t)-1; // Sockets have no file position
+    sqe->buf_index = 0;
+    return sqe;
+}
+
+// MSG_WAITALL: the kernel keeps retrying until everything is sent, so a
+// short result means an error and breaks a link
+static struct io_uring_sqe* ring_sendmsg(Ring* ring, int fd, const struct msghdr* msg, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_SENDMSG, fd, data);
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    return sqe;
+}
+
+static void ring_close(Ring* ring, int fd, uint64_t data) {
+    ring_sqe(ring, IORING_OP_CLOSE, fd, data);
+}
+
+static void ring_poll(Ring* ring, int fd, unsigned events, bool multishot, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_POLL_ADD, fd, data);
+    sqe->poll32_events = events;
+    if (multishot) sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+// Cancel every request submitted with data; the cancellation's own CQE
+// only shows up if it found nothing
+static void ring_cancel(Ring* ring, uint64_t data) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, ring_data(NULL, RING_OP_CANCEL));
+    sqe->addr = data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+// Check --io-uring against the kernel before any worker starts: without
+// the features above (Linux 6.1), or serving TLS, the workers use epoll
+void ring_init(void) {
+    if (!config.io_uring) return;
+    if (config.tls_cert) {
+        fprintf(stderr, "--io-uring serves plain HTTP only; using epoll for TLS\n");
+        config.io_uring = false;
+        return;
+    }
+    Ring* probe = ring_create();
+    if (!probe) {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+        config.io_uring = false;
+        return;
+    }
+    ring_free(probe);
+}
+
+#else // !HAVE_IO_URING
+
+void ring_init(void) {
+    if (!config.io_uring) return;
+    fprintf(stderr, "io_uring support not built in (IO_URING=0, or pre-6.0 kernel headers), using %s\n",
+#ifdef USE_EPOLL
+            "epoll"
+#else
+            "kqueue"
+#endif
+    );
+    config.io_uring = false;
+}
+
+#endif // HAVE_IO_URING
+
+// ============= Response Serialization =============
+
+// Responses are sent as an iovec list instead of being copied into one
+// buffer: a cached status line, pre-rendered header fragments, a small
+// arena-rendered Content-Length line and the body pointer as-is.
+
+#define IOVS_PER_RESPONSE 6
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define CHUNK_HEADER_MAX 10 // Hex length plus CRLF for STREAM_CHUNK_SIZE
+
+typedef struct {
+    char text[64];
+    size_t len;
+} HeaderFragment;
+
+// "HTTP/1.1 200 OK\r\n" for every code, built once by response_cache_init()
+static HeaderFragment status_lines[STATUS_MAX - STATUS_MIN + 1];
+
+// "Content-Type: ...\r\n" for the types set by the response helpers
+static const char* common_content_types[] = {
+    "application/json", "text/html", "text/plain",
+};
+static HeaderFragment content_type_lines[sizeof(common_content_types) / sizeof(common_content_types[0])];
+
+static const char chunked_line[] = "Transfer-Encoding: chunked\r\n";
+static const char keep_alive_tail[] = "Connection: keep-alive\r\n\r\n";
+static const char close_tail[] = "Connection: close\r\n\r\n";
+
+void response_cache_init(void) {
+    for (int code = STATUS_MIN; code <= STATUS_MAX; code++) {
+        HeaderFragment* line = &status_lines[code - STATUS_MIN];
+        line->len = snprintf(line->text, sizeof(line->text), "HTTP/1.1 %d %s\r\n",
+                             code, get_status_text(code));
+    }
+    for (size_t i = 0; i < sizeof(common_content_types) / sizeof(common_content_types[0]); i++) {
+        HeaderFragment* line = &content_type_lines[i];
+        line->len = snprintf(line->text, sizeof(line->text), "Content-Type: %s\r\n",
+                             common_content_types[i]);
+    }
+}
+
+// Write an unsigned decimal; returns the number of characters written
+size_t format_uint(char* out, uint64_t value) {
+    char tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (size_t i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+static const HeaderFragment* status_line(int code) {
+    if (code < STATUS_MIN || code > STATUS_MAX) code = 500;
+    return &status_lines[code - STATUS_MIN];
+}
+
+// Pre-rendered line for a common type, or one rendered into the arena
+static bool content_type_line(HttpResponse* res, struct iovec* iov) {
+    for (size_t i = 0; i < sizeof(common_content_types) / sizeof(common_content_types[0]); i++) {
+        if (res->content_type == common_content_types[i] ||
+            strcmp(res->content_type, common_content_types[i]) == 0) {
+            iov->iov_base = content_type_lines[i].text;
+            iov->iov_len = content_type_lines[i].len;
+            return true;
+        }
+    }
+    size_t len = strlen(res->content_type);
+    char* line = arena_alloc(res->arena, len + 16);
+    if (!line) return false;
+    memcpy(line, "Content-Type: ", 14);
+    memcpy(line + 14, res->content_type, len);
+    memcpy(line + 14 + len, "\r\n", 2);
+    iov->iov_base = line;
+    iov->iov_len = len + 16;
+    return true;
+}
+
+// Status line through Content-Length; returns the iovecs used or -1
+static int serialize_head(HttpResponse* res, bool chunked, struct iovec* iov) {
+    int n = 0;
+    const HeaderFragment* status = status_line(res->status_code);
+    iov[n].iov_base = (void*)status->text;
+    iov[n++].iov_len = status->len;
+
+    if (!content_type_line(res, &iov[n++])) return -1;
+
+    if (res->extra_headers_len > 0) {
+        iov[n].iov_base = res->extra_headers;
+        iov[n++].iov_len = res->extra_headers_len;
+    }
+
+    if (res->producer) {
+        if (chunked) {
+            iov[n].iov_base = (void*)chunked_line;
+            iov[n++].iov_len = sizeof(chunked_line) - 1;
+        }
+    } else if (res->status_code != 204 && res->status_code != 304) {
+        char* length_line = arena_alloc(res->arena, 40);
+        if (!length_line) return -1;
+        memcpy(length_line, "Content-Length: ", 16);
+        size_t len = 16 + format_uint(length_line + 16, res->body_length);
+        length_line[len++] = '\r';
+        length_line[len++] = '\n';
+        iov[n].iov_base = length_line;
+        iov[n++].iov_len = len;
+    }
+    return n;
+}
+
+// "Date: ...\r\nConnection: ...\r\n\r\n", copied into the arena so the
+// queued bytes don't change when the worker clock ticks
+static bool date_tail_line(HttpResponse* res, bool keep_alive, struct iovec* iov) {
+    const WorkerClock* clock = clock_get();
+    const char* tail = keep_alive ? keep_alive_tail : close_tail;
+    size_t tail_len = keep_alive ? sizeof(keep_alive_tail) - 1 : sizeof(close_tail) - 1;
+    char* line = arena_alloc(res->arena, clock->http_date_len + tail_len);
+    if (!line) return false;
+    memcpy(line, clock->http_date, clock->http_date_len);
+    memcpy(line + clock->http_date_len, tail, tail_len);
+    iov->iov_base = line;
+    iov->iov_len = clock->http_date_len + tail_len;
+    return true;
+}
+
+// Fill IOVS_PER_RESPONSE iovecs for res; returns how many were used or -1.
+// Streamed bodies are framed with chunked encoding when the client speaks
+// HTTP/1.1, otherwise they are delimited by closing the connection.
+int serialize_response(HttpResponse* res, bool keep_alive, bool chunked, struct iovec* iov) {
+    if (res->prebuilt) {
+        iov[0].iov_base = res->prebuilt->data;
+        iov[0].iov_len = res->prebuilt->head_len;
+        if (!date_tail_line(res, keep_alive, &iov[1])) return -1;
+        if (res->prebuilt->body_len == 0) return 2;
+        iov[2].iov_base = res->prebuilt->data + res->prebuilt->head_len;
+        iov[2].iov_len = res->prebuilt->body_len;
+        return 3;
+    }
+
+    int n = serialize_head(res, chunked, iov);
+    if (n < 0 || !date_tail_line(res, keep_alive, &iov[n++])) return -1;
+
+    // File bodies are sent by sendfile() after these iovecs drain
+    if (res->body_length > 0 && !res->producer && !res->file) {
+        iov[n].iov_base = res->body;
+        iov[n++].iov_len = res->body_length;
+    }
+    return n;
+}
+
+// Copy the head and body of a plain body response into one buffer
+static bool prebuild_response(HttpResponse* res, PrebuiltResponse* out) {
+    struct iovec iov[IOVS_PER_RESPONSE];
+    int n = serialize_head(res, false, iov);
+    if (n < 0) return false;
+    size_t head_len = 0;
+    for (int i = 0; i < n; i++) head_len += iov[i].iov_len;
+
+    out->data = malloc(head_len + res->body_length);
+    if (!out->data) return false;
+    size_t pos = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(out->data + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    memcpy(out->data + pos, res->body, res->body_length);
+    out->status_code = res->status_code;
+    out->head_len = head_len;
+    out->body_len = res->body_length;
+    return true;
+}
+
+// Run handler against an empty request and keep its serialized output,
+// plus a compressed variant per built-in coding when variants is given.
+// Returns NULL if it allocated nothing usable or streams its body.
+static PrebuiltResponse* prerender_request(Arena* arena, HttpRequest* req, RouteHandler handler,
+                                           PrebuiltResponse** variants) {
+    HttpResponse res;
+    init_response(&res, arena);
+    handler(req, &res);
+    if (res.producer || res.file) {
+        if (res.file) cached_file_release(res.file);
+        return NULL;
+    }
+
+    bool compressible = variants && response_compressible(&res);
+    if (compressible) add_response_header(&res, "Vary", "Accept-Encoding");
+    PrebuiltResponse* prebuilt = calloc(1, sizeof(PrebuiltResponse));
+    if (!prebuilt || !prebuild_response(&res, prebuilt)) {
+        free(prebuilt);
+        return NULL;
+    }
+
+    for (int enc = ENC_GZIP; compressible && enc < ENC_COUNT; enc++) {
+        HttpResponse encoded = res; // Shares the arena; the original stays intact
+        if (!encoding_available(enc) || !compress_body(&encoded, enc, true)) continue;
+        variants[enc] = calloc(1, sizeof(PrebuiltResponse));
+        if (variants[enc] && !prebuild_response(&encoded, variants[enc])) {
+            free(variants[enc]);
+            variants[enc] = NULL;
+        }
+    }
+    return prebuilt;
+}
+
+static PrebuiltResponse* prerender(Arena* arena, Route* route, RouteHandler handler,
+                                   PrebuiltResponse** variants) {
+    HttpRequest req = {0};
+    req.path = route ? route->path : "";
+    req.path_len = strlen(req.path);
+    req.query_string = "";
+    req.body = "";
+    req.route = route;
+    req.keep_alive = true;
+    req.http11 = true;
+    return prerender_request(arena, &req, handler, variants);
+}
+
+// Render constant routes and the 404, 405 and 503 replies once, before workers start
+void prerender_constant_routes(void) {
+    static ArenaPool pool; // Startup only; the one arena stays cached here
+    Arena* arena = arena_pool_get(&pool);
+    if (!arena) return;
+
+    for (int i = 0; i < server.route_count; i++) {
+        Route* route = server.routes[i];
+        if (!route->constant) continue;
+        route->prebuilt = prerender(arena, route, route->handler, route->prebuilt_encoded);
+        if (!route->prebuilt) {
+            fprintf(stderr, "Constant route %s %s could not be prerendered\n",
+                    method_to_string(route->method), route->path);
+        }
+        arena_reset(arena);
+    }
+    server.not_found = prerender(arena, NULL, handle_not_found, NULL);
+    arena_reset(arena);
+    for (int allowed = 1; allowed < (1 << UNSUPPORTED); allowed++) {
+        HttpRequest req = {.path = "", .query_string = "", .body = "",
+                           .keep_alive = true, .http11 = true, .allowed_methods = (uint8_t)allowed};
+        server.not_allowed[allowed] = prerender_request(arena, &req, handle_method_not_allowed, NULL);
+        arena_reset(arena);
+    }
+    server.overloaded = prerender(arena, NULL, handle_overloaded, NULL);
+    arena_pool_put(&pool, arena);
+}
+
+// ============= Response Cache =============
+
+// TTL cache for routes registered with register_cached_route(). Entries
+// hold the serialized response (see PrebuiltResponse) and are keyed on
+// "METHOD path?query" with the query parameters sorted. The key space is
+// split across CACHE_SHARDS independently locked LRU lists, each with an
+// equal share of the -c memory budget. On a miss the first request
+// inserts a pending entry and runs the handler. Other requests for the
+// same key are deferred onto the entry instead of running the handler
+// again, and cache_store() completes them with the stored response
+// through their own worker's completion queue, so no event loop blocks.
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256      // Hash chains per shard
+#define CACHE_MAX_KEY 2048
+#define CACHE_MAX_QUERY_PARAMS 32
+
+typedef struct CacheShard CacheShard;
+
+typedef struct CacheEntry {
+    struct CacheEntry* hash_next;
+    struct CacheEntry* lru_prev; // Towards most recently used
+    struct CacheEntry* lru_next;
+    CacheShard* shard;
+    PrebuiltResponse wire;
+    time_t expires;          // Monotonic seconds
+    size_t bytes;            // Charged against the shard budget
+    int refs;                // Table link plus in-flight responses
+    bool pending;            // Handler still running; wire is empty
+    HttpAsync* waiters;      // Deferred requests for the pending fill
+    bool linked;             // Reachable from the hash table
+    uint32_t hash;
+    size_t key_len;
+    char key[];
+} CacheEntry;
+
+struct CacheShard {
+    pthread_mutex_t lock;
+    CacheEntry* buckets[CACHE_BUCKETS];
+    CacheEntry* lru_head;    // Most recently used
+    CacheEntry* lru_tail;
+    size_t bytes;
+    size_t budget;
+};
+
+static CacheShard cache_shards[CACHE_SHARDS];
+
+void cache_init(void) {
+    size_t budget = (size_t)config.cache_mb * 1024 * 1024 / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+        cache_shards[i].budget = budget;
+    }
+}
+
+typedef struct {
+    const char* text;
+    size_t len;
+} QueryParam;
+
+static int query_param_cmp(const void* a, const void* b) {
+    const QueryParam* x = a;
+    const QueryParam* y = b;
+    int c = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+    if (c != 0) return c;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+// "GET /path?a=1&b=2" with the query parameters in sorted order, so that
+// ?b=2&a=1 shares the entry, then "\n" and the negotiated coding.
+// Returns the key length, or 0 when the key is too long to cache.
+static size_t cache_key(const HttpRequest* req, char* out, size_t size) {
+    QueryParam params[CACHE_MAX_QUERY_PARAMS];
+    int count = 0;
+    const char* q = req->query_string;
+    const char* end = q + req->query_length;
+    while (q < end) {
+        const char* amp = memchr(q, '&', end - q);
+        size_t len = (amp ? amp : end) - q;
+        if (len > 0) {
+            if (count == CACHE_MAX_QUERY_PARAMS) return 0;
+            params[count].text = q;
+            params[count++].len = len;
+        }
+        q += len + 1;
+    }
+    qsort(params, count, sizeof(QueryParam), query_param_cmp);
+
+    const char* method = method_to_string(req->method);
+    size_t len = strlen(method);
+    if (len + 1 + req->path_len + 1 >= size) return 0;
+    memcpy(out, method, len);
+    out[len++] = ' ';
+    memcpy(out + len, req->path, req->path_len);
+    len += req->path_len;
+    for (int i = 0; i < count; i++) {
+        if (len + 1 + params[i].len >= size) return 0;
+        out[len++] = i == 0 ? '?' : '&';
+        memcpy(out + len, params[i].text, params[i].len);
+        len += params[i].len;
+    }
+
+    // One entry per content coding, see compress_response()
+    ContentEncoding enc = negotiate_encoding(req, true);
+    if (enc != ENC_IDENTITY) {
+        size_t name_len = strlen(encoding_names[enc]);
+        if (len + 1 + name_len >= size) return 0;
+        out[len++] = '\n';
+        memcpy(out + len, encoding_names[enc], name_len);
+        len += name_len;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static CacheEntry* cache_find(CacheShard* shard, uint32_t hash, const char* key, size_t len) {
+    CacheEntry* e = shard->buckets[hash % CACHE_BUCKETS];
+    while (e && !(e->hash == hash && e->key_len == len && memcmp(e->key, key, len) == 0)) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+static void cache_lru_unlink(CacheShard* shard, CacheEntry* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else shard->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else shard->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void cache_lru_push(CacheShard* shard, CacheEntry* e) {
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = e;
+    else shard->lru_tail = e;
+    shard->lru_head = e;
+}
+
+// Drop a reference; the shard lock must be held
+static void cache_entry_put(CacheEntry* e) {
+    if (--e->refs > 0) return;
+    free(e->wire.data);
+    free(e);
+}
+
+// Remove from the table; connections still sending it keep it alive
+static void cache_unlink(CacheShard* shard, CacheEntry* e) {
+    CacheEntry** link = &shard->buckets[e->hash % CACHE_BUCKETS];
+    while (*link != e) link = &(*link)->hash_next;
+    *link = e->hash_next;
+    cache_lru_unlink(shard, e);
+    shard->bytes -= e->bytes;
+    e->linked = false;
+    cache_entry_put(e);
+}
+
+// Release the reference taken for a sent response
+void cache_entry_release(CacheEntry* e) {
+    CacheShard* shard = e->shard;
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_put(e);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Serve a fresh entry, defer the request until a fill in progress is
+// done, or claim the fill for this request. Register it after auth_middleware so
+// a cached response is never handed out past an access check.
+bool cache_middleware(HttpRequest* req, HttpResponse* res) {
+    if (!req->route || req->route->cache_ttl <= 0 || req->method != GET) return true;
+
+    // Request directives: no-store bypasses the cache, no-cache refetches
+    const char* cc = http_header(req, HDR_CACHE_CONTROL);
+    if (cc && strstr(cc, "no-store")) return true;
+    bool refetch = cc && (strstr(cc, "no-cache") || strstr(cc, "max-age=0"));
+
+    char key[CACHE_MAX_KEY];
+    size_t key_len = cache_key(req, key, sizeof(key));
+    if (key_len == 0) return true;
+    uint32_t hash = fnv1a(key);
+    CacheShard* shard = &cache_shards[hash % CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry* e = cache_find(shard, hash, key, key_len);
+    if (e && e->pending) {
+        HttpAsync* async = refetch ? NULL : http_defer(res);
+        if (async) {
+            async->next = e->waiters; // Completed by cache_store()
+            e->waiters = async;
+        }
+        // Refetching, or not deferrable: serve this one uncached
+        pthread_mutex_unlock(&shard->lock);
+        return !async;
+    }
+    if (e && !refetch && e->expires > monotonic_seconds()) {
+        e->refs++;
+        cache_lru_unlink(shard, e);
+        cache_lru_push(shard, e);
+        pthread_mutex_unlock(&shard->lock);
+        res->prebuilt = &e->wire;
+        res->cache_entry = e;
+        return false; // Served from cache
+    }
+    if (e) cache_unlink(shard, e); // Expired or refetching
+
+    CacheEntry* fill = calloc(1, sizeof(CacheEntry) + key_len + 1);
+    if (fill) {
+        fill->shard = shard;
+        fill->hash = hash;
+        fill->key_len = key_len;
+        memcpy(fill->key, key, key_len + 1);
+        fill->pending = true;
+        fill->linked = true;
+        fill->refs = 2; // Table link plus this request's, see cache_store()
+        fill->hash_next = shard->buckets[hash % CACHE_BUCKETS];
+        shard->buckets[hash % CACHE_BUCKETS] = fill;
+        cache_lru_push(shard, fill);
+        req->cache_fill = fill;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+// TTL the handler allowed through its own Cache-Control header: the
+// route TTL by default, max-age=N if given, 0 for no-store/no-cache/private
+static int response_cache_ttl(const HttpResponse* res, int ttl) {
+    const char* p = res->extra_headers;
+    const char* end = p + res->extra_headers_len;
+    while (p && p < end) {
+        const char* eol = memchr(p, '\n', end - p);
+        if (!eol) break;
+        if (eol - p > 14 && strncasecmp(p, "Cache-Control:", 14) == 0) {
+            char value[128];
+            size_t len = eol - (p + 14);
+            if (len >= sizeof(value)) len = sizeof(value) - 1;
+            memcpy(value, p + 14, len);
+            value[len] = '\0';
+            if (strstr(value, "no-store") || strstr(value, "no-cache") ||
+                strstr(value, "private")) {
+                return 0;
+            }
+            const char* max_age = strstr(value, "max-age=");
+            if (max_age) ttl = atoi(max_age + 8);
+        }
+        p = eol + 1;
+    }
+    return ttl;
+}
+
+// Response filter: complete the fill claimed by cache_middleware() and
+// hand the stored response to the requests waiting on it. If nothing was
+// stored they run the handler themselves, uncached.
+void cache_store(HttpRequest* req, HttpResponse* res) {
+    CacheEntry* fill = req->cache_fill;
+    if (!fill) return;
+    req->cache_fill = NULL;
+
+    int ttl = response_cache_ttl(res, req->route->cache_ttl);
+    bool ok = ttl > 0 && res->status_code == 200 &&
+              !res->producer && !res->file && !res->prebuilt;
+    // Serialized outside the lock; the entry is ours while pending
+    if (ok) ok = prebuild_response(res, &fill->wire);
+
+    CacheShard* shard = fill->shard;
+    pthread_mutex_lock(&shard->lock);
+    fill->pending = false;
+    if (ok && fill->linked) {
+        fill->expires = monotonic_seconds() + ttl;
+        fill->bytes = sizeof(CacheEntry) + fill->key_len +
+                      fill->wire.head_len + fill->wire.body_len;
+        shard->bytes += fill->bytes;
+        while (shard->bytes > shard->budget && shard->lru_tail) {
+            cache_unlink(shard, shard->lru_tail);
+        }
+    } else if (fill->linked) {
+        cache_unlink(shard, fill);
+    }
+    HttpAsync* waiters = fill->waiters;
+    fill->waiters = NULL;
+    bool stored = fill->linked;
+    for (HttpAsync* w = waiters; w && stored; w = w->next) fill->refs++;
+    if (stored) {
+        // Send the stored copy; our reference now belongs to the response
+        res->prebuilt = &fill->wire;
+        res->cache_entry = fill;
+    } else {
+        cache_entry_put(fill);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    while (waiters) {
+        HttpAsync* w = waiters;
+        waiters = w->next; // http_complete() reuses the link
+        if (stored) {
+            w->res.prebuilt = &fill->wire;
+            w->res.cache_entry = fill;
+        } else {
+            w->cache_retry = true;
+        }
+        http_complete(w);
+    }
+}
+
+// Hand every fresh entry to emit(), with its remaining TTL, so a
+// successor process starts warm (see handoff_serve()). References are
+// taken under the shard lock and emit() runs outside it, so a slow
+// reader never stalls the workers. False if emit() failed.
+bool cache_export(bool (*emit)(void* ctx, const CacheEntry* e, int ttl), void* ctx) {
+    time_t now = monotonic_seconds();
+    bool ok = true;
+    for (int s = 0; s < CACHE_SHARDS && ok; s++) {
+        CacheShard* shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        int count = 0;
+        for (CacheEntry* e = shard->lru_head; e; e = e->lru_next) count++;
+        CacheEntry** entries = count ? malloc(count * sizeof(CacheEntry*)) : NULL;
+        int taken = 0;
+        // Oldest first, so imports rebuild the same LRU order
+        for (CacheEntry* e = shard->lru_tail; e && entries; e = e->lru_prev) {
+            if (e->pending || e->expires <= now) continue;
+            e->refs++;
+            entries[taken++] = e;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        for (int i = 0; i < taken; i++) {
+            if (ok) ok = emit(ctx, entries[i], (int)(entries[i]->expires - now));
+            cache_entry_release(entries[i]);
+        }
+        free(entries);
+    }
+    return ok;
+}
+
+// Add an entry built elsewhere (a predecessor's export); takes ownership
+// of data, a PrebuiltResponse buffer. Existing keys are left alone.
+bool cache_import(const char* key, size_t key_len, int status, char* data, size_t head_len,
+                  size_t body_len, int ttl) {
+    uint32_t hash = fnv1a(key);
+    CacheShard* shard = &cache_shards[hash % CACHE_SHARDS];
+    CacheEntry* e = calloc(1, sizeof(CacheEntry) + key_len + 1);
+    if (!e) {
+        free(data);
+        return false;
+    }
+    e->shard = shard;
+    e->hash = hash;
+    e->key_len = key_len;
+    memcpy(e->key, key, key_len);
+    e->key[key_len] = '\0';
+    e->wire.status_code = status;
+    e->wire.data = data;
+    e->wire.head_len = head_len;
+    e->wire.body_len = body_len;
+    e->expires = monotonic_seconds() + ttl;
+    e->bytes = sizeof(CacheEntry) + key_len + head_len + body_len;
+    e->linked = true;
+    e->refs = 1;
+
+    pthread_mutex_lock(&shard->lock);
+    bool added = !cache_find(shard, hash, key, key_len) && e->bytes <= shard->budget;
+    if (added) {
+        e->hash_next = shard->buckets[hash % CACHE_BUCKETS];
+        shard->buckets[hash % CACHE_BUCKETS] = e;
+        cache_lru_push(shard, e);
+        shard->bytes += e->bytes;
+        while (shard->bytes > shard->budget && shard->lru_tail) {
+            cache_unlink(shard, shard->lru_tail);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!added) {
+        free(data);
+        free(e);
+    }
+    return added;
+}
+
+// ============= Access Log =============
+
+// Workers never write log lines themselves. Each one appends fixed-size
+// records to its own single-producer/single-consumer ring, and one
+// background thread formats them in batches and writes them to stdout
+// with large write() calls. A full ring drops the record and counts it
+// instead of blocking the worker.
+
+#define ACCESS_RING_SIZE 4096  // Records per worker, power of two
+#define ACCESS_PATH_MAX 110    // Path and query, truncated
+#define ACCESS_WRITE_BUFFER (64 * 1024)
+#define ACCESS_IDLE_SLEEP_MS 10
+
+typedef struct {
+    time_t wall;
+    uint64_t bytes;
+    uint32_t latency_us;
+    uint16_t status;
+    uint8_t method;
+    uint8_t path_len;
+    char path[ACCESS_PATH_MAX];
+} AccessRecord;
+
+typedef struct {
+    _Alignas(64) _Atomic size_t head;   // Next slot to write (worker)
+    _Alignas(64) _Atomic size_t tail;   // Next slot to read (log thread)
+    _Alignas(64) _Atomic uint64_t dropped;
+    AccessRecord records[ACCESS_RING_SIZE];
+} AccessRing;
+
+static AccessRing access_rings[MAX_WORKERS];
+static _Thread_local AccessRing* access_ring; // Set by run_event_loop()
+
+// Append a record from the worker thread; never blocks
+void access_log_record(const HttpRequest* req, int status, uint64_t bytes, uint64_t latency_us) {
+    AccessRing* ring = access_ring;
+    if (!ring) return;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ACCESS_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    AccessRecord* r = &ring->records[head & (ACCESS_RING_SIZE - 1)];
+    r->wall = clock_get()->wall;
+    r->bytes = bytes;
+    r->latency_us = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+    r->status = status;
+    r->method = req->method;
+    size_t len = req->path_len < ACCESS_PATH_MAX ? req->path_len : ACCESS_PATH_MAX;
+    memcpy(r->path, req->path, len);
+    if (req->query_length > 0 && len < ACCESS_PATH_MAX) {
+        r->path[len++] = '?';
+        size_t q = req->query_length < ACCESS_PATH_MAX - len ? req->query_length
+                                                               : ACCESS_PATH_MAX - len;
+        memcpy(r->path + len, req->query_string, q);
+        len += q;
+    }
+    r->path_len = len;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void access_log_flush(char* buf, size_t* len) {
+    size_t off = 0;
+    while (off < *len) {
+        ssize_t n = write(STDOUT_FILENO, buf + off, *len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // Nowhere to log to; discard
+        off += n;
+    }
+    *len = 0;
+}
+
+static void* access_log_thread(void* arg) {
+    static char buf[ACCESS_WRITE_BUFFER];
+    size_t len = 0;
+    time_t formatted_at = 0;
+    char time_str[32] = "";
+    uint64_t reported_drops = 0;
+
+    while (1) {
+        bool idle = true;
+        uint64_t drops = 0;
+        for (int w = 0; w < MAX_WORKERS; w++) {
+            AccessRing* ring = &access_rings[w];
+            drops += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (tail == head) continue;
+            idle = false;
+            
+            for (; tail != head; tail++) {
+                const AccessRecord* r = &ring->records[tail & (ACCESS_RING_SIZE - 1)];
+                if (r->wall != formatted_at) {
+                    struct tm tm;
+                    localtime_r(&r->wall, &tm);
+                    strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S %Y", &tm);
+                    formatted_at = r->wall;
+                }
+                if (sizeof(buf) - len < ACCESS_PATH_MAX + 128) access_log_flush(buf, &len);
+                len += snprintf(buf + len, sizeof(buf) - len, "[%s] %s %.*s %u %llu %uus\n",
+                                time_str, method_to_string(r->method), (int)r->path_len, r->path,
+                                r->status, (unsigned long long)r->bytes, r->latency_us);
+            }
+            // Release the slots only after the records have been copied out
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        
+        if (drops != reported_drops) {
+            if (sizeof(buf) - len < 64) access_log_flush(buf, &len);
+            len += snprintf(buf + len, sizeof(buf) - len, "[access log] %llu records dropped\n",
+                            (unsigned long long)(drops - reported_drops));
+            reported_drops = drops;
+        }
+        if (len > 0) access_log_flush(buf, &len);
+        if (idle) {
+            struct timespec pause = {0, ACCESS_IDLE_SLEEP_MS * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return arg;
+}
+
+// Give the log thread time to write out what the workers logged (exit)
+void access_log_sync(void) {
+    for (int tries = 0; tries < 100; tries++) {
+        bool empty = true;
+        for (int w = 0; w < MAX_WORKERS && empty; w++) {
+            empty = atomic_load_explicit(&access_rings[w].tail, memory_order_acquire) ==
+                    atomic_load_explicit(&access_rings[w].head, memory_order_relaxed);
+        }
+        // One more pass: the last batch may still be in the thread's buffer
+        struct timespec pause = {0, ACCESS_IDLE_SLEEP_MS * 2000000L};
+        nanosleep(&pause, NULL);
+        if (empty) return;
+    }
+}
+
+bool start_access_log(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, access_log_thread, NULL) != 0) {
+        perror("Access log thread");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// ============= Metrics Endpoint =============
+
+// Prometheus text exposition of the per-worker metrics, summed at scrape
+// time. Histogram buckets are reported at powers of two from 256 ns.
+
+#define METRICS_MIN_EXP 8
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} HistogramSnapshot;
+
+typedef struct {
+    Arena* arena;
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} MetricsBuffer;
+
+static void metrics_printf(MetricsBuffer* b, const char* fmt, ...) {
+    if (b->failed) return;
+    while (1) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            b->failed = true;
+            return;
+        }
+        if ((size_t)n < b->cap - b->len) {
+            b->len += n;
+            return;
+        }
+        size_t cap = b->cap * 2 + n;
+        char* grown = arena_grow(b->arena, b->data, b->cap, cap);
+        if (!grown) {
+            b->failed = true;
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+}
+
+static void hist_merge(HistogramSnapshot* out, const Histogram* h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+    out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->sum_ns += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+}
+
+// labels is the comma-separated label list, e.g. stage="parse"
+static void metrics_histogram(MetricsBuffer* b, const char* name, const char* labels,
+                              const HistogramSnapshot* h) {
+    uint64_t cumulative = 0;
+    int index = 0;
+    for (int e = METRICS_MIN_EXP; e <= HIST_MAX_EXP; e++) {
+        int limit = HIST_SUB + (e - 2) * HIST_SUB; // First bucket at 2^e ns
+        while (index < limit) cumulative += h->buckets[index++];
+        metrics_printf(b, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                       (double)(1ULL << e) / 1e9, (unsigned long long)cumulative);
+    }
+    metrics_printf(b, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+                   (unsigned long long)h->count);
+    metrics_printf(b, "%s_sum{%s} %.9f\n", name, labels, (double)h->sum_ns / 1e9);
+    metrics_printf(b, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+}
+
+// Route patterns as label values: escape '\' and '"'
+static void metrics_label_value(char* out, size_t size, const char* value) {
+    size_t n = 0;
+    for (; *value && n + 2 < size; value++) {
+        if (*value == '\\' || *value == '"') out[n++] = '\\';
+        out[n++] = *value;
+    }
+    out[n] = '\0';
+}
+
+void handle_metrics(HttpRequest* req, HttpResponse* res) {
+    MetricsBuffer b = {res->arena, NULL, 0, 16 * 1024, false};
+    b.data = arena_alloc(res->arena, b.cap);
+    if (!b.data) {
+        set_text_response(res, 500, "Out of memory\n");
+        return;
+    }
+
+    uint64_t connections = 0, parse_errors = 0, dropped = 0;
+    uint64_t handshakes = 0, resumed = 0, ktls = 0, rejected = 0, limited = 0, shed = 0;
+    for (int w = 0; w < MAX_WORKERS; w++) {
+        if (metrics_slots[w]) {
+            connections += atomic_load_explicit(&metrics_slots[w]->connections, memory_order_relaxed);
+            parse_errors += atomic_load_explicit(&metrics_slots[w]->parse_errors, memory_order_relaxed);
+            handshakes += atomic_load_explicit(&metrics_slots[w]->tls_handshakes, memory_order_relaxed);
+            resumed += atomic_load_explicit(&metrics_slots[w]->tls_resumed, memory_order_relaxed);
+            ktls += atomic_load_explicit(&metrics_slots[w]->tls_ktls, memory_order_relaxed);
+            rejected += atomic_load_explicit(&metrics_slots[w]->conns_rejected, memory_order_relaxed);
+            limited += atomic_load_explicit(&metrics_slots[w]->rate_limited, memory_order_relaxed);
+            shed += atomic_load_explicit(&metrics_slots[w]->shed, memory_order_relaxed);
+        }
+        dropped += atomic_load_explicit(&access_rings[w].dropped, memory_order_relaxed);
+    }
+    metrics_printf(&b, "# TYPE webserver_connections_accepted_total counter\n"
+                       "webserver_connections_accepted_total %llu\n"
+                       "# TYPE webserver_parse_errors_total counter\n"
+                       "webserver_parse_errors_total %llu\n"
+                       "# TYPE webserver_access_log_dropped_total counter\n"
+                       "webserver_access_log_dropped_total %llu\n",
+                   (unsigned long long)connections, (unsigned long long)parse_errors,
+                   (unsigned long long)dropped);
+    metrics_printf(&b, "# TYPE webserver_tls_handshakes_total counter\n"
+                       "webserver_tls_handshakes_total %llu\n"
+                       "# TYPE webserver_tls_resumed_total counter\n"
+                       "webserver_tls_resumed_total %llu\n"
+                       "# TYPE webserver_tls_ktls_total counter\n"
+                       "webserver_tls_ktls_total %llu\n",
+                   (unsigned long long)handshakes, (unsigned long long)resumed,
+                   (unsigned long long)ktls);
+    metrics_printf(&b, "# TYPE webserver_open_connections gauge\n"
+                       "webserver_open_connections %d\n"
+                       "# TYPE webserver_connections_rejected_total counter\n"
+                       "webserver_connections_rejected_total %llu\n"
+                       "# TYPE webserver_rate_limited_total counter\n"
+                       "webserver_rate_limited_total %llu\n"
+                       "# TYPE webserver_requests_shed_total counter\n"
+                       "webserver_requests_shed_total %llu\n",
+                   atomic_load_explicit(&open_connections, memory_order_relaxed),
+                   (unsigned long long)rejected, (unsigned long long)limited,
+                   (unsigned long long)shed);
+
+    // Requests by route and status, and latency by route
+    metrics_printf(&b, "# TYPE webserver_requests_total counter\n");
+    for (int r = 0; r <= server.route_count; r++) {
+        char route[300] = "unmatched";
+        const char* method = "";
+        if (r < server.route_count) {
+            metrics_label_value(route, sizeof(route), server.routes[r]->path);
+            method = method_to_string(server.routes[r]->method);
+        }
+        for (int code = STATUS_MIN; code <= STATUS_MAX; code++) {
+            uint64_t count = 0;
+            for (int w = 0; w < MAX_WORKERS; w++) {
+                if (!metrics_slots[w]) continue;
+                count += atomic_load_explicit(&metrics_slots[w]->routes[r].status[code - STATUS_MIN],
+                                              memory_order_relaxed);
+            }
+            if (count == 0) continue;
+            metrics_printf(&b, "webserver_requests_total{method=\"%s\",route=\"%s\",code=\"%d\"} %llu\n",
+                           method, route, code, (unsigned long long)count);
+        }
+    }
+    
+    metrics_printf(&b, "# TYPE webserver_request_duration_seconds histogram\n");
+    for (int r = 0; r <= server.route_count; r++) {
+        HistogramSnapshot h = {0};
+        for (int w = 0; w < MAX_WORKERS; w++) {
+            if (metrics_slots[w]) hist_merge(&h, &metrics_slots[w]->routes[r].latency);
+        }
+        if (h.count == 0) continue;
+        char route[300] = "unmatched";
+        char labels[360];
+        if (r < server.route_count) metrics_label_value(route, sizeof(route), server.routes[r]->path);
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"",
+                 r < server.route_count ? method_to_string(server.routes[r]->method) : "", route);
+        metrics_histogram(&b, "webserver_request_duration_seconds", labels, &h);
+    }
+
+    // Lifecycle stages and each middleware, by registry id
+    metrics_printf(&b, "# TYPE webserver_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT + server.middleware_count; stage++) {
+        HistogramSnapshot h = {0};
+        for (int w = 0; w < MAX_WORKERS; w++) {
+            if (!metrics_slots[w]) continue;
+            hist_merge(&h, stage < STAGE_COUNT ? &metrics_slots[w]->stages[stage]
+                                               : &metrics_slots[w]->middleware[stage - STAGE_COUNT]);
+        }
+        char labels[64];
+        if (stage < STAGE_COUNT) {
+            snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[stage]);
+        } else {
+            const char* name = server.middleware_names[stage - STAGE_COUNT];
+            snprintf(labels, sizeof(labels), "stage=\"middleware\",index=\"%d\",name=\"%s\"",
+                     stage - STAGE_COUNT, name ? name : "");
+        }
+        metrics_histogram(&b, "webserver_stage_duration_seconds", labels, &h);
+    }
+
+    if (b.failed) {
+        set_text_response(res, 500, "Out of memory\n");
+        return;
+    }
+    // Already in the arena, so no copy through set_response_body()
+    res->status_code = 200;
+    res->content_type = "text/plain; version=0.0.4";
+    res->body = b.data;
+    res->body_length = b.len;
+}
+
+// GET /debug/traces: the slow sampled traces, newest first. The store is
+// copied out under its lock and formatted afterwards.
+void handle_traces(HttpRequest* req, HttpResponse* res) {
+    Trace* traces = arena_alloc(res->arena, sizeof(trace_store.traces));
+    if (!traces) {
+        set_text_response(res, 500, "Out of memory\n");
+        return;
+    }
+    pthread_mutex_lock(&trace_store.lock);
+    uint64_t recorded = trace_store.recorded;
+    int count = recorded < TRACE_KEEP ? (int)recorded : TRACE_KEEP;
+    for (int i = 0; i < count; i++) {
+        traces[i] = trace_store.traces[(recorded - 1 - i) % TRACE_KEEP];
+    }
+    pthread_mutex_unlock(&trace_store.lock);
+
+    JsonWriter w;
+    json_begin(&w, res->arena, 256 + (size_t)count * 1024);
+    json_object_begin(&w);
+    json_key(&w, "sample");
+    json_int(&w, config.trace_sample);
+    json_key(&w, "slow_ms");
+    json_int(&w, config.trace_slow_ms);
+    json_key(&w, "recorded");
+    json_uint(&w, recorded);
+    json_key(&w, "traces");
+    json_array_begin(&w);
+    for (int i = 0; i < count; i++) {
+        const Trace* t = &traces[i];
+        json_object_begin(&w);
+        json_key(&w, "id");
+        json_uint(&w, t->id);
+        json_key(&w, "time");
+        json_int(&w, t->wall);
+        json_key(&w, "method");
+        json_string(&w, method_to_string(t->method));
+        json_key(&w, "path");
+        json_string_n(&w, t->path, t->path_len);
+        json_key(&w, "route");
+        if (t->route >= 0) json_string(&w, server.routes[t->route]->path);
+        else json_null(&w);
+        json_key(&w, "status");
+        json_int(&w, t->status);
+        json_key(&w, "duration_ns");
+        json_uint(&w, t->duration_ns);
+        json_key(&w, "spans");
+        json_array_begin(&w);
+        for (int s = 0; s < t->span_count; s++) {
+            const TraceSpan* span = &t->spans[s];
+            json_object_begin(&w);
+            json_key(&w, "stage");
+            json_string(&w, span_names[span->kind]);
+            if (span->kind == SPAN_MIDDLEWARE) {
+                const char* name = server.middleware_names[span->index];
+                json_key(&w, "name");
+                json_string(&w, name ? name : "");
+            }
+            json_key(&w, "start_ns");
+            json_uint(&w, span->offset_ns);
+            json_key(&w, "duration_ns");
+            json_uint(&w, span->duration_ns);
+            json_object_end(&w);
+        }
+        json_array_end(&w);
+        json_key(&w, "spans_dropped");
+        json_int(&w, t->spans_dropped);
+        json_object_end(&w);
+    }
+    json_array_end(&w);
+    json_object_end(&w);
+    json_finish(&w, res, 200);
+}
+
+// ============= TLS =============
+
+// Built with TLS=1 and started with --tls-cert/--tls-key, the listener
+// speaks TLS only. All workers share one SSL_CTX, so a session ticket
+// issued by one worker resumes on any other; TLS 1.2 clients without
+// tickets fall back to the server-side session cache. With kTLS
+// (OpenSSL 3, Linux tls module) the handshake hands the record keys to
+// the kernel: responses then go out through plain sendmsg() and
+// sendfile() and are encrypted in-kernel. Otherwise OpenSSL encrypts,
+// with small iovecs gathered into full records first.
+
+#define TLS_RECORD_SIZE 16384        // Largest TLS plaintext record
+#define TLS_SESSION_CACHE 20480      // TLS 1.2 session-ID cache entries
+#define TLS_SESSION_TIMEOUT 7200     // Seconds a session or ticket stays valid
+
+#ifdef HAVE_OPENSSL
+
+typedef SSL TlsSession;
+
+static SSL_CTX* tls_ctx; // NULL unless TLS is configured
+
+// Offer HTTP/1.1 to clients that negotiate ALPN
+static int tls_select_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                           const unsigned char* in, unsigned int inlen, void* arg) {
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, outlen, http11, sizeof(http11) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Load the certificate and key from config. Returns false on error;
+// does nothing (and succeeds) when TLS isn't configured.
+bool tls_init(void) {
+    if (!config.tls_cert && !config.tls_key) return true;
+    if (!config.tls_cert || !config.tls_key) {
+        fprintf(stderr, "TLS needs both --tls-cert and --tls-key\n");
+        return false;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) goto fail;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    // Partial writes let a full socket stop us mid-iovec; idle keep-alive
+    // connections give their record buffers back
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+
+    // Resumption: stateless tickets (keys rotated by OpenSSL, shared via
+    // the context) plus a session-ID cache for TLS 1.2
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config.tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, config.tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        goto fail;
+    }
+    tls_ctx = ctx;
+    return true;
+
+fail:
+    fprintf(stderr, "TLS setup failed:\n");
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return false;
+}
+
+static inline bool tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+// Server side of a new connection; the handshake runs in tls_handshake()
+TlsSession* tls_session_new(int fd) {
+    SSL* ssl = SSL_new(tls_ctx);
+    if (!ssl) return NULL;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+// Free the session, sending close_notify first if the handshake finished
+void tls_session_free(TlsSession* tls) {
+    if (SSL_is_init_finished(tls)) {
+        SSL_shutdown(tls); // One non-blocking attempt, no waiting for the reply
+        ERR_clear_error();
+    }
+    SSL_free(tls);
+}
+
+// Map an OpenSSL result onto the recv()/send() conventions the
+// connection code already handles: -1 with EAGAIN to wait, 0 for EOF
+static ssize_t tls_result(TlsSession* tls, int rc) {
+    if (rc > 0) return rc;
+    switch (SSL_get_error(tls, rc)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            ERR_clear_error();
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+// Advance the handshake: 1 when done, 0 to wait for the socket (EV_WRITE
+// if *want_write), -1 on failure
+int tls_handshake(TlsSession* tls, bool* want_write) {
+    int rc = SSL_do_handshake(tls);
+    if (rc == 1) return 1;
+    int err = SSL_get_error(tls, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        *want_write = err == SSL_ERROR_WANT_WRITE;
+        return 0;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+static inline bool tls_resumed(TlsSession* tls) {
+    return SSL_session_reused(tls);
+}
+
+// Did the handshake hand transmit encryption to the kernel?
+static inline bool tls_kernel_send(TlsSession* tls) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(tls));
+#else
+    (void)tls;
+    return false;
+#endif
+}
+
+static inline size_t tls_pending(TlsSession* tls) {
+    return (size_t)SSL_pending(tls);
+}
+
+static inline ssize_t tls_read(TlsSession* tls, void* buf, size_t len) {
+    return tls_result(tls, SSL_read(tls, buf, len > INT32_MAX ? INT32_MAX : (int)len));
+}
+
+// After -1/EAGAIN the next call must pass the same bytes again
+// (possibly from another address)
+static inline ssize_t tls_write(TlsSession* tls, const void* buf, size_t len) {
+    return tls_result(tls, SSL_write(tls, buf, len > INT32_MAX ? INT32_MAX : (int)len));
+}
+
+// sendfile() through kernel TLS; only valid when tls_kernel_send()
+static ssize_t tls_sendfile(TlsSession* tls, int fd, off_t offset, size_t len) {
+#if defined(SSL_OP_ENABLE_KTLS) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+    ossl_ssize_t n = SSL_sendfile(tls, fd, offset, len, 0);
+    return n < 0 ? tls_result(tls, (int)n) : n;
+#else
+    (void)tls; (void)fd; (void)offset; (void)len;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+#else // !HAVE_OPENSSL
+
+typedef struct TlsSession TlsSession; // Never created
+
+bool tls_init(void) {
+    if (!config.tls_cert && !config.tls_key) return true;
+    fprintf(stderr, "TLS support not built in (rebuild with make TLS=1)\n");
+    return false;
+}
+
+static inline bool tls_enabled(void) { return false; }
+static inline TlsSession* tls_session_new(int fd) { (void)fd; return NULL; }
+static inline void tls_session_free(TlsSession* tls) { (void)tls; }
+static inline int tls_handshake(TlsSession* tls, bool* want_write) {
+    (void)tls; (void)want_write;
+    return -1;
+}
+static inline bool tls_resumed(TlsSession* tls) { (void)tls; return false; }
+static inline bool tls_kernel_send(TlsSession* tls) { (void)tls; return false; }
+static inline size_t tls_pending(TlsSession* tls) { (void)tls; return 0; }
+static inline ssize_t tls_read(TlsSession* tls, void* buf, size_t len) {
+    (void)tls; (void)buf; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+static inline ssize_t tls_write(TlsSession* tls, const void* buf, size_t len) {
+    (void)tls; (void)buf; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+static inline ssize_t tls_sendfile(TlsSession* tls, int fd, off_t offset, size_t len) {
+    (void)tls; (void)fd; (void)offset; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
+
+// ============= Timer Wheel =============
+
+// Hierarchical timing wheel (Varghese & Lauck), one per worker: four
+// levels of 64 slots with 64 ms ticks at the bottom, covering about
+// 12 days. Timers are intrusive and doubly linked, so arming and
+// cancelling are O(1) with no allocation. A level-0 slot holds only
+// timers due at exactly that tick; higher levels are cascaded one
+// level down whenever the tick below them wraps. Re-arming to the same
+// tick is a no-op, so pushing a deadline back on every read costs a
+// comparison most of the time.
+
+#define TIMER_TICK_SHIFT 6                  // 64 ms ticks
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1ull << (WHEEL_BITS * WHEEL_LEVELS)) // Ticks the wheel can hold
+
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer** pprev;   // The link pointing at this timer, NULL when not armed
+    uint64_t expires;       // Tick
+} Timer;
+
+typedef struct {
+    uint64_t now;           // Last tick processed
+    Timer* slots[WHEEL_LEVELS][WHEEL_SIZE];
+} TimerWheel;
+
+typedef void (*TimerCallback)(Timer* timer, void* ctx);
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_ms >> TIMER_TICK_SHIFT;
+}
+
+static inline bool timer_armed(const Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+void timer_cancel(Timer* timer) {
+    if (!timer->pprev) return;
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void timer_link(Timer** head, Timer* timer) {
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+// Slot for timer->expires relative to the current tick
+static void timer_insert(TimerWheel* wheel, Timer* timer) {
+    if (timer->expires <= wheel->now) timer->expires = wheel->now + 1;
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta >= WHEEL_SPAN) {
+        timer->expires = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while (delta >= 1ull << (WHEEL_BITS * (level + 1))) level++;
+    size_t index = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    timer_link(&wheel->slots[level][index], timer);
+}
+
+// Arm (or move) timer to fire at expires_ms, rounded up to a tick
+void timer_arm(TimerWheel* wheel, Timer* timer, uint64_t expires_ms) {
+    uint64_t tick = (expires_ms + (1u << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+    if (timer_armed(timer) && timer->expires == tick) return;
+    timer_cancel(timer);
+    timer->expires = tick;
+    timer_insert(wheel, timer);
+}
+
+// Move a slot's list into *list, so callbacks may cancel or re-arm
+// any timer while it is walked
+static void timer_detach(Timer** slot, Timer** list) {
+    *list = *slot;
+    *slot = NULL;
+    if (*list) (*list)->pprev = list;
+}
+
+// Process every tick up to now_ms, calling fire for each expired timer
+// (already cancelled, so fire may re-arm or free it)
+void timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms, TimerCallback fire, void* ctx) {
+    uint64_t target = now_ms >> TIMER_TICK_SHIFT;
+    while (wheel->now < target) {
+        wheel->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1ull << (WHEEL_BITS * level)) - 1)) break;
+            size_t index = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+            Timer* list;
+            timer_detach(&wheel->slots[level][index], &list);
+            while (list) {
+                Timer* timer = list;
+                timer_cancel(timer);
+                timer_insert(wheel, timer);
+            }
+        }
+
+        Timer* due;
+        timer_detach(&wheel->slots[0][wheel->now & (WHEEL_SIZE - 1)], &due);
+        while (due) {
+            Timer* timer = due;
+            timer_cancel(timer);
+            fire(timer, ctx);
+        }
+    }
+}
+
+// Milliseconds from now_ms until the wheel next has work (a due level-0
+// slot or a cascade boundary), capped at max_ms: the event loop's timeout
+int timer_wheel_next_ms(const TimerWheel* wheel, uint64_t now_ms, int max_ms) {
+    for (uint64_t tick = wheel->now + 1; tick <= wheel->now + WHEEL_SIZE; tick++) {
+        size_t index = tick & (WHEEL_SIZE - 1);
+        if (index != 0 && !wheel->slots[0][index]) continue;
+        uint64_t at = tick << TIMER_TICK_SHIFT;
+        if (at <= now_ms) return 0;
+        return at - now_ms < (uint64_t)max_ms ? (int)(at - now_ms) : max_ms;
+    }
+    return max_ms;
+}
+
+// ============= Connection Handling =============
+
+// Per-connection state machine:
+//   HANDSHAKE -> TLS handshake in progress (TLS listeners only), then READING
+//   READING  -> accumulate bytes; every complete request already in the
+//               buffer is dispatched back to back (pipelining)
+//   WRITING  -> flush the queued responses, possibly across many events
+//   WAITING  -> everything before a deferred response is flushed; nothing
+//               is polled until http_complete() hands the response back
+//   CLOSING  -> connection is torn down at the end of the event
+// After a flush a keep-alive connection goes back to READING.
+// Every state but WAITING runs against a deadline, see conn_schedule().
+typedef enum {
+    CONN_HANDSHAKE,
+    CONN_READING,
+    CONN_WRITING,
+    CONN_WAITING,
+    CONN_CLOSING
+} ConnState;
+
+// What a connection's timer is enforcing
+typedef enum {
+    TIMEOUT_NONE,           // WAITING: the deferred handler owns the clock
+    TIMEOUT_IDLE,           // Keep-alive with nothing buffered
+    TIMEOUT_HEADER,         // Handshake or request head, from its first byte; never extended
+    TIMEOUT_BODY,           // Reading a body; extended by every read
+    TIMEOUT_WRITE           // Flushing; extended by every write
+} ConnTimeout;
+
+// Arena-allocated hold on a cache entry until the response is flushed
+typedef struct CacheRef {
+    CacheEntry* entry;
+    struct CacheRef* next;
+} CacheRef;
+
+typedef struct Connection {
+    int fd;
+    ConnState state;
+    TlsSession* tls;       // NULL for plain TCP
+    bool tls_want_write;   // Handshake is waiting for EV_WRITE
+    bool ktls;             // Kernel encrypts sends: use sendmsg()/sendfile() as is
+    uint32_t client_ip;    // Peer IPv4 address, host byte order
+    char* rbuf;
+    size_t rlen;
+    size_t rcap;
+    struct iovec iov[MAX_IOV]; // Queued response pieces, sent with sendmsg()
+    int iov_head;          // First iovec not yet fully sent
+    int iov_count;
+    size_t out_pending;    // Bytes still to send
+    // Active streamed response; further pipelined requests wait for it
+    BodyProducer producer;
+    void* producer_ctx;
+    char* chunk_buf;       // STREAM_CHUNK_SIZE plus framing, from the arena
+    bool chunked;
+    // Active file body, sent with sendfile() after the queued iovecs
+    CachedFile* file;
+    off_t file_offset;
+    size_t file_remaining;
+    struct CacheRef* cache_refs; // Cache entries the queued iovecs point into
+    // Deferred request; rbuf and the arena stay untouched until it completes
+    HttpAsync* async;
+    size_t async_end;      // Buffer offset just past the deferred request
+    HttpAsync* upload;     // Request whose body is being streamed, see conn_on_head()
+    bool orphaned;         // Closed while deferred; freed on completion
+    CompletionQueue* completions;
+    HttpParser parser;     // Progress on the request at the head of rbuf
+    Arena* arena;          // Request/response memory, reset after each flush
+    bool keep_alive;       // Cleared once the last response is queued
+    int requests_served;
+    Timer timer;           // In the worker's wheel, see conn_schedule()
+    ConnTimeout timeout;   // What timer is currently enforcing
+    int timeout_request;   // requests_served when the timer was last armed
+    uint64_t first_byte_ns; // Of the request being read, 0 until it arrives
+    uint64_t parse_ns;     // parse_request() time spent on it so far
+    struct Trace* flushing; // Sampled response still being written
+    struct Connection* live_prev; // Worker's open connections, see worker_begin_drain()
+    struct Connection* live_next;
+#ifdef HAVE_IO_URING
+    // io_uring backend, see conn_ring_arm()
+    int ring_ops;          // Submitted requests whose last CQE is still due
+    int ring_recvs;        // Multishot recvs among them (two while one is being cancelled)
+    bool ring_recv;        // A multishot recv is armed and not being cancelled
+    bool ring_send;        // A send is in flight; the iovecs stay queued until it completes
+    bool ring_poll;        // Waiting for POLLOUT (sendfile, or a write, hit EAGAIN)
+    bool ring_close;       // A close of fd is linked behind the in-flight send
+    int ring_slot;         // Registered slot the in-flight send was gathered into, or -1
+    size_t ring_send_len;
+    struct msghdr ring_msg; // Of an in-flight SENDMSG
+    char* spill;           // Received while the connection could not take it
+    size_t spill_len;
+    size_t spill_cap;
+#endif
+    struct Connection* next_free;
+} Connection;
+
+// Each worker owns a listening socket bound with SO_REUSEPORT and its own
+// event loop, so the kernel spreads new connections across workers and no
+// accept lock is shared between them.
+typedef struct {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    EventLoop loop;
+    TimerWheel timers;     // Connection deadlines
+    CompletionQueue completions; // Deferred responses ready to send
+    // Recycled connections and arenas, so steady state does no malloc
+    Connection* free_conns;
+    int free_conn_count;
+    ArenaPool arena_pool;
+    Connection* live;      // Every connection not yet released
+    int live_count;
+    bool draining;         // Listener closed, see worker_begin_drain()
+    uint64_t drain_deadline_ms;
+#ifdef HAVE_IO_URING
+    Ring* ring;            // With --io-uring; the epoll loop is then unused
+#endif
+} Worker;
+
+// Marker stored as epoll/kqueue user data for the listening socket
+static int listener_tag;
+
+// Set once on shutdown or hand-off: responses queued from then on carry
+// Connection: close (see drain_start() and send_response()). Idle connections
+// get DRAIN_IDLE_MS to send one more request: a client that is about to
+// reuse one is then told to close instead of finding it reset.
+static _Atomic bool draining;
+#define DRAIN_IDLE_MS 1000
+
+#ifdef HAVE_IO_URING
+static _Thread_local Ring* worker_ring; // Set by run_event_loop() with --io-uring
+#define RING_SPILL_MAX (64 * 1024) // Stop receiving while this much waits in the spill
+#endif
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Pick the deadline for the connection's current state and (re)arm its
+// timer; called after every event. A request head gets one deadline from
+// its first byte, so a client trickling bytes can't hold the slot open.
+static void conn_schedule(Worker* worker, Connection* conn) {
+    ConnTimeout timeout;
+    if (conn->state == CONN_HANDSHAKE) {
+        timeout = TIMEOUT_HEADER;
+    } else if (conn->state == CONN_WRITING) {
+        timeout = TIMEOUT_WRITE;
+    } else if (conn->state == CONN_WAITING) {
+        timeout = TIMEOUT_NONE;
+    } else if (conn->parser.state > P_HEAD_LF) {
+        timeout = TIMEOUT_BODY;
+    } else {
+        timeout = conn->rlen > 0 ? TIMEOUT_HEADER : TIMEOUT_IDLE;
+    }
+
+    if (timeout == TIMEOUT_NONE) {
+        timer_cancel(&conn->timer);
+    } else if (timeout != TIMEOUT_HEADER || conn->timeout != TIMEOUT_HEADER ||
+               conn->timeout_request != conn->requests_served) {
+        int seconds = timeout == TIMEOUT_IDLE   ? config.keepalive_timeout
+                    : timeout == TIMEOUT_HEADER ? config.header_timeout
+                    : timeout == TIMEOUT_BODY   ? config.body_timeout
+                                                : config.write_timeout;
+        uint64_t ms = (uint64_t)seconds * 1000;
+        if (timeout == TIMEOUT_IDLE && worker->draining && ms > DRAIN_IDLE_MS) ms = DRAIN_IDLE_MS;
+        timer_arm(&worker->timers, &conn->timer, monotonic_ms() + ms);
+        conn->timeout_request = conn->requests_served;
+    }
+    conn->timeout = timeout;
+}
+
+Connection* conn_create(Worker* worker, int fd) {
+    Connection* conn = worker->free_conns;
+    if (conn) {
+        worker->free_conns = conn->next_free;
+        worker->free_conn_count--;
+        conn->next_free = NULL;
+    } else {
+        conn = calloc(1, sizeof(Connection));
+        if (!conn) return NULL;
+        conn->rcap = BUFFER_SIZE;
+        conn->rbuf = malloc(conn->rcap);
+        conn->arena = arena_pool_get(&worker->arena_pool);
+        if (!conn->rbuf || !conn->arena) {
+            free(conn->rbuf);
+            if (conn->arena) arena_pool_put(&worker->arena_pool, conn->arena);
+            free(conn);
+            return NULL;
+        }
+    }
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->tls = NULL;
+    conn->tls_want_write = false;
+    conn->ktls = false;
+    conn->keep_alive = true;
+    conn->requests_served = 0;
+    conn->timeout = TIMEOUT_NONE;
+    conn->rlen = 0;
+    conn->iov_head = conn->iov_count = 0;
+    conn->out_pending = 0;
+    conn->producer = NULL;
+    conn->file = NULL;
+    conn->cache_refs = NULL;
+    conn->async = NULL;
+    conn->upload = NULL;
+    conn->orphaned = false;
+    conn->first_byte_ns = 0;
+    conn->parse_ns = 0;
+    conn->flushing = NULL;
+    conn->completions = &worker->completions;
+    parser_reset(&conn->parser);
+#ifdef HAVE_IO_URING
+    conn->ring_ops = conn->ring_recvs = 0;
+    conn->ring_recv = conn->ring_send = conn->ring_poll = conn->ring_close = false;
+    conn->ring_slot = -1;
+    conn->spill_len = 0;
+#endif
+    conn->live_prev = NULL;
+    conn->live_next = worker->live;
+    if (worker->live) worker->live->live_prev = conn;
+    worker->live = conn;
+    worker->live_count++;
+    return conn;
+}
+
+// Drop the cache references of flushed (or abandoned) responses
+static void conn_release_cache_refs(Connection* conn) {
+    for (CacheRef* ref = conn->cache_refs; ref; ref = ref->next) {
+        cache_entry_release(ref->entry);
+    }
+    conn->cache_refs = NULL;
+}
+
+// Return a connection (and its buffers) to the worker's free list
+void conn_release(Worker* worker, Connection* conn) {
+    if (conn->live_prev) conn->live_prev->live_next = conn->live_next;
+    else worker->live = conn->live_next;
+    if (conn->live_next) conn->live_next->live_prev = conn->live_prev;
+    worker->live_count--;
+    conn_release_cache_refs(conn);
+    arena_reset(conn->arena);
+#ifdef HAVE_IO_URING
+    free(conn->spill);
+    conn->spill = NULL;
+    conn->spill_cap = 0;
+#endif
+    if (worker->free_conn_count >= ARENA_POOL_MAX) {
+        arena_pool_put(&worker->arena_pool, conn->arena);
+        free(conn->rbuf);
+        free(conn);
+        return;
+    }
+    
+    // Don't let one oversized request pin a large buffer forever
+    if (conn->rcap > BUFFER_SIZE) {
+        char* shrunk = realloc(conn->rbuf, BUFFER_SIZE);
+        if (shrunk) {
+            conn->rbuf = shrunk;
+            conn->rcap = BUFFER_SIZE;
+        }
+    }
+    conn->next_free = worker->free_conns;
+    worker->free_conns = conn;
+    worker->free_conn_count++;
+}
+
+#ifdef HAVE_IO_URING
+// Stop whatever the ring still does for the connection and close the
+// socket behind it. A close linked to the last send is already queued;
+// conn_ring_closed() redoes it if the send fails.
+static void conn_ring_close(Connection* conn) {
+    Ring* ring = worker_ring;
+    if (conn->ring_recvs > 0) ring_cancel(ring, ring_data(conn, RING_OP_RECV));
+    if (conn->ring_send) ring_cancel(ring, ring_data(conn, RING_OP_SEND));
+    if (conn->ring_poll) ring_cancel(ring, ring_data(conn, RING_OP_POLL));
+    conn->ring_recv = false;
+    if (!conn->ring_close) {
+        ring_close(ring, conn->fd, ring_data(conn, RING_OP_CLOSE));
+        conn->ring_ops++;
+    }
+}
+#endif
+
+void conn_destroy(Worker* worker, Connection* conn) {
+    PROBE2(conn__close, conn->fd, conn->requests_served);
+    if (conn->flushing) {
+        trace_commit(conn->flushing, 0); // Never fully written
+        conn->flushing = NULL;
+    }
+    if (conn->file) {
+        cached_file_release(conn->file);
+        conn->file = NULL;
+    }
+    timer_cancel(&conn->timer);
+    if (conn->tls) {
+        tls_session_free(conn->tls);
+        conn->tls = NULL;
+    }
+#ifdef HAVE_IO_URING
+    if (worker_ring) {
+        conn_ring_close(conn);
+    } else {
+        loop_del(&worker->loop, conn->fd);
+        close(conn->fd);
+    }
+#else
+    loop_del(&worker->loop, conn->fd);
+    close(conn->fd);
+#endif
+    atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+    if (conn->async) {
+        // Another thread still owns the request; conn_complete() frees it
+        conn->orphaned = true;
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (conn->ring_ops > 0) {
+        conn->orphaned = true; // The kernel still holds it; freed by its last CQE
+        return;
+    }
+#endif
+    conn_release(worker, conn);
+}
+
+// Socket I/O goes through these so TLS connections need no special
+// cases elsewhere: they keep the recv()/sendmsg() return conventions.
+static ssize_t conn_recv(Connection* conn, char* buf, size_t len) {
+    if (conn->tls) return tls_read(conn->tls, buf, len);
+    return recv(conn->fd, buf, len, 0);
+}
+
+// Send the queued iovecs from iov_head on. Under user-space TLS small
+// iovecs are gathered into one record; the gather is rebuilt identically
+// after EAGAIN, as SSL_write() retries require.
+static ssize_t conn_sendv(Connection* conn) {
+    struct iovec* iov = &conn->iov[conn->iov_head];
+    int count = conn->iov_count - conn->iov_head;
+    if (!conn->tls || conn->ktls) {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    }
+
+    if (iov[0].iov_len >= TLS_RECORD_SIZE) {
+        return tls_write(conn->tls, iov[0].iov_base, iov[0].iov_len); // No copy needed
+    }
+    char record[TLS_RECORD_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < count && len < sizeof(record); i++) {
+        size_t n = iov[i].iov_len < sizeof(record) - len ? iov[i].iov_len : sizeof(record) - len;
+        memcpy(record + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return tls_write(conn->tls, record, len);
+}
+
+// Send a small interim response (100 Continue) in order with the rest:
+// written at once when nothing is queued ahead of it, otherwise (or for
+// what a short write left) queued behind the pending iovecs. data must
+// stay valid until it is flushed. Returns false if part of a TLS record
+// was left behind, which the stream can't recover from.
+static bool conn_send_interim(Connection* conn, const char* data, size_t len) {
+    size_t sent = 0;
+    if (conn->out_pending == 0) {
+        if (conn->tls && !conn->ktls) return tls_write(conn->tls, data, len) == (ssize_t)len;
+        ssize_t n = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (n == (ssize_t)len) return true;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        if (n > 0) sent = n;
+    }
+    // conn_process_buffered() only parses while conn_can_queue(), so there is room
+    conn->iov[conn->iov_count].iov_base = (char*)data + sent;
+    conn->iov[conn->iov_count].iov_len = len - sent;
+    conn->iov_count++;
+    conn->out_pending += len - sent;
+    return true;
+}
+
+// Room for another response in the iovec queue?
+static bool conn_can_queue(const Connection* conn) {
+    return !conn->producer && !conn->file && !conn->async &&
+           conn->iov_count + IOVS_PER_RESPONSE <= MAX_IOV &&
+           conn->out_pending < MAX_PIPELINE_OUTPUT;
+}
+
+// Queue the response; the bytes are sent later by conn_on_writable()
+void send_response(Connection* conn, HttpResponse* res, bool http11) {
+    if (res->cache_entry) {
+        CacheRef* ref = arena_alloc(conn->arena, sizeof(CacheRef));
+        if (!ref) {
+            cache_entry_release(res->cache_entry);
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        ref->entry = res->cache_entry;
+        ref->next = conn->cache_refs;
+        conn->cache_refs = ref;
+    }
+    if (res->producer) {
+        conn->chunk_buf = arena_alloc(conn->arena, CHUNK_HEADER_MAX + STREAM_CHUNK_SIZE + 2);
+        if (!conn->chunk_buf) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        conn->producer = res->producer;
+        conn->producer_ctx = res->producer_ctx;
+        conn->chunked = http11;
+        if (!http11) conn->keep_alive = false; // Body ends at close
+    }
+
+    // Requests read before the drain began (uploads, deferred ones) end
+    // here too, not by a close racing the client's next request
+    if (atomic_load_explicit(&draining, memory_order_relaxed)) conn->keep_alive = false;
+    struct iovec* iov = &conn->iov[conn->iov_count];
+    int n = serialize_response(res, conn->keep_alive, conn->chunked && res->producer, iov);
+    if (n < 0) {
+        if (res->file) cached_file_release(res->file);
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    if (res->file) {
+        conn->file = res->file;
+        conn->file_offset = res->file_offset;
+        conn->file_remaining = res->body_length;
+    }
+    for (int i = 0; i < n; i++) {
+        conn->out_pending += iov[i].iov_len;
+    }
+    conn->iov_count += n;
+}
+
+// Queue a finished response and record it in the metrics and access log
+static void conn_finish(Connection* conn, HttpAsync* async) {
+    HttpRequest* req = &async->req;
+    HttpResponse* res = &async->res;
+    size_t queued = conn->out_pending;
+    uint64_t send_start = monotonic_ns();
+    send_response(conn, res, req->http11);
+    uint64_t end = monotonic_ns();
+    
+    int status = res->prebuilt ? res->prebuilt->status_code : res->status_code;
+    if (worker_metrics) hist_record(&worker_metrics->stages[STAGE_SEND], end - send_start);
+    if (worker_metrics && server.overloaded && res->prebuilt == server.overloaded) {
+        counter_add(&worker_metrics->shed, 1);
+    }
+    metrics_request(req, status, end - async->start_ns);
+    // Streamed bodies are counted as their headers only
+    uint64_t bytes = conn->out_pending - queued + (res->file ? res->body_length : 0);
+    if (req->log_access) access_log_record(req, status, bytes, (end - async->start_ns) / 1000);
+    PROBE4(request__done, req->id, status, bytes, end - async->start_ns);
+    if (req->trace) {
+        Trace* t = req->trace;
+        trace_span(t, SPAN_SEND, 0, send_start, end - send_start);
+        t->status = status;
+        t->route = req->route ? req->route->id : -1;
+        t->queued_ns = end;
+        // Only one is followed to the last byte; an earlier one that is
+        // still queued ends here
+        if (conn->flushing) trace_commit(conn->flushing, 0);
+        conn->flushing = t;
+    }
+    if (async->restore_at) *async->restore_at = async->saved;
+}
+
+// Build the request the parser has read so far (head, and the body unless
+// it is streamed) into a fresh HttpAsync. In the arena rather than on the
+// stack so a deferred or streamed request outlives the call.
+static HttpAsync* conn_new_request(Connection* conn, char* raw) {
+    HttpAsync* async = arena_alloc(conn->arena, sizeof(HttpAsync));
+    if (!async) {
+        conn->state = CONN_CLOSING;
+        return NULL;
+    }
+    memset(&async->req, 0, sizeof(async->req));
+    async->req.client_ip = conn->client_ip;
+    init_response(&async->res, conn->arena);
+    async->res.async = async;
+    async->deferred = false;
+    async->cache_retry = false;
+    async->queue = conn->completions;
+    async->conn = conn;
+    async->restore_at = NULL;
+    async->start_ns = monotonic_ns();
+    if (!parser_build_request(&conn->parser, raw, &async->req, conn->arena)) {
+        conn->state = CONN_CLOSING;
+        return NULL;
+    }
+    HttpRequest* req = &async->req;
+    req->id = request_id_new();
+    PROBE4(request__start, req->id, conn->fd, req->method, req->path);
+
+    // Pipelined requests have no read of their own: they start at the wakeup
+    uint64_t first_byte = conn->first_byte_ns ? conn->first_byte_ns : loop_wake_ns;
+    req->trace = trace_sample(conn->arena, first_byte);
+    if (req->trace) {
+        trace_attach(req->trace, req);
+        if (first_byte < loop_wake_ns) {
+            trace_span(req->trace, SPAN_RECV, 0, first_byte, loop_wake_ns - first_byte);
+        }
+        trace_span(req->trace, SPAN_PARSE, 0, async->start_ns - conn->parse_ns, conn->parse_ns);
+    }
+    conn->first_byte_ns = 0;
+    conn->parse_ns = 0;
+
+    conn->requests_served++;
+    if (!async->req.keep_alive || conn->requests_served >= config.max_requests ||
+        atomic_load_explicit(&draining, memory_order_relaxed)) {
+        conn->keep_alive = false;
+    }
+    return async;
+}
+
+void conn_dispatch(Connection* conn, char* raw, size_t len) {
+    // Building the request NUL-terminates the body over the first byte of
+    // the next pipelined request; put it back once the handler is done
+    char saved = raw[len];
+    HttpAsync* async = conn_new_request(conn, raw);
+    if (!async) {
+        raw[len] = saved;
+        return;
+    }
+    async->restore_at = raw + len;
+    async->saved = saved;
+
+    // Waited behind the rest of the batch too long: the cheap answer now
+    // beats a late one and keeps the backlog from growing
+    if (async->req.trace && async->start_ns > loop_wake_ns) {
+        trace_span(async->req.trace, SPAN_QUEUE, 0, loop_wake_ns, async->start_ns - loop_wake_ns);
+    }
+    if (queue_delay_exceeded(loop_wake_ns)) {
+        PROBE1(request__shed, async->req.id);
+        shed_request(&async->res);
+        conn_finish(conn, async);
+        return;
+    }
+    if (!handle_request(&async->req, &async->res)) {
+        conn->async = async; // Sent by conn_complete()
+        return;
+    }
+    conn_finish(conn, async);
+}
+
+void conn_reject(Connection* conn, int status) {
+    HttpResponse res;
+    init_response(&res, conn->arena);
+    set_json_response(&res, status, status == 400 ? "{\"error\": \"Bad request\"}"
+                                  : status == 408 ? "{\"error\": \"Request timeout\"}"
+                                  : status == 501 ? "{\"error\": \"Unsupported transfer coding\"}"
+                                                  : "{\"error\": \"Request too large\"}");
+    conn->keep_alive = false;
+    send_response(conn, &res, true);
+}
+
+// Drop the first pos bytes of the receive buffer. Parser offsets are
+// relative to the request start, so they survive moving a partial request
+// to the front of the buffer.
+static void conn_consume(Connection* conn, size_t pos) {
+    if (pos > 0) {
+        memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+        conn->rlen -= pos;
+        conn->rbuf[conn->rlen] = '\0';
+    }
+}
+
+// ============= Request Bodies =============
+
+// Bodies are buffered by default: the parser leaves them (de-chunked) in
+// rbuf after the head, up to config.max_body, and the handler sees one
+// contiguous req->body. Routes registered with register_upload_route()
+// stream instead: the request is built and the middleware run as soon as
+// the head is in, then each read's worth of body goes to the route's
+// BodyReader and is dropped from rbuf, so uploads of any size run in a
+// fixed buffer. The handler runs once the body is complete.
+
+// How far rbuf may grow: the head limit, plus the body limit while a
+// buffered body is read. A streamed upload never grows it, since the
+// request views point into it.
+static size_t conn_buffer_limit(const Connection* conn) {
+    if (conn->upload) return conn->rcap;
+    if (conn->parser.state > P_HEAD_LF && conn->parser.state < P_DONE) {
+        return conn->parser.head_len + config.max_body + BUFFER_SIZE;
+    }
+    return MAX_REQUEST_SIZE;
+}
+
+// End a streamed upload early with the middleware's or a rejection reply.
+// The rest of the body is never read, so the connection closes after it.
+static void conn_end_upload(Connection* conn, HttpAsync* async) {
+    conn->upload = NULL;
+    conn->keep_alive = false;
+    finish_request(&async->req, &async->res);
+    conn_finish(conn, async);
+}
+
+static bool conn_start_upload(Connection* conn) {
+    HttpParser* p = &conn->parser;
+    if (conn->rcap < p->head_len + BUFFER_SIZE) {
+        // Room for reads behind the head, made now while moving is safe
+        char* grown = realloc(conn->rbuf, p->head_len + BUFFER_SIZE);
+        if (!grown) {
+            conn->state = CONN_CLOSING;
+            return false;
+        }
+        conn->rbuf = grown;
+        conn->rcap = p->head_len + BUFFER_SIZE;
+    }
+
+    HttpAsync* async = conn_new_request(conn, conn->rbuf);
+    if (!async) return false;
+    if (!begin_request(&async->req, &async->res)) {
+        conn_end_upload(conn, async);
+        return false;
+    }
+    conn->upload = async;
+    p->body_limit = SIZE_MAX;
+    return true;
+}
+
+// The head of a request with a body is in: stream it to the route's
+// BodyReader or keep buffering. Returns false to stop processing rbuf.
+static bool conn_on_head(Connection* conn, size_t pos) {
+    HttpParser* p = &conn->parser;
+    const char* buf = conn->rbuf + pos;
+    bool http11 = buf[p->version.off + 7] == '1';
+    char method[17];
+    memcpy(method, buf + p->method.off, p->method.len);
+    method[p->method.len] = '\0';
+
+    RouteMatch match;
+    if (route_lookup(parse_method(method), buf + p->path.off, p->path.len, &match) &&
+        match.route->body_reader) {
+        if (pos > 0 || conn->out_pending > 0) {
+            // Earlier responses still use the arena: come back after the
+            // flush, with this request at the front of rbuf
+            p->head_reported = false;
+            return false;
+        }
+        if (!conn_start_upload(conn)) return false; // May move rbuf
+    } else if (!p->chunked && p->content_length > p->body_limit) {
+        return true; // parse_body() rejects it
+    }
+
+    if (p->expect_continue && http11) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!conn_send_interim(conn, cont, sizeof(cont) - 1)) {
+            conn->state = CONN_CLOSING;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Hand the body bytes decoded so far to the BodyReader, then drop them
+static bool conn_feed_upload(Connection* conn) {
+    HttpParser* p = &conn->parser;
+    HttpAsync* async = conn->upload;
+    size_t n = p->body_end - p->head_len;
+    if (n > 0) {
+        uint64_t start = monotonic_ns();
+        bool accepted = async->req.route->body_reader(&async->req, &async->res,
+                                                      conn->rbuf + p->head_len, n);
+        uint64_t ns = monotonic_ns() - start;
+        if (worker_metrics) hist_record(&worker_metrics->stages[STAGE_HANDLER], ns);
+        if (async->req.trace) trace_span(async->req.trace, SPAN_BODY, 0, start, ns);
+        if (!accepted) {
+            if (async->res.status_code == 200) {
+                set_json_response(&async->res, 413, "{\"error\": \"Upload rejected\"}");
+            }
+            conn_end_upload(conn, async);
+            return false;
+        }
+        async->req.body_length += n;
+    }
+    conn->rlen -= parser_compact(p, conn->rbuf, conn->rlen, false);
+    return true;
+}
+
+// The whole body has gone through the BodyReader: run the handler
+static void conn_finish_upload(Connection* conn) {
+    HttpAsync* async = conn->upload;
+    conn->upload = NULL;
+    if (!run_handler(&async->req, &async->res)) {
+        conn->async = async; // Sent by conn_complete()
+        return;
+    }
+    conn_finish(conn, async);
+}
+
+// Dispatch every complete request already buffered, without another read
+void conn_process_buffered(Connection* conn) {
+    size_t pos = 0;
+    while (conn->state == CONN_READING && (conn->keep_alive || conn->upload) &&
+           conn_can_queue(conn) && pos < conn->rlen) {
+        HttpParser* p = &conn->parser;
+        uint64_t start = monotonic_ns();
+        ParseResult result = parse_request(p, conn->rbuf + pos, conn->rlen - pos);
+        uint64_t ns = monotonic_ns() - start;
+        if (worker_metrics) hist_record(&worker_metrics->stages[STAGE_PARSE], ns);
+        conn->parse_ns += ns;
+        PROBE3(parse, conn->fd, result, ns);
+        if (result == PARSE_HEAD) {
+            if (!conn_on_head(conn, pos)) break;
+            continue;
+        }
+        if (result == PARSE_ERROR) {
+            if (worker_metrics) counter_add(&worker_metrics->parse_errors, 1);
+            if (conn->upload) {
+                // The middleware has run; answer through the request
+                set_json_response(&conn->upload->res, p->error_status,
+                                  "{\"error\": \"Bad request body\"}");
+                conn_end_upload(conn, conn->upload);
+            } else {
+                conn_reject(conn, p->error_status);
+            }
+            pos = conn->rlen;
+            break;
+        }
+        if (conn->upload && !conn_feed_upload(conn)) break;
+        if (result == PARSE_AGAIN) {
+            // Squeeze the chunk framing out of a buffered body
+            if (p->chunked && !conn->upload) {
+                conn->rlen -= parser_compact(p, conn->rbuf + pos, conn->rlen - pos, true);
+            }
+            break;
+        }
+
+        size_t len = p->message_len;
+        if (conn->upload) conn_finish_upload(conn);
+        else conn_dispatch(conn, conn->rbuf + pos, len);
+        parser_reset(&conn->parser);
+        pos += len;
+        if (conn->async) {
+            // The deferred request points into rbuf: leave it in place
+            conn->async_end = pos;
+            if (conn->state == CONN_READING) {
+                conn->state = conn->out_pending > 0 ? CONN_WRITING : CONN_WAITING;
+            }
+            return;
+        }
+    }
+
+    conn_consume(conn, pos);
+    if (conn->state == CONN_READING && conn->out_pending > 0) {
+        conn->state = CONN_WRITING;
+    }
+}
+
+// Make room in rbuf for at least one more byte, growing it up to the
+// buffer limit; past that the request is answered with 413/431. False
+// when nothing more can be read.
+static bool conn_reserve(Connection* conn) {
+    if (conn->rlen + 1 < conn->rcap) return true;
+    if (conn->rcap >= conn_buffer_limit(conn)) {
+        if (worker_metrics) counter_add(&worker_metrics->parse_errors, 1);
+        conn_reject(conn, conn->parser.state > P_HEAD_LF ? 413 : 431);
+        conn->rlen = 0;
+        conn->state = CONN_WRITING;
+        return false;
+    }
+    char* grown = realloc(conn->rbuf, conn->rcap * 2);
+    if (!grown) {
+        conn->state = CONN_CLOSING;
+        return false;
+    }
+    conn->rbuf = grown;
+    conn->rcap *= 2;
+    return true;
+}
+
+// n bytes just landed in rbuf at rlen: serve what they complete
+static void conn_received(Connection* conn, size_t n) {
+    PROBE2(conn__recv, conn->fd, n);
+    if (!conn->first_byte_ns) conn->first_byte_ns = loop_wake_ns; // Free, and close enough
+    conn->rlen += n;
+    conn->rbuf[conn->rlen] = '\0';
+    conn_process_buffered(conn);
+}
+
+void conn_on_readable(Connection* conn) {
+    while (conn->state == CONN_READING) {
+        if (!conn_reserve(conn)) return;
+        ssize_t n = conn_recv(conn, conn->rbuf + conn->rlen, conn->rcap - conn->rlen - 1);
+        if (n > 0) {
+            conn_received(conn, n);
+        } else if (n == 0) {
+            conn->state = CONN_CLOSING; // Peer closed
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return; // Wait for more data
+        } else if (errno != EINTR) {
+            conn->state = CONN_CLOSING;
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Feed bytes the ring received into rbuf for as long as the connection
+// reads; returns how many it took
+static size_t conn_take_input(Connection* conn, const char* data, size_t len) {
+    size_t taken = 0;
+    while (taken < len && conn->state == CONN_READING && conn_reserve(conn)) {
+        size_t n = conn->rcap - conn->rlen - 1;
+        if (n > len - taken) n = len - taken;
+        memcpy(conn->rbuf + conn->rlen, data + taken, n);
+        taken += n;
+        conn_received(conn, n);
+    }
+    return taken;
+}
+
+// Keep what the connection can't take yet (it is writing, or rbuf is held
+// by a deferred request) until conn_settle() hands it over
+static bool conn_spill(Connection* conn, const char* data, size_t len) {
+    if (conn->spill_len + len > conn->spill_cap) {
+        size_t cap = conn->spill_cap ? conn->spill_cap : RING_RECV_BUF_SIZE;
+        while (cap < conn->spill_len + len) cap *= 2;
+        char* grown = realloc(conn->spill, cap);
+        if (!grown) return false;
+        conn->spill = grown;
+        conn->spill_cap = cap;
+    }
+    memcpy(conn->spill + conn->spill_len, data, len);
+    conn->spill_len += len;
+    return true;
+}
+
+static void conn_ring_input(Connection* conn, const char* data, size_t len) {
+    size_t taken = conn->spill_len == 0 ? conn_take_input(conn, data, len) : 0;
+    if (taken < len && conn->state != CONN_CLOSING && !conn_spill(conn, data + taken, len - taken)) {
+        conn->state = CONN_CLOSING;
+    }
+}
+
+static void conn_ring_unspill(Connection* conn) {
+    size_t taken = conn_take_input(conn, conn->spill, conn->spill_len);
+    memmove(conn->spill, conn->spill + taken, conn->spill_len - taken);
+    conn->spill_len -= taken;
+}
+#endif
+
+// Pull the next chunk from the producer once the previous one is sent.
+// Only one chunk is buffered per connection, so a slow reader throttles
+// the producer instead of growing memory.
+static bool conn_stream_next(Connection* conn) {
+    static const char last_chunk[] = "0\r\n\r\n";
+    char* data = conn->chunk_buf + CHUNK_HEADER_MAX;
+    ssize_t n = conn->producer(conn->producer_ctx, data, STREAM_CHUNK_SIZE);
+    if (n < 0 || n > STREAM_CHUNK_SIZE) return false;
+
+    conn->iov_head = conn->iov_count = 0;
+    struct iovec* iov = &conn->iov[conn->iov_count++];
+    if (n == 0) {
+        conn->producer = NULL;
+        if (!conn->chunked) return true; // Connection close ends the body
+        iov->iov_base = (void*)last_chunk;
+        iov->iov_len = sizeof(last_chunk) - 1;
+    } else if (conn->chunked) {
+        // Frame in place: "<hex>\r\n" right before the data, CRLF after
+        char hex[8];
+        int hex_len = snprintf(hex, sizeof(hex), "%zx", (size_t)n);
+        char* start = data - hex_len - 2;
+        memcpy(start, hex, hex_len);
+        memcpy(data - 2, "\r\n", 2);
+        memcpy(data + n, "\r\n", 2);
+        iov->iov_base = start;
+        iov->iov_len = hex_len + 2 + n + 2;
+    } else {
+        iov->iov_base = data;
+        iov->iov_len = n;
+    }
+    conn->out_pending = iov->iov_len;
+    return true;
+}
+
+// File body over TLS: SSL_sendfile() when the kernel encrypts, else
+// read into a record-sized buffer and encrypt in user space. A retry
+// after EAGAIN re-reads the same bytes from the same offset.
+static ssize_t conn_send_file_tls(Connection* conn) {
+    ssize_t n;
+    if (conn->ktls) {
+        n = tls_sendfile(conn->tls, conn->file->fd, conn->file_offset, conn->file_remaining);
+    } else {
+        char buf[TLS_RECORD_SIZE];
+        size_t want = conn->file_remaining < sizeof(buf) ? conn->file_remaining : sizeof(buf);
+        n = pread(conn->file->fd, buf, want, conn->file_offset);
+        if (n > 0) n = tls_write(conn->tls, buf, n);
+    }
+    if (n > 0) conn->file_offset += n;
+    return n;
+}
+
+// Send the file body straight from the page cache. Returns false on a
+// hard error; stops early (with bytes remaining) when the socket is full.
+static bool conn_send_file(Connection* conn) {
+    while (conn->file_remaining > 0) {
+        if (conn->tls) {
+            ssize_t n = conn_send_file_tls(conn);
+            if (n > 0) {
+                PROBE2(conn__send, conn->fd, n);
+                conn->file_remaining -= n;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) return true;
+            return false;
+        }
+#if defined(__linux__)
+        ssize_t n = sendfile(conn->fd, conn->file->fd, &conn->file_offset, conn->file_remaining);
+#elif defined(__FreeBSD__)
+        off_t sent = 0;
+        int rc = sendfile(conn->file->fd, conn->fd, conn->file_offset, conn->file_remaining,
+                          NULL, &sent, 0);
+        ssize_t n = sent > 0 ? sent : rc;
+        if (sent > 0) conn->file_offset += sent;
+#else
+        // No usable sendfile(): bounce through the chunk-sized stack buffer
+        char buf[STREAM_CHUNK_SIZE];
+        size_t want = conn->file_remaining < sizeof(buf) ? conn->file_remaining : sizeof(buf);
+        ssize_t n = pread(conn->file->fd, buf, want, conn->file_offset);
+        if (n > 0) n = send(conn->fd, buf, n, MSG_NOSIGNAL);
+        if (n > 0) conn->file_offset += n;
+#endif
+        if (n > 0) {
+            PROBE2(conn__send, conn->fd, n);
+            conn->file_remaining -= n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false; // Error, or the file shrank underneath us
+        }
+    }
+    cached_file_release(conn->file);
+    conn->file = NULL;
+    return true;
+}
+
+// Drop n written bytes from the queue: skip fully written iovecs and
+// trim a partially written one
+static void conn_advance(Connection* conn, size_t n) {
+    conn->out_pending -= n;
+    while (n > 0) {
+        struct iovec* iov = &conn->iov[conn->iov_head];
+        if (n >= iov->iov_len) {
+            n -= iov->iov_len;
+            conn->iov_head++;
+        } else {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Queue the pending iovecs as one send, picked up again by conn_ring_sent().
+// A connection's last response takes the close along, linked so it only
+// runs once everything went out.
+static void conn_ring_send(Connection* conn) {
+    Ring* ring = worker_ring;
+    uint64_t data = ring_data(conn, RING_OP_SEND);
+    bool last = !conn->keep_alive && !conn->producer && !conn->file && !conn->async &&
+                !conn->upload;
+    ring_reserve(ring, last ? 2 : 1);
+    int slot = conn->out_pending <= RING_SLOT_SIZE ? ring_slot_get(ring) : -1;
+    struct io_uring_sqe* sqe;
+    if (slot >= 0) {
+        // Gathered into registered memory, which needs no pinning per send
+        char* out = ring_slot(ring, slot);
+        size_t len = 0;
+        for (int i = conn->iov_head; i < conn->iov_count; i++) {
+            memcpy(out + len, conn->iov[i].iov_base, conn->iov[i].iov_len);
+            len += conn->iov[i].iov_len;
+        }
+        sqe = ring_write_slot(ring, conn->fd, slot, len, data);
+    } else {
+        memset(&conn->ring_msg, 0, sizeof(conn->ring_msg));
+        conn->ring_msg.msg_iov = &conn->iov[conn->iov_head];
+        conn->ring_msg.msg_iovlen = conn->iov_count - conn->iov_head;
+        sqe = ring_sendmsg(ring, conn->fd, &conn->ring_msg, data);
+    }
+    conn->ring_send = true;
+    conn->ring_slot = slot;
+    conn->ring_send_len = conn->out_pending;
+    conn->ring_ops++;
+    if (last) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ring_close(ring, conn->fd, ring_data(conn, RING_OP_CLOSE));
+        conn->ring_close = true;
+        conn->ring_ops++;
+    }
+}
+#endif
+
+void conn_on_writable(Connection* conn) {
+#ifdef HAVE_IO_URING
+    if (conn->ring_send || conn->ring_poll) return; // Resumed by the completion
+#endif
+    while (conn->out_pending > 0 || conn->producer || conn->file) {
+        if (conn->out_pending == 0 && conn->file) {
+            if (!conn_send_file(conn)) {
+                conn->state = CONN_CLOSING;
+                return;
+            }
+            if (conn->file) return; // Socket full, wait for EV_WRITE
+            continue;
+        }
+        if (conn->out_pending == 0) {
+            if (!conn_stream_next(conn)) {
+                conn->state = CONN_CLOSING;
+                return;
+            }
+            if (conn->out_pending == 0) break;
+            continue;
+        }
+
+#ifdef HAVE_IO_URING
+        if (worker_ring) {
+            conn_ring_send(conn);
+            return;
+        }
+#endif
+        ssize_t n = conn_sendv(conn);
+        if (n > 0) {
+            PROBE2(conn__send, conn->fd, n);
+            conn_advance(conn, n);
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // Socket buffer full, wait for EV_WRITE
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+    }
+
+    conn->iov_head = conn->iov_count = 0;
+    conn->chunk_buf = NULL;
+    conn_release_cache_refs(conn);
+    if (conn->flushing) {
+        trace_commit(conn->flushing, monotonic_ns());
+        conn->flushing = NULL;
+    }
+    if (conn->async) {
+        conn->state = CONN_WAITING; // The deferred request still uses the arena
+        return;
+    }
+    if (!conn->upload) {
+        // All queued responses sent, nothing references the arena any more
+        arena_reset(conn->arena);
+        if (!conn->keep_alive) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+    } // Else only a 100 Continue went out; the upload still uses the arena
+    conn->state = CONN_READING;
+    conn_process_buffered(conn); // Requests left over from a deep pipeline
+}
+
+// Over --max-conns: send the prerendered 503 and hang up without
+// allocating a Connection. Best effort; TLS clients are just closed.
+static void refuse_connection(int fd) {
+    const PrebuiltResponse* r = server.overloaded;
+    if (r && !tls_enabled()) {
+        const WorkerClock* clock = clock_get();
+        struct iovec iov[4] = {
+            {r->data, r->head_len},
+            {(void*)clock->http_date, clock->http_date_len},
+            {(void*)close_tail, sizeof(close_tail) - 1},
+            {r->data + r->head_len, r->body_len},
+        };
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 4;
+        sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    close(fd);
+}
+
+#ifdef HAVE_IO_URING
+static void conn_ring_poll(Connection* conn) {
+    ring_poll(worker_ring, conn->fd, POLLOUT, false, ring_data(conn, RING_OP_POLL));
+    conn->ring_poll = true;
+    conn->ring_ops++;
+}
+
+// Line the connection's ring requests up with its state, as loop_mod()
+// does for epoll: a multishot recv while it can use input (RING_SPILL_MAX
+// bounds how far a pipelining client gets ahead of the responses), and
+// POLLOUT while a file body waits for socket space
+static void conn_ring_arm(Connection* conn) {
+    Ring* ring = worker_ring;
+    bool want_recv = (conn->keep_alive || conn->upload) && !conn->async &&
+                     conn->spill_len < RING_SPILL_MAX &&
+                     (conn->state == CONN_READING || conn->state == CONN_WRITING);
+    if (want_recv && !conn->ring_recv) {
+        ring_recv(ring, conn->fd, ring_data(conn, RING_OP_RECV));
+        conn->ring_recv = true;
+        conn->ring_recvs++;
+        conn->ring_ops++;
+    } else if (!want_recv && conn->ring_recv) {
+        ring_cancel(ring, ring_data(conn, RING_OP_RECV));
+        conn->ring_recv = false;
+    }
+    if (conn->state == CONN_WRITING && !conn->ring_send && !conn->ring_poll) conn_ring_poll(conn);
+}
+#endif
+
+// Start watching a new connection for its first request
+static int conn_watch(Worker* worker, Connection* conn) {
+#ifdef HAVE_IO_URING
+    if (worker_ring) {
+        conn_ring_arm(conn);
+        return 0;
+    }
+#endif
+    return loop_add(&worker->loop, conn->fd, EV_READ, conn);
+}
+
+// Turn an accepted (non-blocking) socket into a connection, or refuse it
+// over --max-conns
+static void conn_open(Worker* worker, int client_sock, uint32_t client_ip, uint64_t start) {
+    // Accept even when full so the kernel queue keeps draining
+    if (atomic_fetch_add_explicit(&open_connections, 1, memory_order_relaxed) >=
+        config.max_conns) {
+        atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+        counter_add(&worker_metrics->conns_rejected, 1);
+        refuse_connection(client_sock);
+        return;
+    }
+
+    Connection* conn = NULL;
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (!(conn = conn_create(worker, client_sock)) ||
+        (tls_enabled() && !(conn->tls = tls_session_new(client_sock))) ||
+        conn_watch(worker, conn) < 0) {
+        if (conn) {
+            if (conn->tls) tls_session_free(conn->tls);
+            conn_release(worker, conn);
+        }
+        close(client_sock);
+        atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+        return;
+    }
+    conn->client_ip = client_ip;
+    PROBE2(conn__accept, client_sock, conn->client_ip);
+    if (conn->tls) conn->state = CONN_HANDSHAKE; // The ClientHello is read first
+    conn_schedule(worker, conn);
+    metrics_stage(STAGE_ACCEPT, start);
+    counter_add(&worker_metrics->connections, 1);
+}
+
+void accept_connections(Worker* worker) {
+    while (1) {
+        uint64_t start = monotonic_ns();
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        // Close-on-exec, so a successor started by SIGHUP inherits no clients
+#ifdef SOCK_CLOEXEC
+        int client_sock = accept4(worker->listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                  SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+        int client_sock = accept(worker->listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (client_sock >= 0) {
+            fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+            if (set_nonblocking(client_sock) < 0) {
+                close(client_sock);
+                continue;
+            }
+        }
+#endif
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        // Responses are already gathered into one sendmsg(); Nagle would only
+        // hold back the tail (sendfile body, next chunk) for a delayed ACK
+        int one = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conn_open(worker, client_sock, ntohl(client_addr.sin_addr.s_addr), start);
+    }
+}
+
+// Event interest for each state; WAITING polls nothing (epoll still
+// reports hangups and errors)
+static int conn_events(const Connection* conn) {
+    switch (conn->state) {
+        case CONN_HANDSHAKE: return conn->tls_want_write ? EV_WRITE : EV_READ;
+        case CONN_READING: return EV_READ;
+        case CONN_WRITING: return EV_WRITE;
+        default: return 0;
+    }
+}
+
+// Flush what can be flushed, then close or re-arm the connection
+static void conn_settle(Worker* worker, Connection* conn, ConnState before) {
+    // Loop until the state settles: a flush can re-enter READING and
+    // dispatch more pipelined requests that need writing again
+    while (1) {
+        if (conn->state == CONN_WRITING) {
+            size_t pending = conn->out_pending;
+            conn_on_writable(conn);
+            if (conn->state == CONN_WRITING && conn->out_pending == pending) break;
+        } else if (conn->state == CONN_READING && conn->tls && tls_pending(conn->tls) > 0) {
+            // Bytes OpenSSL already decrypted won't make the socket readable
+            conn_on_readable(conn);
+#ifdef HAVE_IO_URING
+        } else if (conn->state == CONN_READING && conn->spill_len > 0) {
+            conn_ring_unspill(conn); // Received while it was busy
+#endif
+        } else {
+            break;
+        }
+    }
+
+    if (conn->state == CONN_CLOSING) {
+        conn_destroy(worker, conn);
+        return;
+    }
+    conn_schedule(worker, conn);
+#ifdef HAVE_IO_URING
+    if (worker_ring) {
+        conn_ring_arm(conn);
+        return;
+    }
+#endif
+    if (conn->state != before || conn->state == CONN_HANDSHAKE) {
+        loop_mod(&worker->loop, conn->fd, conn_events(conn), conn);
+    }
+}
+
+// Drive the TLS handshake; once done, serve whatever request came with it
+static void conn_handshake(Connection* conn) {
+    int rc = tls_handshake(conn->tls, &conn->tls_want_write);
+    if (rc < 0) {
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    if (rc == 0) return;
+
+    conn->ktls = tls_kernel_send(conn->tls);
+    if (worker_metrics) {
+        counter_add(&worker_metrics->tls_handshakes, 1);
+        if (tls_resumed(conn->tls)) counter_add(&worker_metrics->tls_resumed, 1);
+        if (conn->ktls) counter_add(&worker_metrics->tls_ktls, 1);
+    }
+    conn->state = CONN_READING;
+    conn_on_readable(conn);
+}
+
+void process_connection(Worker* worker, Connection* conn, int events) {
+    ConnState before = conn->state;
+
+    if (conn->state == CONN_WAITING) {
+        conn->state = CONN_CLOSING; // Nothing is polled, so a hangup or error
+    }
+    if (conn->state == CONN_HANDSHAKE) {
+        conn_handshake(conn);
+    } else if ((events & EV_READ) && conn->state == CONN_READING) {
+        conn_on_readable(conn);
+    }
+    conn_settle(worker, conn, before);
+}
+
+// Send a deferred response handed back through the completion queue
+static void conn_complete(Worker* worker, HttpAsync* async) {
+    Connection* conn = async->conn;
+    if (async->cache_retry && !conn->orphaned) {
+        // The cache fill it waited on stored nothing: run the handler after all
+        async->cache_retry = false;
+        async->deferred = false;
+        if (!run_handler(&async->req, &async->res)) return; // Deferred again
+    } else {
+        finish_request(&async->req, &async->res);
+    }
+    conn->async = NULL;
+    if (conn->orphaned) {
+        if (async->res.file) cached_file_release(async->res.file);
+        if (async->res.cache_entry) cache_entry_release(async->res.cache_entry);
+#ifdef HAVE_IO_URING
+        if (conn->ring_ops > 0) return; // Its last CQE frees it
+#endif
+        conn_release(worker, conn);
+        return;
+    }
+
+    ConnState before = conn->state;
+    conn_finish(conn, async);
+    conn_consume(conn, conn->async_end);
+    if (conn->state == CONN_WAITING) {
+        conn->state = CONN_READING;
+        conn_process_buffered(conn); // Also picks WRITING for the new response
+    }
+    conn_settle(worker, conn, before);
+}
+
+void run_completions(Worker* worker) {
+    HttpAsync* async = completion_queue_take(&worker->completions);
+    while (async) {
+        HttpAsync* next = async->next;
+        conn_complete(worker, async);
+        async = next;
+    }
+}
+
+// Timer wheel callback: a connection missed its deadline. A request head
+// that is late gets a 408 on the way out; everything else is just closed.
+static void conn_on_timeout(Timer* timer, void* ctx) {
+    Worker* worker = ctx;
+    Connection* conn = (Connection*)((char*)timer - offsetof(Connection, timer));
+    PROBE2(conn__timeout, conn->fd, conn->timeout);
+    if (conn->timeout == TIMEOUT_HEADER && conn->state == CONN_READING && conn->out_pending == 0) {
+        conn_reject(conn, 408);
+        conn->rlen = 0;
+        conn->state = CONN_WRITING;
+        conn_settle(worker, conn, CONN_READING); // Now on the write deadline
+        return;
+    }
+    conn_destroy(worker, conn);
+}
+
+#ifdef HAVE_IO_URING
+// Multishot recv completion: bytes in a provided buffer (copied out and
+// handed straight back), the end of the stream, or the request ending
+// because it was cancelled or the buffers ran out
+static void conn_ring_received(Worker* worker, Connection* conn, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && --conn->ring_recvs == 0) conn->ring_recv = false;
+    ConnState before = conn->state;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->orphaned) {
+            conn_ring_input(conn, worker_ring->recv_bufs + (size_t)bid * RING_RECV_BUF_SIZE, cqe->res);
+        }
+        ring_recv_give(worker_ring, bid);
+    }
+    if (conn->orphaned) return;
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        conn->state = CONN_CLOSING; // Peer closed, or an error
+    }
+    conn_settle(worker, conn, before); // Also re-arms a recv that ended
+}
+
+static void conn_ring_sent(Worker* worker, Connection* conn, int res) {
+    conn->ring_send = false;
+    if (conn->ring_slot >= 0) {
+        ring_slot_put(worker_ring, conn->ring_slot);
+        conn->ring_slot = -1;
+    }
+    if (conn->orphaned) return;
+    // Short or failed: the linked close was cancelled along with the rest
+    if (res != (int)conn->ring_send_len) conn->ring_close = false;
+
+    ConnState before = conn->state;
+    if (res > 0) {
+        PROBE2(conn__send, conn->fd, res);
+        conn_advance(conn, res);
+    } else if (res == -EAGAIN) {
+        conn_ring_poll(conn); // Socket buffer full
+    } else if (res != -EINTR) {
+        conn->state = CONN_CLOSING;
+    }
+    conn_settle(worker, conn, before);
+}
+
+static void conn_ring_writable(Worker* worker, Connection* conn, int res) {
+    conn->ring_poll = false;
+    if (conn->orphaned || res == -ECANCELED) return;
+    conn_settle(worker, conn, conn->state);
+}
+
+// Once a close ran, ring_close keeps conn_destroy() from closing the fd
+// (maybe reused by then) again. A linked close gets cancelled when the
+// send before it falls short: conn_ring_sent() clears ring_close, and one
+// that conn_destroy() already counted on is redone here.
+static void conn_ring_closed(Connection* conn, int res) {
+    if (res != -ECANCELED || !conn->ring_close) return;
+    if (conn->orphaned) {
+        ring_close(worker_ring, conn->fd, ring_data(conn, RING_OP_CLOSE));
+        conn->ring_ops++;
+    } else {
+        conn->ring_close = false;
+    }
+}
+
+// Multishot accept: the CQE carries the socket but no address
+static void worker_ring_accepted(Worker* worker, const struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        struct sockaddr_in addr = {0};
+        socklen_t len = sizeof(addr);
+        getpeername(cqe->res, (struct sockaddr*)&addr, &len);
+        conn_open(worker, cqe->res, ntohl(addr.sin_addr.s_addr), monotonic_ns());
+    } else if (cqe->res != -ECANCELED) {
+        fprintf(stderr, "Accept failed: %s\n", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED && worker->listen_fd >= 0) {
+        ring_accept(worker_ring, worker->listen_fd, ring_data(worker, RING_OP_ACCEPT));
+    }
+}
+
+// The event loop body for --io-uring: dispatch what ring_wait() reaped.
+// A connection whose last CQE is in after conn_destroy() is freed here.
+static void worker_ring_complete(Worker* worker) {
+    struct io_uring_cqe cqe;
+    while (ring_next(worker_ring, &cqe)) {
+        RingOp op = cqe.user_data & RING_OP_MASK;
+        bool last = !(cqe.flags & IORING_CQE_F_MORE);
+        if (op == RING_OP_ACCEPT) {
+            worker_ring_accepted(worker, &cqe);
+            continue;
+        }
+        if (op == RING_OP_WAKE) {
+            run_completions(worker);
+            if (last) {
+                ring_poll(worker_ring, worker->completions.wake_read, POLLIN, true,
+                          ring_data(worker, RING_OP_WAKE));
+            }
+            continue;
+        }
+        if (op == RING_OP_CANCEL) continue; // Found nothing left to cancel
+
+        Connection* conn = (Connection*)(uintptr_t)(cqe.user_data & ~(uint64_t)RING_OP_MASK);
+        if (op == RING_OP_RECV) conn_ring_received(worker, conn, &cqe);
+        else if (op == RING_OP_SEND) conn_ring_sent(worker, conn, cqe.res);
+        else if (op == RING_OP_POLL) conn_ring_writable(worker, conn, cqe.res);
+        else conn_ring_closed(conn, cqe.res);
+        if (last && --conn->ring_ops == 0 && conn->orphaned && !conn->async) {
+            conn_release(worker, conn);
+        }
+    }
+}
+#endif
+
+// ============= Workers =============
+
+Worker workers[MAX_WORKERS];
+
+int create_listener(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC); // Successors get it over the hand-off socket
+    
     // Set socket options
     int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#if defined(SO_REUSEPORT_LB)
+    // FreeBSD only load-balances accepts with the _LB variant
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT_LB, &opt, sizeof(opt)) < 0) {
+#else
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+#endif
+        perror("SO_REUSEPORT failed");
+        close(sock);
+        return -1;
+    }
     
     // Configure server address
+    struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     
     // Bind socket
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
-        close(server_sock);
-        exit(1);
+        close(sock);
+        return -1;
     }
     
     // Listen for connections
-    if (listen(server_sock, 10) < 0) {
+    if (listen(sock, config.backlog) < 0) {
         perror("Listen failed");
-        close(server_sock);
-        exit(1);
+        close(sock);
+        return -1;
+    }
+    
+    // The event loop never blocks on a single client
+    if (set_nonblocking(sock) < 0) {
+        perror("Failed to set non-blocking mode");
+        close(sock);
+        return -1;
     }
     
-    printf("Server listening on port %d...\n", PORT);
-    printf("Visit http://localhost:%d in your browser\n\n", PORT);
+    return sock;
+}
+
+void pin_worker_to_cpu(Worker* worker) {
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0) return;
     
-    // Main server loop
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->id % cpus, &set);
+    int err = pthread_setaffinity_np(worker->thread, sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Worker %d: CPU affinity failed: %s\n", worker->id, strerror(err));
+    }
+#else
+    (void)worker;
+    fprintf(stderr, "CPU affinity is not supported on this platform\n");
+#endif
+}
+
+// Stop accepting and put idle connections on the short DRAIN_IDLE_MS
+// deadline; everything else finishes what it started. The listener's
+// queue is taken in first, since closing a listener resets what it still
+// holds (after a hand-off the successor owns the socket and the queue
+// lives on).
+static void worker_begin_drain(Worker* worker) {
+    worker->draining = true;
+    worker->drain_deadline_ms = monotonic_ms() + (uint64_t)config.drain_timeout * 1000;
+    if (worker->listen_fd >= 0) {
+        accept_connections(worker);
+#ifdef HAVE_IO_URING
+        if (worker_ring) ring_cancel(worker_ring, ring_data(worker, RING_OP_ACCEPT));
+        else
+#endif
+        loop_del(&worker->loop, worker->listen_fd);
+        close(worker->listen_fd);
+        worker->listen_fd = -1;
+    }
+    for (Connection* conn = worker->live; conn; conn = conn->live_next) {
+        if (!conn->orphaned && conn->timeout == TIMEOUT_IDLE) conn_schedule(worker, conn);
+    }
+}
+
+void* run_event_loop(void* arg) {
+    Worker* worker = arg;
+    EventLoop* loop = &worker->loop;
+    access_ring = &access_rings[worker->id];
+    worker_metrics = metrics_slots[worker->id];
+    trace_worker_start(worker->id);
+#ifdef HAVE_IO_URING
+    if (worker->ring && !ring_enable(worker->ring)) {
+        perror("io_uring enable failed");
+        return NULL;
+    }
+    worker_ring = worker->ring;
+#endif
+
+    LoopEvent events[MAX_EVENTS];
     while (1) {
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock < 0) {
-            perror("Accept failed");
-            continue;
+        // Wake for the next connection deadline, and at least once a second
+        int timeout = timer_wheel_next_ms(&worker->timers, monotonic_ms(), 1000);
+#ifdef HAVE_IO_URING
+        int n = worker_ring ? ring_wait(worker_ring, timeout) : loop_wait(loop, events, MAX_EVENTS, timeout);
+#else
+        int n = loop_wait(loop, events, MAX_EVENTS, timeout);
+#endif
+        clock_update();
+        loop_wake_ns = monotonic_ns();
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Event wait failed");
+            break;
         }
-        
-        // Read request
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_read = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_read > 0) {
-            // Parse request
-            HttpRequest req = {0};
-            HttpResponse res;
-            init_response(&res);
-            
-            parse_request(buffer, &req);
-            
-            // Handle request
-            handle_request(&req, &res);
-            
-            // Send response
-            send_response(client_sock, &res);
+
+#ifdef HAVE_IO_URING
+        if (worker_ring) worker_ring_complete(worker); // ring_wait() left n at 0
+#endif
+        for (int i = 0; i < n; i++) {
+            if (events[i].data == &listener_tag) {
+                accept_connections(worker);
+            } else if (events[i].data == &worker->completions) {
+                run_completions(worker);
+            } else {
+                process_connection(worker, events[i].data, events[i].events);
+            }
+        }
+        timer_wheel_advance(&worker->timers, monotonic_ms(), conn_on_timeout, worker);
+
+        if (atomic_load_explicit(&draining, memory_order_relaxed)) {
+            if (!worker->draining) worker_begin_drain(worker);
+            if (worker->live_count == 0 || monotonic_ms() >= worker->drain_deadline_ms) break;
+        }
+    }
+
+    file_cache_clear();
+#ifdef HAVE_IO_URING
+    if (worker_ring) {
+        ring_free(worker_ring); // Cancels whatever is still pending
+        worker->ring = worker_ring = NULL;
+    }
+#endif
+    return NULL;
+}
+
+// listen_fd: a listener inherited from a predecessor, or -1 to bind one
+bool start_worker(Worker* worker, int id, int listen_fd) {
+    worker->id = id;
+    if (!metrics_slots[id] && !metrics_create(id)) {
+        perror("Worker metrics");
+        return false;
+    }
+    worker->listen_fd = listen_fd >= 0 ? listen_fd : create_listener(config.port);
+    if (worker->listen_fd < 0) return false;
+    timer_wheel_init(&worker->timers, monotonic_ms());
+    
+#ifdef HAVE_IO_URING
+    if (config.io_uring) {
+        // Accepted sockets inherit TCP_NODELAY (see accept_connections())
+        int one = 1;
+        setsockopt(worker->listen_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (completion_queue_init(&worker->completions) < 0 || !(worker->ring = ring_create())) {
+            perror("io_uring setup failed");
+            close(worker->listen_fd);
+            return false;
+        }
+        ring_accept(worker->ring, worker->listen_fd, ring_data(worker, RING_OP_ACCEPT));
+        ring_poll(worker->ring, worker->completions.wake_read, POLLIN, true,
+                  ring_data(worker, RING_OP_WAKE));
+    } else
+#endif
+    if (loop_init(&worker->loop) < 0 ||
+        loop_add(&worker->loop, worker->listen_fd, EV_READ, &listener_tag) < 0 ||
+        completion_queue_init(&worker->completions) < 0 ||
+        loop_add(&worker->loop, worker->completions.wake_read, EV_READ, &worker->completions) < 0) {
+        perror("Event loop setup failed");
+        close(worker->listen_fd);
+        return false;
+    }
+    
+    int err = pthread_create(&worker->thread, NULL, run_event_loop, worker);
+    if (err != 0) {
+        fprintf(stderr, "Worker %d: thread creation failed: %s\n", id, strerror(err));
+#ifdef HAVE_IO_URING
+        if (worker->ring) ring_free(worker->ring);
+        else
+#endif
+        close(worker->loop.fd);
+        close(worker->listen_fd);
+        return false;
+    }
+    
+    if (config.cpu_affinity) {
+        pin_worker_to_cpu(worker);
+    }
+    return true;
+}
+
+// ============= Drain and Hot Restart =============
+
+// SIGTERM or SIGINT drains the server: each worker takes in what its
+// listener has queued, closes it, gives idle keep-alive connections a
+// second to send one last request and answers everything still in flight
+// with Connection: close. The process exits once no connections are
+// left, or after --drain-timeout seconds.
+//
+// With --handoff PATH the server also listens on a Unix socket there. A
+// new process started with the same PATH (by hand, or by sending the old
+// one SIGHUP, which runs argv again) connects to it before binding:
+//
+//   new -> old   'L'                 asks for the listeners
+//   old -> new   count, SCM_RIGHTS   every worker's listening socket
+//   old -> new   HandoffRecords      fresh response cache entries, then an empty one
+//   new -> old   'D'                 its workers are accepting: old drains
+//
+// The listening sockets stay open throughout, so connections that arrive
+// during the switch wait in their accept queues instead of being refused.
+// If the new process fails before 'D', the old one just keeps serving.
+
+#define HANDOFF_TIMEOUT_S 10
+
+typedef struct {
+    uint32_t key_len;       // 0 ends the stream
+    uint32_t ttl;           // Seconds left
+    int32_t status;
+    uint32_t head_len;      // PrebuiltResponse layout: head, then body
+    uint32_t body_len;
+} HandoffRecord;
+
+static int workers_started;
+static int handoff_fd = -1;
+static _Atomic bool handed_off; // A successor took over; it owns config.handoff now
+
+// Start draining every worker; safe to call more than once
+void drain_start(void) {
+    if (atomic_exchange(&draining, true)) return;
+    uint64_t one = 1;
+    for (int i = 0; i < workers_started; i++) {
+        ssize_t n = write(workers[i].completions.wake_write, &one, sizeof(one));
+        (void)n; // Full pipe: a wakeup is already pending
+    }
+}
+
+static bool send_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool handoff_address(struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(config.handoff) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Hand-off path too long: %s\n", config.handoff);
+        return false;
+    }
+    strcpy(addr->sun_path, config.handoff);
+    return true;
+}
+
+// A stalled peer must not hang either process
+static void handoff_set_timeouts(int fd) {
+    struct timeval tv = {HANDOFF_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool handoff_send_entry(void* ctx, const CacheEntry* e, int ttl) {
+    int fd = *(int*)ctx;
+    HandoffRecord r = {(uint32_t)e->key_len, (uint32_t)ttl, e->wire.status_code,
+                       (uint32_t)e->wire.head_len, (uint32_t)e->wire.body_len};
+    return send_all(fd, &r, sizeof(r)) && send_all(fd, e->key, e->key_len) &&
+           send_all(fd, e->wire.data, e->wire.head_len + e->wire.body_len);
+}
+
+// Serve one successor; true once it has taken over
+static bool handoff_serve(int client) {
+#ifdef SO_PEERCRED
+    // Only our own user may take the listeners (the socket is 0600 too)
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != geteuid()) {
+        return false;
+    }
+#endif
+    handoff_set_timeouts(client);
+    char cmd;
+    if (!recv_all(client, &cmd, 1) || cmd != 'L') return false;
+    if (atomic_load(&draining)) return false; // Listeners are being closed
+
+    uint32_t count = workers_started;
+    int fds[MAX_WORKERS];
+    for (uint32_t i = 0; i < count; i++) fds[i] = workers[i].listen_fd;
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(count)) return false;
+
+    clock_update(); // Not an event loop thread: refresh the cached clock for the TTLs
+    HandoffRecord end = {0};
+    if (!cache_export(handoff_send_entry, &client) || !send_all(client, &end, sizeof(end))) {
+        return false;
+    }
+    return recv_all(client, &cmd, 1) && cmd == 'D';
+}
+
+static void* handoff_thread(void* arg) {
+    while (1) {
+        int client = accept(handoff_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            perror("Hand-off accept");
+            return arg;
+        }
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        bool done = handoff_serve(client);
+        close(client);
+        if (done) {
+            fprintf(stderr, "Handed off to a new process, draining\n");
+            atomic_store(&handed_off, true);
+            close(handoff_fd);
+            kill(getpid(), SIGTERM); // Drained by the main thread, see serve_signals()
+            return arg;
         }
+        fprintf(stderr, "Hand-off aborted, still serving\n");
+    }
+}
+
+// Listen on config.handoff for a successor, replacing any stale socket
+bool handoff_listen(void) {
+    struct sockaddr_un addr;
+    if (!handoff_address(&addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Hand-off socket");
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || chmod(addr.sun_path, 0600) < 0 ||
+        listen(fd, 4) < 0) {
+        perror("Hand-off socket");
+        close(fd);
+        return false;
+    }
+    handoff_fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_thread, NULL) != 0) {
+        perror("Hand-off thread");
+        close(fd);
+        handoff_fd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// Keep an inherited entry only while a cached route still serves its key
+// ("METHOD /path?query\ncoding"), and for no longer than that route's TTL
+static void handoff_import(const char* key, const HandoffRecord* r, char* data) {
+    const char* path = strchr(key, ' ');
+    char method[8];
+    RouteMatch match;
+    if (!path || path - key >= (ptrdiff_t)sizeof(method)) {
+        free(data);
+        return;
+    }
+    memcpy(method, key, path - key);
+    method[path - key] = '\0';
+    path++;
+    if (!route_lookup(parse_method(method), path, strcspn(path, "?\n"), &match) ||
+        match.route->cache_ttl <= 0) {
+        free(data);
+        return;
+    }
+    int ttl = (int)r->ttl < match.route->cache_ttl ? (int)r->ttl : match.route->cache_ttl;
+    cache_import(key, r->key_len, r->status, data, r->head_len, r->body_len, ttl);
+}
+
+static bool handoff_listener_port_ok(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0 || addr.sin_family != AF_INET) {
+        return false;
+    }
+    if (ntohs(addr.sin_port) == config.port) return true;
+    fprintf(stderr, "Running server listens on port %d, not %d\n", ntohs(addr.sin_port),
+            config.port);
+    return false;
+}
+
+// Take over from a server running on config.handoff: its listeners go to
+// fds and its cache into ours. Returns the number of listeners (0 when
+// no server answers, so bind as usual) or -1 on failure; on success
+// *conn stays open for handoff_complete(). Needs setup_routes() first.
+int handoff_receive(int* fds, int* conn) {
+    struct sockaddr_un addr;
+    if (!handoff_address(&addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return 0; // Nobody serving there
+    }
+    handoff_set_timeouts(fd);
+
+    uint32_t count = 0;
+    char control[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    char cmd = 'L';
+    int received = 0;
+    bool ok = send_all(fd, &cmd, 1) && recvmsg(fd, &msg, flags) == (ssize_t)sizeof(count) &&
+              !(msg.msg_flags & MSG_CTRUNC);
+    for (struct cmsghdr* c = ok ? CMSG_FIRSTHDR(&msg) : NULL; c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), received * sizeof(int));
+        }
+    }
+    ok = ok && received == (int)count && received > 0;
+    for (int i = 0; ok && i < received; i++) ok = handoff_listener_port_ok(fds[i]);
+
+    int imported = 0;
+    while (ok) {
+        HandoffRecord r;
+        char key[CACHE_MAX_KEY + 1];
+        ok = recv_all(fd, &r, sizeof(r)) && r.key_len <= CACHE_MAX_KEY;
+        if (!ok || r.key_len == 0) break;
+        char* data = malloc((size_t)r.head_len + r.body_len);
+        ok = data && recv_all(fd, key, r.key_len) &&
+             recv_all(fd, data, (size_t)r.head_len + r.body_len);
+        if (!ok) {
+            free(data);
+            break;
+        }
+        key[r.key_len] = '\0';
+        handoff_import(key, &r, data);
+        imported++;
+    }
+    if (!ok) {
+        fprintf(stderr, "Hand-off from the running server failed\n");
+        for (int i = 0; i < received; i++) close(fds[i]);
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "Took over %d listener%s and %d cache entr%s\n", received,
+            received == 1 ? "" : "s", imported, imported == 1 ? "y" : "ies");
+    *conn = fd;
+    return received;
+}
+
+// Our workers are accepting: let the predecessor drain
+void handoff_complete(int conn) {
+    char cmd = 'D';
+    send_all(conn, &cmd, 1);
+    close(conn);
+}
+
+// ============= Server Setup =============
+
+// Middleware that ROUTE_TABLE entries may list; the position is the
+// registry (and metrics) id
+#define MIDDLEWARE_TABLE(X) \
+    X(logger) \
+    X(rate_limit) \
+    X(auth) \
+    X(cors) \
+    X(cache)
+
+#define MIDDLEWARE_ID(name) MW_##name,
+enum { MIDDLEWARE_TABLE(MIDDLEWARE_ID) MW_TABLE_COUNT };
+
+// The built-in routes. Each entry is
+//   X(name, method, path, handler, kind, arg, middleware...)
+// where kind is PLAIN, CONSTANT, CACHED (arg: ttl), BLOCKING, UPLOAD
+// (arg: body reader) or STATIC (arg: directory, path ends in "*path"),
+// and the middleware run in the order listed (at least one, at most 6).
+// Order within a chain matters: rate_limit early so rejected requests
+// cost little, cache after auth so hits never skip an access check.
+#define ROUTE_TABLE(X) \
+    X(home,         GET,    "/",                   handle_home,         CONSTANT, 0,           logger, rate_limit, cors) \
+    X(hello,        GET,    "/api/hello",          handle_hello,        CACHED,   1,           logger, rate_limit, cors, cache) \
+    X(time,         GET,    "/api/time",           handle_time,         PLAIN,    0,           logger, rate_limit) \
+    X(users,        GET,    "/api/users",          handle_users_list,   CONSTANT, 0,           logger, rate_limit, cors) \
+    X(users_export, GET,    "/api/users/export",   handle_users_export, PLAIN,    0,           logger, rate_limit, cors) \
+    X(user_create,  POST,   "/api/users",          handle_user_create,  BLOCKING, 0,           logger, rate_limit, cors) \
+    X(user_get,     GET,    "/api/users/:id<int>", handle_user_get,     CACHED,   5,           logger, rate_limit, cors, cache) \
+    X(upload,       POST,   "/api/upload",         handle_upload,       UPLOAD,   read_upload, logger, rate_limit, cors) \
+    X(user_delete,  DELETE, "/api/users/:id<int>", handle_user_delete,  PLAIN,    0,           logger, rate_limit, cors) \
+    X(admin,        GET,    "/admin",              handle_admin,        CONSTANT, 0,           logger, rate_limit, auth, cors) \
+    X(metrics,      GET,    "/metrics",            handle_metrics,      PLAIN,    0,           logger, rate_limit) \
+    X(traces,       GET,    "/debug/traces",       handle_traces,       PLAIN,    0,           logger, rate_limit) \
+    X(static_files, GET,    "/static/*path",       handle_static,       STATIC,   "./public",  logger, rate_limit, cors)
+
+// Chains expand to direct calls joined by &&, one function per route
+#define CHAIN_STEP(name) middleware_step(MW_##name, name##_middleware, req, res)
+#define CHAIN_1(a) CHAIN_STEP(a)
+#define CHAIN_2(a, ...) CHAIN_STEP(a) && CHAIN_1(__VA_ARGS__)
+#define CHAIN_3(a, ...) CHAIN_STEP(a) && CHAIN_2(__VA_ARGS__)
+#define CHAIN_4(a, ...) CHAIN_STEP(a) && CHAIN_3(__VA_ARGS__)
+#define CHAIN_5(a, ...) CHAIN_STEP(a) && CHAIN_4(__VA_ARGS__)
+#define CHAIN_6(a, ...) CHAIN_STEP(a) && CHAIN_5(__VA_ARGS__)
+#define CHAIN_PICK(_1, _2, _3, _4, _5, _6, name, ...) name
+#define CHAIN(...) CHAIN_PICK(__VA_ARGS__, CHAIN_6, CHAIN_5, CHAIN_4, CHAIN_3, CHAIN_2, CHAIN_1)(__VA_ARGS__)
+
+#define ROUTE_CHAIN(name, method, path, handler, kind, arg, ...) \
+    static bool route_chain_##name(HttpRequest* req, HttpResponse* res) { return CHAIN(__VA_ARGS__); }
+ROUTE_TABLE(ROUTE_CHAIN)
+
+#define ROUTE_KIND_PLAIN(arg)
+#define ROUTE_KIND_CONSTANT(arg) .constant = true,
+#define ROUTE_KIND_CACHED(arg) .cache_ttl = (arg),
+#define ROUTE_KIND_BLOCKING(arg) .blocking = true,
+#define ROUTE_KIND_UPLOAD(arg) .body_reader = (arg),
+#define ROUTE_KIND_STATIC(arg) .ctx = (void*)(arg),
+
+#define ROUTE_ENTRY(name, m, p, h, kind, arg, ...) \
+    {.method = m, .path = p, .handler = h, .chain = route_chain_##name, ROUTE_KIND_##kind(arg)},
+static Route route_table[] = { ROUTE_TABLE(ROUTE_ENTRY) };
+
+// Seed the middleware registry and add the table routes (no allocation
+// beyond server.routes); must run before any register_middleware()
+static void install_route_table(void) {
+#define MIDDLEWARE_DEFINE(name) define_middleware(name##_middleware, #name);
+    MIDDLEWARE_TABLE(MIDDLEWARE_DEFINE)
+#undef MIDDLEWARE_DEFINE
+    for (size_t i = 0; i < sizeof(route_table) / sizeof(route_table[0]); i++) {
+        add_route(&route_table[i]);
+    }
+}
+
+void setup_routes() {
+    install_route_table();
+    
+    // Runtime routes (register_route() and friends) get these; none of the
+    // built-in routes is one, ROUTE_TABLE lists their chains
+    register_middleware(logger_middleware);
+    register_middleware(rate_limit_middleware); // Early: rejected requests cost little
+    register_middleware(cors_middleware);
+    register_group_middleware("/admin", auth_middleware);
+    
+    // 404/405: log and rate-limit (scanners), nothing else
+    register_miss_middleware(logger_middleware);
+    register_miss_middleware(rate_limit_middleware);
+    register_response_filter(compress_response); // Before cache_store: entries are stored compressed
+    register_response_filter(cache_store);
+    
+    router_compile();
+    
+    // From here on the tables are shared by all workers without locking
+    server.frozen = true;
+}
+
+// ============= Server Startup =============
+
+void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  -p, --port N          Listen port (default %d)\n"
+           "  -w, --workers N       Worker threads, 0 = one per CPU (default 1)\n"
+           "  -a, --affinity        Pin each worker to a CPU\n"
+           "  -k, --keepalive N     Idle keep-alive timeout in seconds (default 5)\n"
+           "      --header-timeout N Seconds to send a request head (default 10)\n"
+           "      --body-timeout N  Seconds a request body may stall (default 30)\n"
+           "      --write-timeout N Seconds a response may stall (default 30)\n"
+           "  -m, --max-requests N  Requests per connection (default 100)\n"
+           "  -c, --cache-mb N      Response cache budget in MB (default 16)\n"
+           "  -t, --threads N       Threads for blocking routes, 0 = inline (default 4)\n"
+           "  -b, --max-body N      Largest buffered request body in KB (default 1024)\n"
+           "      --tls-cert FILE   PEM certificate chain; serve TLS (build with TLS=1)\n"
+           "      --tls-key FILE    PEM private key for --tls-cert\n"
+           "      --backlog N       listen() backlog (default 1024)\n"
+           "      --max-conns N     Open connections, 0 = from the fd limit (default 0)\n"
+           "      --rate-limit N    Requests per second per client IP, 0 = off (default 0)\n"
+           "      --rate-burst N    Requests a client may burst, 0 = rate limit (default 0)\n"
+           "      --shed-ms N       Queue delay before answering 503, 0 = off (default 500)\n"
+           "      --trace-sample N  Trace one request in N per worker, 0 = off (default 0)\n"
+           "      --trace-slow MS   Keep sampled traces at least this slow (default 100)\n"
+           "      --handoff PATH    Unix socket for hot restarts (take over, or hand off on SIGHUP)\n"
+           "      --drain-timeout N Seconds to finish in-flight requests on shutdown (default 30)\n"
+           "      --io-uring        Use io_uring for sockets (Linux 6.1+, plain HTTP)\n"
+           "  -h, --help            Show this help\n",
+           prog, PORT);
+}
+
+void parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
         
-        close(client_sock);
+        if ((strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) && has_value) {
+            config.port = atoi(argv[++i]);
+        } else if ((strcmp(arg, "-w") == 0 || strcmp(arg, "--workers") == 0) && has_value) {
+            config.workers = atoi(argv[++i]);
+        } else if ((strcmp(arg, "-k") == 0 || strcmp(arg, "--keepalive") == 0) && has_value) {
+            config.keepalive_timeout = atoi(argv[++i]);
+        } else if ((strcmp(arg, "-m") == 0 || strcmp(arg, "--max-requests") == 0) && has_value) {
+            config.max_requests = atoi(argv[++i]);
+        } else if ((strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) && has_value) {
+            config.pool_threads = atoi(argv[++i]);
+        } else if ((strcmp(arg, "-b") == 0 || strcmp(arg, "--max-body") == 0) && has_value) {
+            long kb = atol(argv[++i]);
+            config.max_body = kb > 0 ? (size_t)kb * 1024 : 0;
+        } else if ((strcmp(arg, "-c") == 0 || strcmp(arg, "--cache-mb") == 0) && has_value) {
+            config.cache_mb = atoi(argv[++i]);
+        } else if (strcmp(arg, "--header-timeout") == 0 && has_value) {
+            config.header_timeout = atoi(argv[++i]);
+        } else if (strcmp(arg, "--body-timeout") == 0 && has_value) {
+            config.body_timeout = atoi(argv[++i]);
+        } else if (strcmp(arg, "--write-timeout") == 0 && has_value) {
+            config.write_timeout = atoi(argv[++i]);
+        } else if (strcmp(arg, "--backlog") == 0 && has_value) {
+            config.backlog = atoi(argv[++i]);
+        } else if (strcmp(arg, "--max-conns") == 0 && has_value) {
+            config.max_conns = atoi(argv[++i]);
+        } else if (strcmp(arg, "--rate-limit") == 0 && has_value) {
+            config.rate_limit = atoi(argv[++i]);
+        } else if (strcmp(arg, "--rate-burst") == 0 && has_value) {
+            config.rate_burst = atoi(argv[++i]);
+        } else if (strcmp(arg, "--shed-ms") == 0 && has_value) {
+            config.shed_ms = atoi(argv[++i]);
+        } else if (strcmp(arg, "--trace-sample") == 0 && has_value) {
+            config.trace_sample = atoi(argv[++i]);
+        } else if (strcmp(arg, "--trace-slow") == 0 && has_value) {
+            config.trace_slow_ms = atoi(argv[++i]);
+        } else if (strcmp(arg, "--handoff") == 0 && has_value) {
+            config.handoff = argv[++i];
+        } else if (strcmp(arg, "--drain-timeout") == 0 && has_value) {
+            config.drain_timeout = atoi(argv[++i]);
+        } else if (strcmp(arg, "--tls-cert") == 0 && has_value) {
+            config.tls_cert = argv[++i];
+        } else if (strcmp(arg, "--tls-key") == 0 && has_value) {
+            config.tls_key = argv[++i];
+        } else if (strcmp(arg, "-a") == 0 || strcmp(arg, "--affinity") == 0) {
+            config.cpu_affinity = true;
+        } else if (strcmp(arg, "--io-uring") == 0) {
+            config.io_uring = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    
+    if (config.workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (config.max_requests < 1) {
+        config.max_requests = 1;
+    }
+    if (config.cache_mb < 0) {
+        config.cache_mb = 0;
+    }
+    if (config.workers > MAX_WORKERS) {
+        config.workers = MAX_WORKERS;
+    }
+    if (config.keepalive_timeout < 1) {
+        config.keepalive_timeout = 1;
+    }
+    if (config.header_timeout < 1) {
+        config.header_timeout = 1;
+    }
+    if (config.body_timeout < 1) {
+        config.body_timeout = 1;
+    }
+    if (config.write_timeout < 1) {
+        config.write_timeout = 1;
     }
+    if (config.backlog < 1) {
+        config.backlog = 1;
+    }
+    if (config.max_conns <= 0) {
+        // Leave descriptors for listeners, event loops and the file cache,
+        // so the limit is hit before accept() starts failing with EMFILE
+        struct rlimit lim;
+        long fds = getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY
+                       ? (long)lim.rlim_cur : 1L << 20;
+        long reserved = FILE_CACHE_MAX + 4L * config.workers + 32;
+        config.max_conns = fds > reserved + 16 ? (int)(fds - reserved) : 16;
+    }
+    if (config.shed_ms < 0) {
+        config.shed_ms = 0;
+    }
+    if (config.trace_sample < 0) {
+        config.trace_sample = 0;
+    }
+    if (config.trace_slow_ms < 0) {
+        config.trace_slow_ms = 0;
+    }
+    if (config.drain_timeout < 0) {
+        config.drain_timeout = 0;
+    }
+}
+
+// bench/microbench.c includes this file with WEBSERVER_NO_MAIN defined
+#ifndef WEBSERVER_NO_MAIN
+static void signal_set(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGCHLD);
+}
+
+// SIGHUP: run argv again (the binary may have been replaced); the new
+// process finds our hand-off socket and takes over
+static void spawn_successor(char** argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t set;
+        signal_set(&set);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0) perror("fork");
+    else fprintf(stderr, "Started process %d to take over\n", (int)pid);
+}
+
+// Every thread blocks these signals (see main()); the main thread takes
+// them here and returns when it is time to drain
+static void serve_signals(char** argv) {
+    sigset_t set;
+    signal_set(&set);
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (sig == SIGINT || sig == SIGTERM) return;
+        if (sig == SIGCHLD) {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                fprintf(stderr, "Process %d exited before taking over (status %d)\n", (int)pid,
+                        WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            }
+        } else if (!config.handoff) {
+            fprintf(stderr, "SIGHUP ignored: restarts need --handoff PATH\n");
+        } else {
+            spawn_successor(argv);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    // sendfile() and OpenSSL's write() have no MSG_NOSIGNAL; a client that
+    // hangs up mid-body must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // Shutdown and restart signals go to serve_signals(); blocked before
+    // any thread starts, so every thread inherits the mask
+    sigset_t signals;
+    signal_set(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (!tls_init()) exit(1);
+    ring_init();
+    scan_init();
+    header_index_init();
+    response_cache_init();
+    cache_init();
+    
+    // Initialize server
+    setup_routes();
+    prerender_constant_routes();
+    
+    // Take over from a running server before binding anything. Every
+    // inherited listener has connections hashed to it, so each needs a worker.
+    int inherited[MAX_WORKERS];
+    int handoff_conn = -1;
+    int inherited_count = config.handoff ? handoff_receive(inherited, &handoff_conn) : 0;
+    if (inherited_count < 0) {
+        exit(1);
+    }
+    if (config.workers < inherited_count) {
+        config.workers = inherited_count;
+    }
+    
+    start_access_log();
+    blocking_pool_start(config.pool_threads);
+    
+    int started = 0;
+    for (int i = 0; i < config.workers; i++) {
+        if (!start_worker(&workers[i], i, i < inherited_count ? inherited[i] : -1)) break;
+        started++;
+    }
+    if (started == 0 || started < inherited_count) {
+        exit(1); // Before handoff_complete(): the running server carries on
+    }
+    workers_started = started;
     
-    close(server_sock);
+    printf("Server listening on port %d with %d worker%s%s...\n",
+           config.port, started, started == 1 ? "" : "s", config.io_uring ? " (io_uring)" : "");
+    printf("Visit %s://localhost:%d in your browser\n\n", tls_enabled() ? "https" : "http",
+           config.port);
+    fflush(stdout); // The access log writes to fd 1 directly from here on
+    if (handoff_conn >= 0) handoff_complete(handoff_conn);
+    if (config.handoff) handoff_listen();
+    
+    // The workers serve until a signal says to drain
+    serve_signals(argv);
+    fprintf(stderr, "Draining %d connection%s...\n",
+            atomic_load(&open_connections), atomic_load(&open_connections) == 1 ? "" : "s");
+    drain_start();
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (config.handoff && !atomic_load(&handed_off)) unlink(config.handoff);
+    access_log_sync();
     return 0;
 }
+#endif // WEBSERVER_NO_MAIN